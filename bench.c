@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "ems.h"
+#include "ems-util-crc32c.h"
+
+/* Microbenchmarks of the hot paths of the wire format. Each kernel processes
+ * cfg_megabytes MiB in chunks of the sizes below and reports the throughput.
+ * The array conversions are compared to loops over the per-element helpers. */
+
+size_t cfg_megabytes = 1024;
+
+static const size_t chunk_sizes[] = { 64, 1024, 65536 };
+
+/* Keep results alive, so the compiler cannot drop the work. */
+volatile uint32_t bench_sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, size_t chunk, size_t bytes, double seconds)
+{
+    double gb = bytes / 1e9;
+    printf("%-24s %6zu B  %8.2f GB/s  %8.4f s/GB\n", name, chunk, gb / seconds, seconds / gb);
+}
+
+static void bench_crc32c(const char *name, uint8_t *buffer, size_t length)
+{
+    size_t total = cfg_megabytes << 20;
+    size_t chunk, done, pos;
+    uint32_t crc = 0;
+    double start;
+    size_t j;
+
+    for (j = 0; j < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++j) {
+        chunk = chunk_sizes[j];
+        start = now();
+        for (done = 0, pos = 0; done < total; done += chunk, pos += chunk) {
+            if (pos + chunk > length)
+                pos = 0;
+            crc = ems_util_crc32c(crc, &buffer[pos], chunk);
+        }
+        report(name, chunk, done, now() - start);
+    }
+    bench_sink = crc;
+}
+
+typedef void (*BenchArrayFunc)(uint8_t *payload, void *values, size_t count);
+
+static void write_u32_loop(uint8_t *payload, void *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ems_message_write_u32(payload, 4 * j, ((uint32_t *)values)[j]);
+}
+
+static void write_u32_array(uint8_t *payload, void *values, size_t count)
+{
+    ems_message_write_u32_array(payload, 0, values, count);
+}
+
+static void read_u64_loop(uint8_t *payload, void *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ((uint64_t *)values)[j] = ems_message_read_u64(payload, 8 * j);
+}
+
+static void read_u64_array(uint8_t *payload, void *values, size_t count)
+{
+    ems_message_read_u64_array(payload, 0, values, count);
+}
+
+/* Convert between values and payload, both of length bytes, in chunks. The payload
+ * is placed at an odd address, as it usually is behind a header. */
+static void bench_array(const char *name, BenchArrayFunc func, size_t element_size,
+                        uint8_t *payload, void *values, size_t length)
+{
+    size_t total = cfg_megabytes << 20;
+    size_t chunk, done, pos;
+    double start;
+    size_t j;
+
+    for (j = 0; j < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++j) {
+        chunk = chunk_sizes[j];
+        start = now();
+        for (done = 0, pos = 0; done < total; done += chunk, pos += chunk) {
+            if (pos + chunk > length)
+                pos = 0;
+            func(&payload[pos + 1], (uint8_t *)values + pos, chunk / element_size);
+        }
+        report(name, chunk, done, now() - start);
+    }
+    bench_sink = payload[1] ^ ((uint8_t *)values)[0];
+}
+
+static void bench_arrays(uint8_t *payload, void *values, size_t length)
+{
+    static const struct {
+        EMSMessageBulkKernels kernels;
+        const char *write_name;
+        const char *read_name;
+    } kernels[] = {
+        { EMS_MESSAGE_BULK_AVX2,   "write_u32_array avx2",   "read_u64_array avx2" },
+        { EMS_MESSAGE_BULK_SSSE3,  "write_u32_array ssse3",  "read_u64_array ssse3" },
+        { EMS_MESSAGE_BULK_SCALAR, "write_u32_array scalar", "read_u64_array scalar" },
+    };
+    size_t j;
+
+    bench_array("write_u32 loop", write_u32_loop, 4, payload, values, length);
+    for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); ++j) {
+        if (ems_message_bulk_use_kernels(kernels[j].kernels) != EMS_OK) {
+            printf("%s: not supported\n", kernels[j].write_name);
+            continue;
+        }
+        bench_array(kernels[j].write_name, write_u32_array, 4, payload, values, length);
+    }
+
+    bench_array("read_u64 loop", read_u64_loop, 8, payload, values, length);
+    for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); ++j) {
+        if (ems_message_bulk_use_kernels(kernels[j].kernels) != EMS_OK) {
+            printf("%s: not supported\n", kernels[j].read_name);
+            continue;
+        }
+        bench_array(kernels[j].read_name, read_u64_array, 8, payload, values, length);
+    }
+}
+
+int parse_options(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        { "megabytes", required_argument, 0, 'm' },
+        { 0, 0, 0, 0 },
+    };
+
+    int c;
+    int option_index = 0;
+
+    while ((c = getopt_long(argc, argv, "m:", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'm':
+                cfg_megabytes = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    /* Large enough to leave the L1 cache, small enough to stay in L2. */
+    size_t length = 256 << 10;
+    uint8_t *buffer;
+    uint8_t *payload;
+    uint64_t *values;
+    size_t j;
+
+    if (parse_options(argc, argv) != 0) {
+        fprintf(stderr, "usage: %s [-m megabytes]\n", argv[0]);
+        return 1;
+    }
+
+    ems_init("EMSG");
+
+    buffer = malloc(length);
+    for (j = 0; j < length; ++j)
+        buffer[j] = (uint8_t)(j * 131 + 7);
+
+    if (ems_util_crc32c_use_hardware(1) == EMS_OK)
+        bench_crc32c("crc32c sse4.2", buffer, length);
+    else
+        printf("crc32c sse4.2: not supported\n");
+    ems_util_crc32c_use_hardware(0);
+    bench_crc32c("crc32c slicing-by-8", buffer, length);
+
+    /* The payload is one byte longer for its odd start. */
+    payload = calloc(1, length + 1);
+    values = malloc(length);
+    memcpy(values, buffer, length);
+    bench_arrays(payload, values, length);
+
+    free(values);
+    free(payload);
+    free(buffer);
+
+    return 0;
+}
@@ -10,14 +10,26 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <errno.h>
 /*#include <sys/un.h>*/
 #include "ems-messages-internal.h"
 #include "ems-error.h"
+#include "ems-util-crc32c.h"
 
 #ifdef DEBUG
 #include <stdio.h>
 #endif
 
+/* Size of the input buffer of a data socket. Payloads not fitting in are read directly. */
+#define EMS_SOCKET_INPUT_SIZE 16384
+
+/* Maximum number of messages written to a socket at once. */
+#define EMS_SOCKET_BATCH_MAX 64
+
+/* Default limit of the payload size of incoming frames. */
+#define EMS_SOCKET_MAX_FRAME_SIZE (64 << 20)
+
 typedef enum {
     _EMS_COMM_SOCKET_STATUS_CONTROL_PIPE   = (1 << 0), /* The control pipe is set up */
     _EMS_COMM_SOCKET_STATUS_THREAD_RUNNING = (1 << 1), /* The thread is running */
@@ -33,10 +45,9 @@ EMSSocketInfo *ems_communicator_socket_add_socket(EMSCommunicatorSocket *comm, i
     if (ems_unlikely(!comm) || sockfd < 0)
         return NULL;
 
-    EMSSocketInfo *sock_info = ems_alloc(sizeof(EMSSocketInfo));
+    EMSSocketInfo *sock_info = ems_alloc0(sizeof(EMSSocketInfo));
     sock_info->fd = sockfd;
     sock_info->type = type;
-    sock_info->id = 0;
 
     comm->socket_list = ems_list_prepend(comm->socket_list, sock_info);
 
@@ -48,6 +59,16 @@ EMSSocketInfo *ems_communicator_socket_add_socket(EMSCommunicatorSocket *comm, i
     return sock_info;
 }
 
+static
+void _ems_communicator_socket_info_free(EMSSocketInfo *sock_info)
+{
+    if (sock_info) {
+        ems_free(sock_info->input);
+        ems_free(sock_info->pending);
+        ems_free(sock_info);
+    }
+}
+
 static
 int _ems_communicator_socket_signal_event(EMSCommunicatorSocket *comm)
 {
@@ -73,13 +94,17 @@ int ems_communicator_socket_disconnect(EMSCommunicatorSocket *comm)
     return _ems_communicator_socket_signal_event(comm);
 }
 
-int ems_communicator_socket_send_message(EMSCommunicatorSocket *comm, EMSMessage *msg)
+int ems_communicator_socket_send_message(EMSCommunicatorSocket *comm, EMSMessage *msg, EMSMessagePriority priority)
 {
     /* signal incoming message to comm thread */
     if (ems_unlikely(!msg))
         return EMS_ERROR_INVALID_ARGUMENT;
     ems_message_ref(msg);
-    ems_message_queue_push_tail(&((EMSCommunicator *)comm)->msg_queue_outgoing, msg);
+    int rc = ems_message_queue_push_tail_with_priority(&((EMSCommunicator *)comm)->msg_queue_outgoing, msg, priority);
+    if (ems_unlikely(rc != EMS_OK)) {
+        ems_message_unref(msg);
+        return rc;
+    }
     return _ems_communicator_socket_signal_event(comm);
 }
 
@@ -126,9 +151,10 @@ int ems_communicator_socket_accept(EMSCommunicatorSocket *comm, int fd)
                                       new_id,
                                       EMS_MESSAGE_RECIPIENT_MASTER,
                                       "peer-id", new_id,
+                                      "wire-caps", comm->wire_caps,
                                       NULL, NULL);
 
-    ems_communicator_socket_send_message(comm, msg);
+    ems_communicator_socket_send_message(comm, msg, EMS_MESSAGE_PRIORITY_CONTROL);
 
     ems_message_unref(msg);
 
@@ -154,7 +180,7 @@ void ems_communicator_socket_disconnect_peers(EMSCommunicatorSocket *comm)
         if (si->type == EMS_SOCKET_TYPE_DATA || si->type == EMS_SOCKET_TYPE_MASTER) {
             epoll_ctl(comm->epoll_fd, EPOLL_CTL_DEL, si->fd, NULL);
             close(si->fd);
-            ems_free(si);
+            _ems_communicator_socket_info_free(si);
             comm->socket_list = ems_list_delete_link(comm->socket_list, active);
         }
         active = tmp;
@@ -173,7 +199,7 @@ void ems_communicator_socket_disconnect_peer(EMSCommunicatorSocket *comm, EMSSoc
         if (tmp->data == sock_info) {
             comm->socket_list = ems_list_delete_link(comm->socket_list, tmp);
             ems_communicator_remove_connection((EMSCommunicator *)comm, sock_info->id);
-            ems_free(sock_info);
+            _ems_communicator_socket_info_free(sock_info);
             break;
         }
     }
@@ -193,7 +219,7 @@ void ems_communicator_socket_close_connection(EMSCommunicatorSocket *comm, uint6
 
             comm->socket_list = ems_list_delete_link(comm->socket_list, tmp);
             ems_communicator_remove_connection((EMSCommunicator *)comm, sock_info->id);
-            ems_free(sock_info);
+            _ems_communicator_socket_info_free(sock_info);
             break;
         }
     }
@@ -211,57 +237,198 @@ EMSSocketInfo *_ems_communicator_socket_get_peer(EMSCommunicatorSocket *comm, ui
     return NULL;
 }
 
-/* Check for outgoing messages and deliver them to the peers. */
+/* Add an iovec for the message to be sent with the header agreed on for the connection.
+ * Frames with a checksum always use compact headers, which carry the flag announcing it. */
+static inline
+int _ems_communicator_socket_add_frame(EMSCommunicatorSocket *comm, EMSSocketFrame *frame, int compact, int compress,
+                                       int checksum, struct iovec *iov, uint8_t *header, size_t *length)
+{
+    size_t buflen;
+    const uint8_t *buffer = ems_message_encoding_get_frame(frame->encoding, compress, &buflen);
+
+    if (!compact) {
+        iov[0].iov_base = (void *)buffer;
+        iov[0].iov_len  = buflen;
+        *length += buflen;
+        return 1;
+    }
+
+    /* The receiver implies our id as sender. */
+    iov[0].iov_base = header;
+    iov[0].iov_len  = ems_message_write_compact_header(frame->msg, header,
+                                                       ems_message_read_u32((uint8_t *)buffer, EMS_MESSAGE_HEADER_SIZE - 4),
+                                                       ((EMSCommunicator *)comm)->peer_id, checksum);
+    iov[1].iov_base = (void *)(buffer + EMS_MESSAGE_HEADER_SIZE);
+    iov[1].iov_len  = buflen - EMS_MESSAGE_HEADER_SIZE;
+    *length += iov[0].iov_len + iov[1].iov_len;
+    return 2;
+}
+
+/* Append an iovec with the checksum of the count iovecs of a frame. */
+static inline
+int _ems_communicator_socket_add_checksum(struct iovec *iov, int count, uint8_t *trailer)
+{
+    uint32_t crc = 0;
+    int j;
+
+    for (j = 0; j < count; ++j)
+        crc = ems_util_crc32c(crc, iov[j].iov_base, iov[j].iov_len);
+    ems_message_write_u32(trailer, 0, crc);
+
+    iov[count].iov_base = trailer;
+    iov[count].iov_len  = EMS_MESSAGE_CHECKSUM_SIZE;
+    return 1;
+}
+
+/* The size of the pending frames with 28 byte headers, an upper bound for a batch. */
+static
+size_t _ems_communicator_socket_pending_size(EMSSocketInfo *peer, int compress)
+{
+    size_t length = 0;
+    size_t buflen;
+    size_t j;
+
+    for (j = 0; j < peer->pending_count; ++j) {
+        ems_message_encoding_get_frame(peer->pending[j].encoding, compress, &buflen);
+        length += buflen;
+    }
+    return length;
+}
+
+/* Write the messages collected for the peer with a single system call. Several messages
+ * are put in a batch frame if the peer supports it, otherwise the frames are just
+ * concatenated. The batch and the frames in it use the header agreed on for the
+ * connection. With checksums, a batch gets a single one covering all its messages.
+ * Batches exceeding the maximum frame size are not formed. */
+static
+ssize_t _ems_communicator_socket_write_pending(EMSCommunicatorSocket *comm, EMSSocketInfo *peer)
+{
+    struct iovec iov[3 * EMS_SOCKET_BATCH_MAX + 2];
+    uint8_t headers[EMS_SOCKET_BATCH_MAX + 1][EMS_MESSAGE_COMPACT_HEADER_MAX_SIZE];
+    uint8_t trailers[EMS_SOCKET_BATCH_MAX + 1][EMS_MESSAGE_CHECKSUM_SIZE];
+    int batch = peer->pending_count > 1 && (peer->wire_caps & EMS_WIRE_CAP_BATCH);
+    int checksum = (peer->wire_caps & EMS_WIRE_CAP_CHECKSUM) != 0;
+    int compact = checksum || (peer->wire_caps & EMS_WIRE_CAP_COMPACT_HEADER);
+    int compress = (peer->wire_caps & EMS_WIRE_CAP_COMPRESSION) != 0;
+    size_t length = 0;
+    int iovcnt;
+    int first;
+    size_t j;
+
+    if (batch && comm->max_frame_size)
+        batch = _ems_communicator_socket_pending_size(peer, compress) <= comm->max_frame_size;
+    iovcnt = batch ? 1 : 0;
+
+    for (j = 0; j < peer->pending_count; ++j) {
+        first = iovcnt;
+        iovcnt += _ems_communicator_socket_add_frame(comm, &peer->pending[j], compact, compress,
+                                                     checksum && !batch,
+                                                     &iov[iovcnt], headers[j + 1], &length);
+        if (checksum && !batch)
+            iovcnt += _ems_communicator_socket_add_checksum(&iov[first], iovcnt - first, trailers[j + 1]);
+    }
+
+    if (batch) {
+        EMSMessage header = {
+            .type = __EMS_MESSAGE_BATCH,
+            .recipient_id = peer->id,
+            .sender_id = ((EMSCommunicator *)comm)->peer_id,
+        };
+        iov[0].iov_base = headers[0];
+        if (compact)
+            iov[0].iov_len = ems_message_write_compact_header(&header, headers[0], length,
+                                                              ((EMSCommunicator *)comm)->peer_id, checksum);
+        else
+            iov[0].iov_len = ems_message_write_header(&header, headers[0], length);
+        if (checksum)
+            iovcnt += _ems_communicator_socket_add_checksum(iov, iovcnt, trailers[0]);
+    }
+
+    return ems_util_writev_full(peer->fd, iov, iovcnt);
+}
+
+static inline
+void _ems_communicator_socket_add_pending(EMSSocketInfo *peer, EMSMessage *msg, EMSMessageEncoding *encoding)
+{
+    if (ems_unlikely(!peer->pending))
+        peer->pending = ems_alloc(sizeof(EMSSocketFrame) * EMS_SOCKET_BATCH_MAX);
+    peer->pending[peer->pending_count].msg = msg;
+    peer->pending[peer->pending_count].encoding = encoding;
+    ++peer->pending_count;
+}
+
+/* Check for outgoing messages and deliver them to the peers. Up to EMS_SOCKET_BATCH_MAX
+ * waiting messages are drained per round and written to each peer at once. */
 static
 void _ems_communicator_socket_check_outgoing_messages(EMSCommunicatorSocket *comm)
 {
-    EMSMessage *msg;
+    EMSMessage *msgs[EMS_SOCKET_BATCH_MAX];
+    EMSMessageEncoding *encodings[EMS_SOCKET_BATCH_MAX];
     EMSSocketInfo *peer;
-    uint8_t *buffer = NULL;
-    size_t buflen;
     EMSList *tmp;
-    ssize_t rc;
+    size_t count, drained, j;
 
     EMSList *err_list = NULL;
 
-    while ((msg = ems_message_queue_pop_filtered(&((EMSCommunicator *)comm)->msg_queue_outgoing)) != NULL) {
-        buflen = ems_message_encode(msg, &buffer);
-        if (msg->recipient_id == EMS_MESSAGE_RECIPIENT_ALL) {
-            /* send to all */
-            for (tmp = comm->socket_list; tmp; tmp = tmp->next) {
-                peer = (EMSSocketInfo *)tmp->data;
-#ifdef DEBUG
-                fprintf(stderr, "[%d] Send message 0x%08x to %" PRIu64 "\n", getpid(), msg->type, peer->id);
-#endif
-                if (peer->type == EMS_SOCKET_TYPE_DATA) {
-                    if ((rc = ems_util_write_full(peer->fd, buffer, buflen)) <= 0) {
+    do {
+        drained = ems_message_queue_drain(&((EMSCommunicator *)comm)->msg_queue_outgoing,
+                                          msgs, EMS_SOCKET_BATCH_MAX);
+        count = 0;
+        for (j = 0; j < drained; ++j) {
+            /* The encoding is shared with other communicators sending the same message.
+             * Our reference keeps it alive while writing, even if the message is changed. */
+            if (ems_unlikely((encodings[count] = ems_message_get_encoding(msgs[j])) == NULL)) {
+                ems_message_unref(msgs[j]);
+                continue;
+            }
+            msgs[count] = msgs[j];
+            if (msgs[count]->recipient_id == EMS_MESSAGE_RECIPIENT_ALL) {
+                /* send to all */
+                for (tmp = comm->socket_list; tmp; tmp = tmp->next) {
+                    peer = (EMSSocketInfo *)tmp->data;
 #ifdef DEBUG
-                        fprintf(stderr, "[%d] write to %" PRIu64 " returned %ld\n", getpid(), peer->id, rc);
+                    fprintf(stderr, "[%d] Send message 0x%08x to %" PRIu64 "\n", getpid(), msgs[count]->type, peer->id);
 #endif
-                        err_list = ems_list_prepend(err_list, tmp->data);
-                    }
+                    if (peer->type == EMS_SOCKET_TYPE_DATA)
+                        _ems_communicator_socket_add_pending(peer, msgs[count], encodings[count]);
                 }
             }
-            /* remove hung up descriptors */
-            while (ems_unlikely(err_list != NULL)) {
-                tmp = err_list->next;
+            else {
+                /* find slave */
+                peer = _ems_communicator_socket_get_peer(comm, msgs[count]->recipient_id);
+                if (peer && peer->type == EMS_SOCKET_TYPE_DATA)
+                    _ems_communicator_socket_add_pending(peer, msgs[count], encodings[count]);
+            }
+            ++count;
+        }
+
+        for (tmp = comm->socket_list; tmp; tmp = tmp->next) {
+            peer = (EMSSocketInfo *)tmp->data;
+            if (peer->pending_count && _ems_communicator_socket_write_pending(comm, peer) <= 0) {
 #ifdef DEBUG
-                fprintf(stderr, "[%d] There have been descriptor errors: id=%u\n", getpid(), ((EMSSocketInfo *)err_list->data)->id);
+                fprintf(stderr, "[%d] write to %" PRIu64 " failed\n", getpid(), peer->id);
 #endif
-                ems_communicator_socket_disconnect_peer(comm, (EMSSocketInfo *)err_list->data);
-                ems_free(err_list);
-                err_list = tmp;
+                err_list = ems_list_prepend(err_list, peer);
             }
+            peer->pending_count = 0;
         }
-        else {
-            /* find slave */
-            peer = _ems_communicator_socket_get_peer(comm, msg->recipient_id);
-            if (peer && ems_util_write_full(peer->fd, buffer, buflen) < 0)
-                ems_communicator_socket_disconnect_peer(comm, peer);
+
+        /* remove hung up descriptors */
+        while (ems_unlikely(err_list != NULL)) {
+            tmp = err_list->next;
+#ifdef DEBUG
+            fprintf(stderr, "[%d] There have been descriptor errors: id=%u\n", getpid(), ((EMSSocketInfo *)err_list->data)->id);
+#endif
+            ems_communicator_socket_disconnect_peer(comm, (EMSSocketInfo *)err_list->data);
+            ems_free(err_list);
+            err_list = tmp;
         }
-        ems_free(buffer);
-        ems_message_unref(msg);
-    }
+
+        for (j = 0; j < count; ++j) {
+            ems_message_encoding_unref(encodings[j]);
+            ems_message_unref(msgs[j]);
+        }
+    } while (drained == EMS_SOCKET_BATCH_MAX);
 }
 
 static
@@ -270,63 +437,328 @@ void ems_communicator_socket_flush_outgoing_messages(EMSCommunicatorSocket *comm
     _ems_communicator_socket_check_outgoing_messages(comm);
 }
 
-/* Read an incoming message, decode it and push it to the message queue of the peer. */
+/* Agree on the wire capabilities. The slave accepts what both sides support when the
+ * master assigns its id, the master then takes over what the slave accepted.
+ * Frames are recognized by their first byte, so each side may switch at any time. */
+static
+void _ems_communicator_socket_negotiate(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info, EMSMessage *msg)
+{
+    EMSMessage *reply;
+    uint32_t caps;
+
+    if (msg->type == __EMS_MESSAGE_SET_ID) {
+        if ((caps = ((EMSMessageIntSetId *)msg)->wire_caps & comm->wire_caps) == 0)
+            return;
+        reply = ems_message_new(__EMS_MESSAGE_WIRE_CAPS,
+                                EMS_MESSAGE_RECIPIENT_MASTER,
+                                ((EMSMessageIntSetId *)msg)->peer_id,
+                                "wire-caps", caps,
+                                NULL, NULL);
+        ems_communicator_socket_send_message(comm, reply, EMS_MESSAGE_PRIORITY_CONTROL);
+        ems_message_unref(reply);
+        sock_info->wire_caps = caps;
+    }
+    else if (msg->type == __EMS_MESSAGE_WIRE_CAPS) {
+        sock_info->wire_caps = ((EMSMessageIntWireCaps *)msg)->wire_caps & comm->wire_caps;
+    }
+}
+
+static
+int _ems_communicator_socket_has_socket(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info)
+{
+    EMSList *tmp;
+    for (tmp = comm->socket_list; tmp; tmp = tmp->next) {
+        if (tmp->data == sock_info)
+            return 1;
+    }
+    return 0;
+}
+
+/* Pass a decoded message on. Returns EMS_ERROR_CONNECTION if handling the message
+ * closed the connection. */
+static
+int _ems_communicator_socket_dispatch_message(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info, EMSMessage *msg)
+{
+    if (msg->type == __EMS_MESSAGE_SET_ID || msg->type == __EMS_MESSAGE_WIRE_CAPS)
+        _ems_communicator_socket_negotiate(comm, sock_info, msg);
+
+    /* FIXME: Do we really need this distinction? Can’t we just push to the peer and
+     * let the peer handle this? */
+    if (msg->type == __EMS_MESSAGE_WIRE_CAPS || msg->type == __EMS_MESSAGE_BATCH) {
+        ems_message_unref(msg);
+    }
+    else if (EMS_MESSAGE_IS_INTERNAL(msg)) {
+        ems_communicator_handle_internal_message((EMSCommunicator *)comm, msg);
+        ems_message_unref(msg);
+        /* The connection may have been closed. */
+        if (!_ems_communicator_socket_has_socket(comm, sock_info))
+            return EMS_ERROR_CONNECTION;
+    }
+    else {
+        ems_communicator_push_messages((EMSCommunicator *)comm, &msg, 1);
+    }
+
+    return EMS_OK;
+}
+
+/* Decode the payload of msg from data, which stays with the caller. Returns
+ * EMS_ERROR_INVALID_ARGUMENT if a compressed payload cannot be decompressed or
+ * would exceed the maximum frame size. */
 static
-int _ems_communicator_socket_read_incoming_message(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info)
+int _ems_communicator_socket_decode_payload(EMSCommunicatorSocket *comm, EMSMessage *msg,
+                                            const uint8_t *data, size_t length, int compressed)
 {
-    uint8_t *buffer = ems_alloc(EMS_MESSAGE_HEADER_SIZE);
+    uint8_t *buffer;
 
+    if (compressed) {
+        if (ems_unlikely((buffer = ems_message_decompress_payload(msg, data, length, comm->max_frame_size,
+                                                                  &length)) == NULL))
+            return EMS_ERROR_INVALID_ARGUMENT;
+    }
+    else {
+        buffer = ems_message_alloc_payload(msg, length);
+        memcpy(buffer, data, length);
+    }
+
+    ems_message_decode_payload(msg, buffer, length);
+    ems_message_release_payload(msg, buffer);
+
+    return EMS_OK;
+}
+
+/* Decode and dispatch all messages of a batch frame. Batches are not nested.
+ * User messages are pushed to the peer in groups, internal ones are dispatched
+ * in order after the messages before them have been pushed. */
+static
+int _ems_communicator_socket_unpack_batch(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info,
+                                          uint8_t *data, size_t length)
+{
+    EMSMessageFrameInfo frame;
+    EMSMessage *msg;
+    EMSMessage *pending[EMS_SOCKET_BATCH_MAX];
+    size_t pending_count = 0;
+    size_t pos = 0;
+    int status = EMS_OK;
+
+    while (pos < length) {
+        status = ems_message_decode_frame_header(&data[pos], length - pos, sock_info->id, &msg, &frame);
+        if (ems_unlikely(status != EMS_OK && status != EMS_ERROR_MESSAGE_TYPE_UNKNOWN)) {
+            status = EMS_ERROR_INVALID_SOCKET;
+            break;
+        }
+        status = EMS_OK;
+        pos += frame.header_size;
+        /* The batch as a whole is checked. */
+        if (ems_unlikely(frame.payload_size > length - pos || frame.checksum)) {
+            ems_message_unref(msg);
+            status = EMS_ERROR_INVALID_SOCKET;
+            break;
+        }
+
+        if (msg && frame.payload_size && msg->type != __EMS_MESSAGE_BATCH &&
+                _ems_communicator_socket_decode_payload(comm, msg, &data[pos], frame.payload_size,
+                                                        frame.compressed) != EMS_OK) {
+            /* Drop the message, the frame is skipped anyway. */
+            ems_message_unref(msg);
+            msg = NULL;
+        }
+        pos += frame.payload_size;
+        if (!msg)
+            continue;
+
+        if (!EMS_MESSAGE_IS_INTERNAL(msg)) {
+            pending[pending_count++] = msg;
+            if (pending_count == EMS_SOCKET_BATCH_MAX) {
+                ems_communicator_push_messages((EMSCommunicator *)comm, pending, pending_count);
+                pending_count = 0;
+            }
+            continue;
+        }
+
+        if (pending_count) {
+            ems_communicator_push_messages((EMSCommunicator *)comm, pending, pending_count);
+            pending_count = 0;
+        }
+        if ((status = _ems_communicator_socket_dispatch_message(comm, sock_info, msg)) != EMS_OK)
+            break;
+    }
+
+    if (pending_count)
+        ems_communicator_push_messages((EMSCommunicator *)comm, pending, pending_count);
+
+    return status;
+}
+
+/* Handle a frame, whose payload is in data and stays with the caller. */
+static
+int _ems_communicator_socket_handle_frame(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info, EMSMessage *msg,
+                                          uint8_t *data, size_t length, int compressed)
+{
+    if (msg->type == __EMS_MESSAGE_BATCH) {
+        ems_message_unref(msg);
+        return _ems_communicator_socket_unpack_batch(comm, sock_info, data, length);
+    }
+
+    if (length && _ems_communicator_socket_decode_payload(comm, msg, data, length, compressed) != EMS_OK) {
+        /* Drop the message, the frame is skipped anyway. */
+        ems_message_unref(msg);
+        return EMS_OK;
+    }
+
+    return _ems_communicator_socket_dispatch_message(comm, sock_info, msg);
+}
+
+/* Check the checksum following the payload of a frame. */
+static inline
+int _ems_communicator_socket_check_frame(const uint8_t *header, size_t header_size,
+                                         const uint8_t *payload, size_t payload_size)
+{
+    uint32_t crc = ems_util_crc32c(ems_util_crc32c(0, header, header_size), payload, payload_size);
+    return crc == ems_message_read_u32((uint8_t *)payload, payload_size);
+}
+
+/* Decode a message, whose header starts the buffered input, and push it to the message
+ * queue of the peer. Returns EMS_ERROR_INCOMPLETE if the header is not buffered completely.
+ * The payload may be read directly from the socket.
+ */
+static
+int _ems_communicator_socket_handle_incoming_message(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info)
+{
+    EMSMessageFrameInfo frame;
+    EMSMessage *msg = NULL;
+    uint8_t *header = &sock_info->input[sock_info->input_start];
+    uint8_t *buffer;
+    size_t payload_size;
+    size_t frame_size;
+    size_t available;
     ssize_t rc;
-    if ((rc = ems_util_read_full(sock_info->fd, buffer, EMS_MESSAGE_HEADER_SIZE)) <= 0) {
-#ifdef DEBUG
-        fprintf(stderr, "[%d] read_full returned %ld\n", getpid(), rc);
-#endif
-        ems_free(buffer);
+    int direct;
+    int status;
+
+    status = ems_message_decode_frame_header(&sock_info->input[sock_info->input_start],
+                                             sock_info->input_end - sock_info->input_start,
+                                             sock_info->id, &msg, &frame);
+    if (status == EMS_ERROR_INCOMPLETE)
+        return status;
+    if (ems_unlikely(status != EMS_OK && status != EMS_ERROR_MESSAGE_TYPE_UNKNOWN))
+        return EMS_ERROR_INVALID_SOCKET;
+
+    /* The length is only covered by the checksum following the payload, so a corrupted
+     * one must not make us allocate or wait for an absurd amount of data. */
+    payload_size = frame.payload_size;
+    if (ems_unlikely(comm->max_frame_size && payload_size > comm->max_frame_size)) {
+        ems_message_unref(msg);
         return EMS_ERROR_INVALID_SOCKET;
     }
+    frame_size = payload_size + (frame.checksum ? EMS_MESSAGE_CHECKSUM_SIZE : 0);
+    sock_info->input_start += frame.header_size;
+    available = sock_info->input_end - sock_info->input_start;
+    if (available > frame_size)
+        available = frame_size;
+
+    if (ems_unlikely(!msg)) {
+        /* Skip the frame of an unknown message type. */
+        sock_info->input_start += available;
+        frame_size -= available;
+        while (frame_size) {
+            rc = read(sock_info->fd, sock_info->input,
+                      frame_size < EMS_SOCKET_INPUT_SIZE ? frame_size : EMS_SOCKET_INPUT_SIZE);
+            if (rc <= 0)
+                return EMS_ERROR_INVALID_SOCKET;
+            frame_size -= rc;
+        }
+        return EMS_OK;
+    }
 
-    size_t payload_size = 0;
-/*    fprintf(stderr, "[%d] msgheader: "
-                    "%02x %02x %02x %02x %02x %02x %02x %02x "
-                    "%02x %02x %02x %02x %02x %02x %02x %02x "
-                    "%02x %02x %02x %02x\n", getpid(),
-                    buffer[0], buffer[1], buffer[2], buffer[3],
-                    buffer[4], buffer[5], buffer[6], buffer[7],
-                    buffer[8], buffer[9], buffer[10], buffer[11],
-                    buffer[12], buffer[13], buffer[14], buffer[15],
-                    buffer[16], buffer[17], buffer[18], buffer[19]);*/
+    if (available == frame_size && (frame.compressed || frame.checksum || msg->type == __EMS_MESSAGE_BATCH)) {
+        /* Check, unpack or decompress right from the input buffer. */
+        buffer = &sock_info->input[sock_info->input_start];
+        sock_info->input_start += frame_size;
+        if (frame.checksum && !_ems_communicator_socket_check_frame(header, frame.header_size, buffer, payload_size)) {
+            ems_message_unref(msg);
+            return EMS_ERROR_INVALID_SOCKET;
+        }
+        return _ems_communicator_socket_handle_frame(comm, sock_info, msg, buffer, payload_size, frame.compressed);
+    }
 
-    EMSMessage *msg = ems_message_decode_header(buffer, rc, &payload_size);
-    if (!msg)
-        return EMS_ERROR_INVALID_ARGUMENT;
+    if (frame_size) {
+        /* Only a plain payload is read into the buffer the message may keep. The header
+         * stays in the input buffer meanwhile. */
+        direct = !frame.compressed && !frame.checksum && msg->type != __EMS_MESSAGE_BATCH;
+        buffer = direct ? ems_message_alloc_payload(msg, frame_size) : ems_alloc(frame_size);
 
-    ems_free(buffer);
-    if (payload_size) {
-        buffer = ems_alloc(payload_size);
+        memcpy(buffer, &sock_info->input[sock_info->input_start], available);
+        sock_info->input_start += available;
 
-        if ((rc = ems_util_read_full(sock_info->fd, buffer, payload_size)) <= 0) {
+        if (available < frame_size &&
+                (rc = ems_util_read_full(sock_info->fd, &buffer[available], frame_size - available)) <= 0) {
 #ifdef DEBUG
             fprintf(stderr, "[%d] read_full returned %ld\n", getpid(), rc);
 #endif
+            if (direct)
+                ems_message_release_payload(msg, buffer);
+            else
+                ems_free(buffer);
             ems_message_unref(msg);
-            ems_free(buffer);
             return EMS_ERROR_INVALID_SOCKET;
         }
 
+        if (!direct) {
+            if (frame.checksum && !_ems_communicator_socket_check_frame(header, frame.header_size, buffer, payload_size)) {
+                ems_free(buffer);
+                ems_message_unref(msg);
+                return EMS_ERROR_INVALID_SOCKET;
+            }
+            status = _ems_communicator_socket_handle_frame(comm, sock_info, msg, buffer, payload_size,
+                                                           frame.compressed);
+            ems_free(buffer);
+            return status;
+        }
+
         ems_message_decode_payload(msg, buffer, payload_size);
-        ems_free(buffer);
+        ems_message_release_payload(msg, buffer);
     }
 
-    /* FIXME: Do we really need this distinction? Can’t we just push to the peer and
-     * let the peer handle this? */
-    if (EMS_MESSAGE_IS_INTERNAL(msg)) {
-        ems_communicator_handle_internal_message((EMSCommunicator *)comm, msg);
-        ems_message_unref(msg);
+    return _ems_communicator_socket_dispatch_message(comm, sock_info, msg);
+}
+
+/* Read what is available from the socket and handle all complete messages. */
+static
+int _ems_communicator_socket_read_incoming_messages(EMSCommunicatorSocket *comm, EMSSocketInfo *sock_info)
+{
+    ssize_t rc;
+    int status;
+
+    if (ems_unlikely(!sock_info->input))
+        sock_info->input = ems_alloc(EMS_SOCKET_INPUT_SIZE);
+
+    /* Move the beginning of a message to the front. */
+    if (sock_info->input_start) {
+        memmove(sock_info->input, &sock_info->input[sock_info->input_start],
+                sock_info->input_end - sock_info->input_start);
+        sock_info->input_end -= sock_info->input_start;
+        sock_info->input_start = 0;
     }
-    else {
-        ems_peer_push_message(((EMSCommunicator *)comm)->peer, msg);
+
+    rc = read(sock_info->fd, &sock_info->input[sock_info->input_end], EMS_SOCKET_INPUT_SIZE - sock_info->input_end);
+    if (rc <= 0) {
+        if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+            return EMS_OK;
+#ifdef DEBUG
+        fprintf(stderr, "[%d] read returned %ld\n", getpid(), rc);
+#endif
+        return EMS_ERROR_INVALID_SOCKET;
+    }
+    sock_info->input_end += rc;
+
+    while (sock_info->input_start < sock_info->input_end) {
+        if ((status = _ems_communicator_socket_handle_incoming_message(comm, sock_info)) != EMS_OK)
+            return status == EMS_ERROR_INCOMPLETE || status == EMS_ERROR_CONNECTION ? EMS_OK : status;
     }
 
+    sock_info->input_start = 0;
+    sock_info->input_end = 0;
+
     return EMS_OK;
 }
 
@@ -371,7 +803,7 @@ void *ems_communicator_socket_comm_thread(EMSCommunicatorSocket *comm)
                         /* FIXME: if we got no bye message and we are a slave, try to reconnect */
                     }
                     else if (incoming[j].events & EPOLLIN) {
-                        rc = _ems_communicator_socket_read_incoming_message(comm, sock_info);
+                        rc = _ems_communicator_socket_read_incoming_messages(comm, sock_info);
                         if (rc == EMS_ERROR_INVALID_SOCKET) {
                             ems_communicator_socket_disconnect_peer(comm, sock_info);
                         }
@@ -444,8 +876,14 @@ int ems_communicator_socket_init(EMSCommunicatorSocket *comm)
 
     atomic_fetch_or(&comm->comm_socket_status, _EMS_COMM_SOCKET_STATUS_CONTROL_PIPE);
 
-    ems_message_queue_init(&((EMSCommunicator *)comm)->msg_queue_outgoing);
-    ems_message_queue_init(&((EMSCommunicator *)comm)->msg_queue_incoming);
+    comm->wire_caps = EMS_WIRE_CAP_BATCH | EMS_WIRE_CAP_COMPRESSION;
+    comm->max_frame_size = EMS_SOCKET_MAX_FRAME_SIZE;
+
+    /* Any thread may send, only the comm thread takes messages off the queue. Of the
+     * messages of conflated types, only the latest one per key is waiting there. */
+    ems_message_queue_init_full(&((EMSCommunicator *)comm)->msg_queue_outgoing,
+                                EMS_MESSAGE_QUEUE_MPSC | EMS_MESSAGE_QUEUE_CONFLATE);
+    ems_message_queue_init_full(&((EMSCommunicator *)comm)->msg_queue_incoming, EMS_MESSAGE_QUEUE_CONFLATE);
 
     return EMS_OK;
 }
@@ -458,6 +896,33 @@ void ems_communicator_socket_set_value(EMSCommunicatorSocket *comm, const char *
         /* FIXME: set role -> possibly disconnect slaves and close listen socket (master->slave) */
         ((EMSCommunicator *)comm)->role = EMS_UTIL_POINTER_TO_INT(value);
     }
+    else if (!strcmp(key, "compact-header")) {
+        if (EMS_UTIL_POINTER_TO_INT(value))
+            comm->wire_caps |= EMS_WIRE_CAP_COMPACT_HEADER;
+        else
+            comm->wire_caps &= ~EMS_WIRE_CAP_COMPACT_HEADER;
+    }
+    else if (!strcmp(key, "batch")) {
+        if (EMS_UTIL_POINTER_TO_INT(value))
+            comm->wire_caps |= EMS_WIRE_CAP_BATCH;
+        else
+            comm->wire_caps &= ~EMS_WIRE_CAP_BATCH;
+    }
+    else if (!strcmp(key, "compression")) {
+        if (EMS_UTIL_POINTER_TO_INT(value))
+            comm->wire_caps |= EMS_WIRE_CAP_COMPRESSION;
+        else
+            comm->wire_caps &= ~EMS_WIRE_CAP_COMPRESSION;
+    }
+    else if (!strcmp(key, "checksum")) {
+        if (EMS_UTIL_POINTER_TO_INT(value))
+            comm->wire_caps |= EMS_WIRE_CAP_CHECKSUM;
+        else
+            comm->wire_caps &= ~EMS_WIRE_CAP_CHECKSUM;
+    }
+    else if (!strcmp(key, "max-frame-size")) {
+        comm->max_frame_size = EMS_UTIL_POINTER_TO_SIZE(value);
+    }
     else {
         fprintf(stderr, "EMSCommunicatorSocket: Unknown key: %s\n", key);
     }
@@ -487,7 +952,7 @@ void ems_communicator_socket_clear(EMSCommunicatorSocket *comm)
         atomic_fetch_and(&comm->comm_socket_status, ~_EMS_COMM_SOCKET_STATUS_CONTROL_PIPE);
     }
 
-    ems_list_free_full(comm->socket_list, (EMSDestroyNotifyFunc)ems_free);
+    ems_list_free_full(comm->socket_list, (EMSDestroyNotifyFunc)_ems_communicator_socket_info_free);
     comm->socket_list = NULL;
 
     ems_message_queue_clear(&((EMSCommunicator *)comm)->msg_queue_outgoing);
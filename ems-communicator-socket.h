@@ -35,6 +35,12 @@ typedef enum {
     EMS_SOCKET_TYPE_DATA
 } EMSSocketType;
 
+/* A message to be written and the reference to its encoding held meanwhile. */
+typedef struct {
+    EMSMessage *msg;
+    EMSMessageEncoding *encoding;
+} EMSSocketFrame;
+
 /* Information about a socket/file descriptor. */
 typedef struct {
     /* The file descriptor. */
@@ -45,6 +51,18 @@ typedef struct {
 
     /* The id of the remote peer if this is a data socket. */
     uint64_t id;
+
+    /* The wire capabilities agreed on with the remote peer, see EMS_WIRE_CAP_*. */
+    uint32_t wire_caps;
+
+    /* Data read from the socket, but not handled yet, is input[input_start..input_end). */
+    uint8_t *input;
+    size_t input_start;
+    size_t input_end;
+
+    /* Outgoing messages collected for this socket, to be written at once. */
+    EMSSocketFrame *pending;
+    size_t pending_count;
 } EMSSocketInfo;
 
 typedef struct _EMSCommunicatorSocket EMSCommunicatorSocket;
@@ -89,6 +107,20 @@ struct _EMSCommunicatorSocket {
 
     /* Internal status of the communicator. */
     atomic_uint comm_socket_status;
+
+    /* The wire capabilities we support, offered by the master and accepted by the slave.
+     * Set "compact-header" to a non-zero value to enable compact message headers.
+     * Batch frames and payload compression are enabled by default and may be disabled
+     * by setting "batch" or "compression" to 0. Set "checksum" to protect each frame
+     * with a CRC32C, a mismatch closes the connection. Checksums imply compact headers,
+     * otherwise the 28 byte header is used, also within batches. */
+    uint32_t wire_caps;
+
+    /* Frames announcing a larger payload (including batches) close the connection
+     * before anything is allocated or read for them. The default is 64 MiB, set
+     * "max-frame-size" to change it, 0 only keeps the limit of the wire format.
+     * Both sides should use the same value, batches are kept below it. */
+    size_t max_frame_size;
 };
 
 /* Initialize the communicator. Set up values and functions common to all derived communicators. */
@@ -106,4 +138,4 @@ void ems_communicator_socket_clear(EMSCommunicatorSocket *comm);
 int ems_communicator_socket_run_thread(EMSCommunicatorSocket *comm);
 
 /* Send a message over this communicator to all matching peers. */
-int ems_communicator_socket_send_message(EMSCommunicatorSocket *comm, EMSMessage *msg);
+int ems_communicator_socket_send_message(EMSCommunicatorSocket *comm, EMSMessage *msg, EMSMessagePriority priority);
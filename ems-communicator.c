@@ -84,10 +84,17 @@ void ems_communicator_set_role(EMSCommunicator *comm, EMSPeerRole role)
 
 void ems_communicator_destroy(EMSCommunicator *comm)
 {
+    EMSPeer *peer = comm ? comm->peer : NULL;
+    EMSMessageQueueRing *ring = comm ? comm->peer_ring : NULL;
+
     if (comm && comm->destroy)
         comm->destroy(comm);
     else
         ems_free(comm);
+
+    /* The thread of the communicator is done now. */
+    if (ring)
+        ems_message_queue_remove_ring(&peer->msgqueue, ring);
 }
 
 int ems_communicator_connect(EMSCommunicator *comm)
@@ -105,13 +112,35 @@ int ems_communicator_disconnect(EMSCommunicator *comm)
 }
 
 int ems_communicator_send_message(EMSCommunicator *comm, EMSMessage *msg)
+{
+    return ems_communicator_send_message_with_priority(comm, msg, EMS_MESSAGE_PRIORITY_DEFAULT);
+}
+
+int ems_communicator_send_message_with_priority(EMSCommunicator *comm, EMSMessage *msg, EMSMessagePriority priority)
 {
     if (comm && comm->send_message) {
-        return comm->send_message(comm, msg);
+        return comm->send_message(comm, msg, priority);
     }
     return -1;
 }
 
+void ems_communicator_push_messages(EMSCommunicator *comm, EMSMessage **msgs, size_t count)
+{
+    size_t j;
+
+    if (ems_unlikely(!comm || !comm->peer))
+        return;
+
+    if (ems_likely(comm->peer_ring != NULL)) {
+        j = ems_message_queue_ring_push_many(comm->peer_ring, msgs, count);
+        for (; j < count; ++j)
+            ems_message_unref(msgs[j]);
+    }
+    else {
+        ems_peer_push_messages(comm->peer, msgs, count);
+    }
+}
+
 void ems_communicator_close_connection(EMSCommunicator *comm, uint64_t peer_id)
 {
     if (comm && comm->close_connection)
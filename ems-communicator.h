@@ -24,7 +24,7 @@ typedef struct _EMSCommunicator EMSCommunicator;
 /* Type definitions for the communicator class. */
 typedef int (*EMSCommunicatorConnect)(EMSCommunicator *);
 typedef int (*EMSCommunicatorDisconnect)(EMSCommunicator *);
-typedef int (*EMSCommunicatorSendMessage)(EMSCommunicator *, EMSMessage *);
+typedef int (*EMSCommunicatorSendMessage)(EMSCommunicator *, EMSMessage *, EMSMessagePriority);
 typedef void (*EMSCommunicatorDestroy)(EMSCommunicator *);
 typedef void (*EMSCommunicatorHandleInternalMessage)(EMSCommunicator *, EMSMessage *);
 typedef void (*EMSCommunicatorCloseConnection)(EMSCommunicator *, uint64_t);
@@ -75,6 +75,10 @@ struct _EMSCommunicator {
     /* Message queues for outgoing and incoming messages. */
     EMSMessageQueue msg_queue_outgoing;
     EMSMessageQueue msg_queue_incoming;
+
+    /* The ring feeding the message queue of the peer, only the thread of the
+     * communicator pushes to it. */
+    EMSMessageQueueRing *peer_ring;
 };
 
 /* Create a new communicator of the given type. */
@@ -89,6 +93,10 @@ void ems_communicator_set_role(EMSCommunicator *comm, EMSPeerRole role);
 /* Destroy the communicator. */
 void ems_communicator_destroy(EMSCommunicator *comm);
 
+/* Pass received messages on to the peer. This must only be called from the thread
+ * of the communicator. */
+void ems_communicator_push_messages(EMSCommunicator *comm, EMSMessage **msgs, size_t count);
+
 /* Inform the communicator and the peer about a new connection. */
 void ems_communicator_add_connection(EMSCommunicator *comm);
 
@@ -104,6 +112,9 @@ int ems_communicator_disconnect(EMSCommunicator *comm);
 /* Send a message to all connected peers. */
 int ems_communicator_send_message(EMSCommunicator *comm, EMSMessage *msg);
 
+/* Send a message, overriding the priority of its class in the outgoing queue. */
+int ems_communicator_send_message_with_priority(EMSCommunicator *comm, EMSMessage *msg, EMSMessagePriority priority);
+
 /* Handle an internal message. */
 void ems_communicator_handle_internal_message(EMSCommunicator *comm, EMSMessage *msg);
 
@@ -30,3 +30,15 @@
 
 /* Writing failed. */
 #define EMS_ERROR_WRITE_FAILED                          9
+
+/* More data is needed, e.g., to decode a message header. */
+#define EMS_ERROR_INCOMPLETE                            10
+
+/* The message type has not been registered. */
+#define EMS_ERROR_MESSAGE_TYPE_UNKNOWN                  11
+
+/* We try to register a compressor with an id that is already in use. */
+#define EMS_ERROR_COMPRESSOR_EXISTS                     12
+
+/* The message queue has reached its limits. */
+#define EMS_ERROR_QUEUE_FULL                            13
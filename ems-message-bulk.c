@@ -0,0 +1,294 @@
+/* Conversion of whole arrays between host and payload byte order.
+ * The per-element helpers in ems-message.h reverse the bytes of each 32 bit
+ * word (64 bit values are written as two such words, low word first). On little
+ * endian x86 this is a plain byte swap of 16 or 32 bit words, which is done
+ * with SSSE3 or AVX2 shuffles if the CPU supports it. Everywhere else we just
+ * loop over the per-element helpers.
+ */
+#include "ems-message.h"
+#include "ems-error.h"
+#include <memory.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define EMS_MESSAGE_BULK_SIMD 1
+#include <immintrin.h>
+#endif
+
+#ifdef EMS_MESSAGE_BULK_SIMD
+
+typedef void (*EMSMessageBulkSwapFunc)(uint8_t *, const uint8_t *, size_t);
+
+/* Swap count 16 bit words from src to dst. */
+static
+void _ems_message_swap16_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    uint16_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        memcpy(&value, &src[2 * j], 2);
+        value = __builtin_bswap16(value);
+        memcpy(&dst[2 * j], &value, 2);
+    }
+}
+
+/* Swap count 32 bit words from src to dst. */
+static
+void _ems_message_swap32_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    uint32_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        memcpy(&value, &src[4 * j], 4);
+        value = __builtin_bswap32(value);
+        memcpy(&dst[4 * j], &value, 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static
+void _ems_message_swap16_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[2 * j]);
+        _mm_storeu_si128((__m128i *)&dst[2 * j], _mm_shuffle_epi8(v, mask));
+    }
+    _ems_message_swap16_scalar(&dst[2 * j], &src[2 * j], count - j);
+}
+
+__attribute__((target("ssse3")))
+static
+void _ems_message_swap32_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[4 * j]);
+        _mm_storeu_si128((__m128i *)&dst[4 * j], _mm_shuffle_epi8(v, mask));
+    }
+    _ems_message_swap32_scalar(&dst[4 * j], &src[4 * j], count - j);
+}
+
+__attribute__((target("avx2")))
+static
+void _ems_message_swap16_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t j = 0;
+    for (; j + 32 <= count; j += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&src[2 * j]);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)&src[2 * j + 32]);
+        _mm256_storeu_si256((__m256i *)&dst[2 * j], _mm256_shuffle_epi8(v0, mask));
+        _mm256_storeu_si256((__m256i *)&dst[2 * j + 32], _mm256_shuffle_epi8(v1, mask));
+    }
+    for (; j + 16 <= count; j += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[2 * j]);
+        _mm256_storeu_si256((__m256i *)&dst[2 * j], _mm256_shuffle_epi8(v, mask));
+    }
+    _ems_message_swap16_scalar(&dst[2 * j], &src[2 * j], count - j);
+}
+
+__attribute__((target("avx2")))
+static
+void _ems_message_swap32_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t j = 0;
+    for (; j + 16 <= count; j += 16) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&src[4 * j]);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)&src[4 * j + 32]);
+        _mm256_storeu_si256((__m256i *)&dst[4 * j], _mm256_shuffle_epi8(v0, mask));
+        _mm256_storeu_si256((__m256i *)&dst[4 * j + 32], _mm256_shuffle_epi8(v1, mask));
+    }
+    for (; j + 8 <= count; j += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[4 * j]);
+        _mm256_storeu_si256((__m256i *)&dst[4 * j], _mm256_shuffle_epi8(v, mask));
+    }
+    _ems_message_swap32_scalar(&dst[4 * j], &src[4 * j], count - j);
+}
+
+static EMSMessageBulkSwapFunc _ems_message_swap16 = _ems_message_swap16_scalar;
+static EMSMessageBulkSwapFunc _ems_message_swap32 = _ems_message_swap32_scalar;
+
+/* Choose the kernels once when the library is loaded. */
+__attribute__((constructor))
+static
+void _ems_message_bulk_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _ems_message_swap16 = _ems_message_swap16_avx2;
+        _ems_message_swap32 = _ems_message_swap32_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        _ems_message_swap16 = _ems_message_swap16_ssse3;
+        _ems_message_swap32 = _ems_message_swap32_ssse3;
+    }
+}
+
+int ems_message_bulk_use_kernels(EMSMessageBulkKernels kernels)
+{
+    switch (kernels) {
+        case EMS_MESSAGE_BULK_SCALAR:
+            _ems_message_swap16 = _ems_message_swap16_scalar;
+            _ems_message_swap32 = _ems_message_swap32_scalar;
+            return EMS_OK;
+        case EMS_MESSAGE_BULK_SSSE3:
+            if (!__builtin_cpu_supports("ssse3"))
+                break;
+            _ems_message_swap16 = _ems_message_swap16_ssse3;
+            _ems_message_swap32 = _ems_message_swap32_ssse3;
+            return EMS_OK;
+        case EMS_MESSAGE_BULK_AVX2:
+            if (!__builtin_cpu_supports("avx2"))
+                break;
+            _ems_message_swap16 = _ems_message_swap16_avx2;
+            _ems_message_swap32 = _ems_message_swap32_avx2;
+            return EMS_OK;
+    }
+    return EMS_ERROR_INVALID_ARGUMENT;
+}
+
+void ems_message_write_u16_array(uint8_t *payload, uint32_t offset, const uint16_t *values, size_t count)
+{
+    _ems_message_swap16(&payload[offset], (const uint8_t *)values, count);
+}
+
+void ems_message_write_u32_array(uint8_t *payload, uint32_t offset, const uint32_t *values, size_t count)
+{
+    _ems_message_swap32(&payload[offset], (const uint8_t *)values, count);
+}
+
+void ems_message_write_u64_array(uint8_t *payload, uint32_t offset, const uint64_t *values, size_t count)
+{
+    _ems_message_swap32(&payload[offset], (const uint8_t *)values, 2 * count);
+}
+
+void ems_message_write_float_array(uint8_t *payload, uint32_t offset, const float *values, size_t count)
+{
+    _ems_message_swap32(&payload[offset], (const uint8_t *)values, count);
+}
+
+void ems_message_write_double_array(uint8_t *payload, uint32_t offset, const double *values, size_t count)
+{
+    _ems_message_swap32(&payload[offset], (const uint8_t *)values, 2 * count);
+}
+
+void ems_message_read_u16_array(uint8_t *payload, uint32_t offset, uint16_t *values, size_t count)
+{
+    _ems_message_swap16((uint8_t *)values, &payload[offset], count);
+}
+
+void ems_message_read_u32_array(uint8_t *payload, uint32_t offset, uint32_t *values, size_t count)
+{
+    _ems_message_swap32((uint8_t *)values, &payload[offset], count);
+}
+
+void ems_message_read_u64_array(uint8_t *payload, uint32_t offset, uint64_t *values, size_t count)
+{
+    _ems_message_swap32((uint8_t *)values, &payload[offset], 2 * count);
+}
+
+void ems_message_read_float_array(uint8_t *payload, uint32_t offset, float *values, size_t count)
+{
+    _ems_message_swap32((uint8_t *)values, &payload[offset], count);
+}
+
+void ems_message_read_double_array(uint8_t *payload, uint32_t offset, double *values, size_t count)
+{
+    _ems_message_swap32((uint8_t *)values, &payload[offset], 2 * count);
+}
+
+#else /* !EMS_MESSAGE_BULK_SIMD */
+
+void ems_message_write_u16_array(uint8_t *payload, uint32_t offset, const uint16_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ems_message_write_u16(payload, offset + 2 * j, values[j]);
+}
+
+void ems_message_write_u32_array(uint8_t *payload, uint32_t offset, const uint32_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ems_message_write_u32(payload, offset + 4 * j, values[j]);
+}
+
+void ems_message_write_u64_array(uint8_t *payload, uint32_t offset, const uint64_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        ems_message_write_u64(payload, offset + 8 * j, values[j]);
+}
+
+void ems_message_write_float_array(uint8_t *payload, uint32_t offset, const float *values, size_t count)
+{
+    uint32_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        memcpy(&value, &values[j], 4);
+        ems_message_write_u32(payload, offset + 4 * j, value);
+    }
+}
+
+void ems_message_write_double_array(uint8_t *payload, uint32_t offset, const double *values, size_t count)
+{
+    uint64_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        memcpy(&value, &values[j], 8);
+        ems_message_write_u64(payload, offset + 8 * j, value);
+    }
+}
+
+void ems_message_read_u16_array(uint8_t *payload, uint32_t offset, uint16_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        values[j] = ems_message_read_u16(payload, offset + 2 * j);
+}
+
+void ems_message_read_u32_array(uint8_t *payload, uint32_t offset, uint32_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        values[j] = ems_message_read_u32(payload, offset + 4 * j);
+}
+
+void ems_message_read_u64_array(uint8_t *payload, uint32_t offset, uint64_t *values, size_t count)
+{
+    size_t j;
+    for (j = 0; j < count; ++j)
+        values[j] = ems_message_read_u64(payload, offset + 8 * j);
+}
+
+void ems_message_read_float_array(uint8_t *payload, uint32_t offset, float *values, size_t count)
+{
+    uint32_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        value = ems_message_read_u32(payload, offset + 4 * j);
+        memcpy(&values[j], &value, 4);
+    }
+}
+
+void ems_message_read_double_array(uint8_t *payload, uint32_t offset, double *values, size_t count)
+{
+    uint64_t value;
+    size_t j;
+    for (j = 0; j < count; ++j) {
+        value = ems_message_read_u64(payload, offset + 8 * j);
+        memcpy(&values[j], &value, 8);
+    }
+}
+
+int ems_message_bulk_use_kernels(EMSMessageBulkKernels kernels)
+{
+    return kernels == EMS_MESSAGE_BULK_SCALAR ? EMS_OK : EMS_ERROR_INVALID_ARGUMENT;
+}
+
+#endif /* EMS_MESSAGE_BULK_SIMD */
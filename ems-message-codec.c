@@ -0,0 +1,455 @@
+#include "ems-message-codec.h"
+#include "ems-message-private.h"
+#include "ems-memory.h"
+#include "ems-util.h"
+#include <memory.h>
+
+#define EMS_MESSAGE_CODEC_NULL_STRING 0xffffffff
+
+static
+int _ems_message_codec_op_cmp(const void *a, const void *b)
+{
+    size_t oa = ((EMSMessageCodecOp *)a)->offset;
+    size_t ob = ((EMSMessageCodecOp *)b)->offset;
+    return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+/* The space of a member up to the next one of any type, or the end of the message. */
+static
+size_t _ems_message_codec_member_space(EMSMessageCodecOp *ops, size_t op_count, size_t msg_size, size_t offset)
+{
+    size_t end = msg_size;
+    size_t j;
+    for (j = 0; j < op_count; ++j) {
+        if (ops[j].offset > offset && ops[j].offset < end)
+            end = ops[j].offset;
+    }
+    return offset < end ? end - offset : 0;
+}
+
+EMSMessageCodec *ems_message_codec_compile(EMSMessageCodecOp *ops, size_t op_count, size_t msg_size)
+{
+    EMSMessageCodec *codec = ems_alloc0(sizeof(EMSMessageCodec) + op_count * sizeof(EMSMessageCodecOp));
+    EMSMessageCodecOp *op;
+    size_t j;
+
+    /* Strings may only use the space up to the next member, including those not
+     * put on the wire. This is at least the declared size, everything else is
+     * padding. A string without space is dropped. */
+    for (j = 0; j < op_count; ++j) {
+        if (ops[j].type == EMS_MSG_MEMBER_FIXED_STRING)
+            ops[j].capacity = _ems_message_codec_member_space(ops, op_count, msg_size, ops[j].offset);
+    }
+
+    /* Keep only what we can put on the wire. */
+    for (j = 0; j < op_count; ++j) {
+        switch (ops[j].type) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_DOUBLE:
+            case EMS_MSG_MEMBER_STRING:
+            case EMS_MSG_MEMBER_SMALL_STRING:
+            case EMS_MSG_MEMBER_BYTES:
+            case EMS_MSG_MEMBER_ARRAY:
+                codec->ops[codec->op_count++] = ops[j];
+                break;
+            case EMS_MSG_MEMBER_FIXED_STRING:
+                if (ops[j].capacity)
+                    codec->ops[codec->op_count++] = ops[j];
+                break;
+            default:
+                break;
+        }
+    }
+
+    qsort(codec->ops, codec->op_count, sizeof(EMSMessageCodecOp), _ems_message_codec_op_cmp);
+
+    for (j = 0; j < codec->op_count; ++j) {
+        op = &codec->ops[j];
+        switch (op->type) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+                codec->fixed_size += 4;
+                break;
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_DOUBLE:
+                codec->fixed_size += 8;
+                break;
+            case EMS_MSG_MEMBER_FIXED_STRING:
+                codec->fixed_size += 4;
+                break;
+            case EMS_MSG_MEMBER_STRING:
+            case EMS_MSG_MEMBER_SMALL_STRING:
+            case EMS_MSG_MEMBER_BYTES:
+                ++codec->dynamic_count;
+                codec->fixed_size += 4;
+                break;
+            case EMS_MSG_MEMBER_ARRAY:
+                ++codec->dynamic_count;
+                codec->fixed_size += 8;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return codec;
+}
+
+void ems_message_codec_free(EMSMessageCodec *codec)
+{
+    ems_free(codec);
+}
+
+size_t ems_message_codec_payload_size(EMSMessageCodec *codec, EMSMessage *msg)
+{
+    size_t size = codec->fixed_size;
+    size_t j;
+    char *str;
+    EMSMessageArray *array;
+
+    for (j = 0; j < codec->op_count; ++j) {
+        if (codec->ops[j].type == EMS_MSG_MEMBER_FIXED_STRING) {
+            size += strnlen((char *)msg + codec->ops[j].offset, codec->ops[j].capacity - 1);
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_STRING) {
+            if ((str = *(char **)((char *)msg + codec->ops[j].offset)) != NULL)
+                size += strlen(str);
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_SMALL_STRING) {
+            size += ((EMSMessageSmallString *)((char *)msg + codec->ops[j].offset))->length;
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_BYTES) {
+            size += ((EMSMessageBytes *)((char *)msg + codec->ops[j].offset))->length;
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_ARRAY) {
+            array = (EMSMessageArray *)((char *)msg + codec->ops[j].offset);
+            size += array->length * ems_message_array_element_size(array->element_type);
+        }
+    }
+
+    return size;
+}
+
+size_t ems_message_codec_encode(EMSMessageCodec *codec, EMSMessage *msg, uint8_t *payload)
+{
+    size_t pos = 0;
+    size_t len;
+    size_t j;
+    char *member;
+    char *str;
+    EMSMessageSmallString *small;
+    EMSMessageBytes *bytes;
+    EMSMessageArray *array;
+    uint64_t u64;
+
+    for (j = 0; j < codec->op_count; ++j) {
+        member = (char *)msg + codec->ops[j].offset;
+        switch (codec->ops[j].type) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+                ems_message_write_u32(payload, pos, *(uint32_t *)member);
+                pos += 4;
+                break;
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_DOUBLE:
+                memcpy(&u64, member, 8);
+                ems_message_write_u64(payload, pos, u64);
+                pos += 8;
+                break;
+            case EMS_MSG_MEMBER_FIXED_STRING:
+                len = strnlen(member, codec->ops[j].capacity - 1);
+                ems_message_write_u32(payload, pos, len);
+                memcpy(&payload[pos + 4], member, len);
+                pos += 4 + len;
+                break;
+            case EMS_MSG_MEMBER_STRING:
+                if ((str = *(char **)member) != NULL) {
+                    len = strlen(str);
+                    ems_message_write_u32(payload, pos, len);
+                    memcpy(&payload[pos + 4], str, len);
+                    pos += 4 + len;
+                }
+                else {
+                    ems_message_write_u32(payload, pos, EMS_MESSAGE_CODEC_NULL_STRING);
+                    pos += 4;
+                }
+                break;
+            case EMS_MSG_MEMBER_SMALL_STRING:
+                small = (EMSMessageSmallString *)member;
+                ems_message_write_u32(payload, pos, small->length);
+                memcpy(&payload[pos + 4], ems_message_small_string_get(small), small->length);
+                pos += 4 + small->length;
+                break;
+            case EMS_MSG_MEMBER_BYTES:
+                bytes = (EMSMessageBytes *)member;
+                ems_message_write_u32(payload, pos, bytes->length);
+                if (bytes->length)
+                    memcpy(&payload[pos + 4], bytes->data, bytes->length);
+                pos += 4 + bytes->length;
+                break;
+            case EMS_MSG_MEMBER_ARRAY:
+                array = (EMSMessageArray *)member;
+                len = ems_message_array_element_size(array->element_type) ? array->length : 0;
+                ems_message_write_u32(payload, pos, len ? array->element_type : EMS_TYPE_UNKNOWN);
+                ems_message_write_u32(payload, pos + 4, len);
+                pos += 8;
+                if (!len)
+                    break;
+                if (array->element_type == EMS_TYPE_UINT || array->element_type == EMS_TYPE_INT) {
+                    ems_message_write_u32_array(payload, pos, (uint32_t *)array->data, len);
+                    pos += 4 * len;
+                }
+                else {
+                    ems_message_write_u64_array(payload, pos, (uint64_t *)array->data, len);
+                    pos += 8 * len;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return pos;
+}
+
+void ems_message_codec_decode(EMSMessageCodec *codec, EMSMessage *msg, uint8_t *payload, size_t length)
+{
+    size_t pos = 0;
+    size_t len;
+    size_t j;
+    char *member;
+    EMSMessageBytes *bytes;
+    EMSMessageArray *array;
+    size_t element_size;
+    uint32_t element_type;
+    uint64_t u64;
+    int borrow = ems_message_is_borrowed(msg, payload);
+
+    for (j = 0; j < codec->op_count; ++j) {
+        member = (char *)msg + codec->ops[j].offset;
+        switch (codec->ops[j].type) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+                if (ems_unlikely(pos + 4 > length))
+                    goto truncated;
+                *(uint32_t *)member = ems_message_read_u32(payload, pos);
+                pos += 4;
+                break;
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_DOUBLE:
+                if (ems_unlikely(pos + 8 > length))
+                    goto truncated;
+                u64 = ems_message_read_u64(payload, pos);
+                memcpy(member, &u64, 8);
+                pos += 8;
+                break;
+            case EMS_MSG_MEMBER_FIXED_STRING:
+                if (ems_unlikely(pos + 4 > length))
+                    goto truncated;
+                len = ems_message_read_u32(payload, pos);
+                pos += 4;
+                if (ems_unlikely(len > length - pos))
+                    goto truncated;
+                /* Cut off what does not fit, but skip the whole string. */
+                memcpy(member, &payload[pos], len < codec->ops[j].capacity ? len : codec->ops[j].capacity - 1);
+                member[len < codec->ops[j].capacity ? len : codec->ops[j].capacity - 1] = 0;
+                pos += len;
+                break;
+            case EMS_MSG_MEMBER_STRING:
+                if (ems_unlikely(pos + 4 > length))
+                    goto truncated;
+                len = ems_message_read_u32(payload, pos);
+                pos += 4;
+                if (len == EMS_MESSAGE_CODEC_NULL_STRING) {
+                    *(char **)member = NULL;
+                    break;
+                }
+                if (ems_unlikely(len > length - pos))
+                    goto truncated;
+                *(char **)member = ems_alloc(len + 1);
+                memcpy(*(char **)member, &payload[pos], len);
+                (*(char **)member)[len] = 0;
+                pos += len;
+                break;
+            case EMS_MSG_MEMBER_SMALL_STRING:
+                if (ems_unlikely(pos + 4 > length))
+                    goto truncated;
+                len = ems_message_read_u32(payload, pos);
+                pos += 4;
+                /* Sent as a NULL STRING. */
+                if (len == EMS_MESSAGE_CODEC_NULL_STRING)
+                    len = 0;
+                if (ems_unlikely(len > length - pos))
+                    goto truncated;
+                ems_message_small_string_assign((EMSMessageSmallString *)member, (char *)&payload[pos], len);
+                pos += len;
+                break;
+            case EMS_MSG_MEMBER_BYTES:
+                if (ems_unlikely(pos + 4 > length))
+                    goto truncated;
+                len = ems_message_read_u32(payload, pos);
+                pos += 4;
+                if (ems_unlikely(len > length - pos))
+                    goto truncated;
+                bytes = (EMSMessageBytes *)member;
+                bytes->length = len;
+                if (!len)
+                    bytes->data = NULL;
+                else if (borrow)
+                    bytes->data = &payload[pos];
+                else
+                    bytes->data = memcpy(ems_alloc(len), &payload[pos], len);
+                pos += len;
+                break;
+            case EMS_MSG_MEMBER_ARRAY:
+                if (ems_unlikely(pos + 8 > length))
+                    goto truncated;
+                element_type = ems_message_read_u32(payload, pos);
+                len = ems_message_read_u32(payload, pos + 4);
+                pos += 8;
+                element_size = ems_message_array_element_size(element_type);
+                if (ems_unlikely(len && (!element_size || len > (length - pos) / element_size)))
+                    goto truncated;
+                array = (EMSMessageArray *)member;
+                array->element_type = element_type;
+                array->length = len;
+                array->data = NULL;
+                if (!len)
+                    break;
+                array->data = ems_alloc(len * element_size);
+                if (element_size == 4)
+                    ems_message_read_u32_array(payload, pos, (uint32_t *)array->data, len);
+                else
+                    ems_message_read_u64_array(payload, pos, (uint64_t *)array->data, len);
+                pos += len * element_size;
+                break;
+            default:
+                break;
+        }
+    }
+    return;
+
+truncated:
+    for (; j < codec->op_count; ++j) {
+        member = (char *)msg + codec->ops[j].offset;
+        switch (codec->ops[j].type) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+                *(uint32_t *)member = 0;
+                break;
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_DOUBLE:
+                memset(member, 0, 8);
+                break;
+            case EMS_MSG_MEMBER_FIXED_STRING:
+                member[0] = 0;
+                break;
+            case EMS_MSG_MEMBER_STRING:
+                *(char **)member = NULL;
+                break;
+            case EMS_MSG_MEMBER_SMALL_STRING:
+                memset(member, 0, sizeof(EMSMessageSmallString));
+                break;
+            case EMS_MSG_MEMBER_BYTES:
+                ((EMSMessageBytes *)member)->data = NULL;
+                ((EMSMessageBytes *)member)->length = 0;
+                break;
+            case EMS_MSG_MEMBER_ARRAY:
+                memset(member, 0, sizeof(EMSMessageArray));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void ems_message_codec_copy(EMSMessageCodec *codec, size_t msg_size, EMSMessage *dst, EMSMessage *src)
+{
+    size_t j;
+    char **str;
+    EMSMessageSmallString *small;
+    EMSMessageBytes *bytes;
+    EMSMessageArray *array;
+    size_t len;
+
+    ems_message_codec_free_members(codec, dst);
+
+    if (msg_size > sizeof(EMSMessage))
+        memcpy((char *)dst + sizeof(EMSMessage), (char *)src + sizeof(EMSMessage), msg_size - sizeof(EMSMessage));
+
+    if (!codec->dynamic_count)
+        return;
+
+    for (j = 0; j < codec->op_count; ++j) {
+        if (codec->ops[j].type == EMS_MSG_MEMBER_STRING) {
+            str = (char **)((char *)dst + codec->ops[j].offset);
+            if (*str) {
+                len = strlen(*str);
+                *str = memcpy(ems_alloc(len + 1), *str, len + 1);
+            }
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_SMALL_STRING) {
+            small = (EMSMessageSmallString *)((char *)dst + codec->ops[j].offset);
+            if (small->length >= EMS_MESSAGE_SMALL_STRING_INLINE)
+                small->heap_data = memcpy(ems_alloc(small->length + 1), small->heap_data, small->length + 1);
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_BYTES) {
+            bytes = (EMSMessageBytes *)((char *)dst + codec->ops[j].offset);
+            if (bytes->length && !ems_message_is_borrowed(src, bytes->data))
+                bytes->data = memcpy(ems_alloc(bytes->length), bytes->data, bytes->length);
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_ARRAY) {
+            array = (EMSMessageArray *)((char *)dst + codec->ops[j].offset);
+            if (array->data) {
+                len = array->length * ems_message_array_element_size(array->element_type);
+                array->data = len ? memcpy(ems_alloc(len), array->data, len) : NULL;
+            }
+        }
+    }
+}
+
+void ems_message_codec_free_members(EMSMessageCodec *codec, EMSMessage *msg)
+{
+    size_t j;
+    char **str;
+    EMSMessageSmallString *small;
+    EMSMessageBytes *bytes;
+    EMSMessageArray *array;
+
+    if (!codec->dynamic_count)
+        return;
+
+    for (j = 0; j < codec->op_count; ++j) {
+        if (codec->ops[j].type == EMS_MSG_MEMBER_STRING) {
+            str = (char **)((char *)msg + codec->ops[j].offset);
+            ems_free(*str);
+            *str = NULL;
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_SMALL_STRING) {
+            small = (EMSMessageSmallString *)((char *)msg + codec->ops[j].offset);
+            if (small->length >= EMS_MESSAGE_SMALL_STRING_INLINE)
+                ems_free(small->heap_data);
+            memset(small, 0, sizeof(EMSMessageSmallString));
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_BYTES) {
+            bytes = (EMSMessageBytes *)((char *)msg + codec->ops[j].offset);
+            if (!ems_message_is_borrowed(msg, bytes->data))
+                ems_free(bytes->data);
+            bytes->data = NULL;
+            bytes->length = 0;
+        }
+        else if (codec->ops[j].type == EMS_MSG_MEMBER_ARRAY) {
+            array = (EMSMessageArray *)((char *)msg + codec->ops[j].offset);
+            ems_free(array->data);
+            array->data = NULL;
+            array->length = 0;
+        }
+    }
+}
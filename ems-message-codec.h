@@ -0,0 +1,70 @@
+/* Generic encoding/decoding of messages from their registered members.
+ * A class with EMS_MESSAGE_CLASS_AUTO_CODEC set gets its members compiled into
+ * a flat list of operations, which is then used to encode, decode, copy and
+ * free messages of this class.
+ *
+ * In the payload, the members are stored in the order of their offsets:
+ * UINT, INT:             4 bytes
+ * UINT64, INT64, DOUBLE: 8 bytes
+ * FIXED_STRING, STRING,
+ * SMALL_STRING:          4 byte length, followed by the characters (without
+ *                        the terminating 0). A NULL STRING has length 0xffffffff.
+ * BYTES:                 4 byte length, followed by the data.
+ * ARRAY:                 4 byte element type, 4 byte number of elements, followed by
+ *                        the elements, each encoded like the members above.
+ * Other member types are not encoded.
+ */
+#pragma once
+
+#include "ems-message.h"
+#include <stddef.h>
+
+/* A member as used by the codec. */
+typedef struct {
+    EMSMessageMemberType type;
+
+    /* Offset of the member in the message structure. */
+    size_t offset;
+
+    /* The space available for a FIXED_STRING, including the terminating 0. */
+    size_t capacity;
+} EMSMessageCodecOp;
+
+typedef struct {
+    /* The payload size of all members with a size not depending on the value. */
+    size_t fixed_size;
+
+    /* Number of members that may need to be freed or copied. */
+    size_t dynamic_count;
+
+    size_t op_count;
+    EMSMessageCodecOp ops[];
+} EMSMessageCodec;
+
+/* Compile the members into a codec. Pass all registered members, including those
+ * not put on the wire. The ops need not be sorted, and the capacity of FIXED_STRING
+ * members is ignored. It is derived from the offset of the next member of any type
+ * or the size of the message structure.
+ */
+EMSMessageCodec *ems_message_codec_compile(EMSMessageCodecOp *ops, size_t op_count, size_t msg_size);
+
+/* Free the codec. */
+void ems_message_codec_free(EMSMessageCodec *codec);
+
+/* The exact size of the payload for this message. */
+size_t ems_message_codec_payload_size(EMSMessageCodec *codec, EMSMessage *msg);
+
+/* Write the payload. The buffer must hold at least ems_message_codec_payload_size bytes.
+ * Returns the number of bytes written. */
+size_t ems_message_codec_encode(EMSMessageCodec *codec, EMSMessage *msg, uint8_t *payload);
+
+/* Read the payload. Members not contained in the payload are set to 0.
+ * If the message borrows the payload, BYTES members point into it. */
+void ems_message_codec_decode(EMSMessageCodec *codec, EMSMessage *msg, uint8_t *payload, size_t length);
+
+/* Copy all data of the message and duplicate the strings and bytes. Borrowed
+ * bytes are not duplicated, the caller has to share the payload with dst. */
+void ems_message_codec_copy(EMSMessageCodec *codec, size_t msg_size, EMSMessage *dst, EMSMessage *src);
+
+/* Free the strings and bytes in the message, except for borrowed ones. */
+void ems_message_codec_free_members(EMSMessageCodec *codec, EMSMessage *msg);
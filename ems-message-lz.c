@@ -0,0 +1,187 @@
+#include "ems-message-lz.h"
+#include "ems-util.h"
+#include <memory.h>
+
+#define EMS_LZ_HASH_LOG   12
+#define EMS_LZ_MIN_MATCH  4
+#define EMS_LZ_MAX_OFFSET 65535
+
+/* Matches end at least this many bytes before the end of the input, and do not
+ * start within the last EMS_LZ_MATCH_LIMIT bytes, so the last sequence is literals only. */
+#define EMS_LZ_LAST_LITERALS 5
+#define EMS_LZ_MATCH_LIMIT   12
+
+static inline
+uint32_t _ems_lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static inline
+uint32_t _ems_lz_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - EMS_LZ_HASH_LOG);
+}
+
+/* Write the rest of a length exceeding its nibble. */
+static inline
+uint8_t *_ems_lz_write_length(uint8_t *op, size_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/* Read the rest of a length exceeding its nibble. Returns NULL if the input ends. */
+static inline
+const uint8_t *_ems_lz_read_length(const uint8_t *ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t b;
+    do {
+        if (ems_unlikely(ip >= iend))
+            return NULL;
+        b = *ip++;
+        *length += b;
+    } while (b == 255);
+    return ip;
+}
+
+size_t ems_message_lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    uint32_t table[1 << EMS_LZ_HASH_LOG];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + length;
+    const uint8_t *ref, *mp, *mr;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+    uint8_t *token;
+    size_t literals, match;
+    uint32_t seq, h;
+
+    memset(table, 0, sizeof(table));
+
+    if (length > EMS_LZ_MATCH_LIMIT) {
+        const uint8_t *match_start_limit = iend - EMS_LZ_MATCH_LIMIT;
+        const uint8_t *match_end_limit = iend - EMS_LZ_LAST_LITERALS;
+
+        while (ip < match_start_limit) {
+            seq = _ems_lz_read32(ip);
+            h = _ems_lz_hash(seq);
+            ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > EMS_LZ_MAX_OFFSET || _ems_lz_read32(ref) != seq) {
+                ++ip;
+                continue;
+            }
+
+            /* Extend the match in both directions. */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            mp = ip + EMS_LZ_MIN_MATCH;
+            mr = ref + EMS_LZ_MIN_MATCH;
+            while (mp < match_end_limit && *mp == *mr) {
+                ++mp;
+                ++mr;
+            }
+
+            literals = ip - anchor;
+            match = mp - ip - EMS_LZ_MIN_MATCH;
+
+            if (ems_unlikely((size_t)(oend - op) < 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1))
+                return 0;
+
+            token = op++;
+            *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4 | (match >= 15 ? 15 : match));
+            if (literals >= 15)
+                op = _ems_lz_write_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            op[0] = (uint8_t)(ip - ref);
+            op[1] = (uint8_t)((ip - ref) >> 8);
+            op += 2;
+
+            if (match >= 15)
+                op = _ems_lz_write_length(op, match - 15);
+
+            ip = anchor = mp;
+        }
+    }
+
+    literals = iend - anchor;
+    if (ems_unlikely((size_t)(oend - op) < 1 + literals + literals / 255 + 1))
+        return 0;
+
+    token = op++;
+    *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15)
+        op = _ems_lz_write_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - dst;
+}
+
+size_t ems_message_lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + length;
+    const uint8_t *ref;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+    size_t literals, match, offset;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        literals = token >> 4;
+        if (literals == 15 && (ip = _ems_lz_read_length(ip, iend, &literals)) == NULL)
+            return 0;
+        if (ems_unlikely(literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)))
+            return 0;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        /* The last sequence has no match. */
+        if (ip == iend)
+            break;
+
+        if (ems_unlikely(iend - ip < 2))
+            return 0;
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (ems_unlikely(offset == 0 || offset > (size_t)(op - dst)))
+            return 0;
+
+        match = token & 15;
+        if (match == 15 && (ip = _ems_lz_read_length(ip, iend, &match)) == NULL)
+            return 0;
+        match += EMS_LZ_MIN_MATCH;
+        if (ems_unlikely(match > (size_t)(oend - op)))
+            return 0;
+
+        ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        }
+        else {
+            /* The match overlaps the output, e.g., for repeated bytes. */
+            while (match--)
+                *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
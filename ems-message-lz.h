@@ -0,0 +1,19 @@
+/* A small and fast compressor of the LZ77 family, bundled as EMS_MESSAGE_COMPRESSOR_LZ.
+ * The format follows the LZ4 block format: a sequence starts with a token holding
+ * the number of literals in the upper and the match length minus 4 in the lower
+ * nibble. A nibble of 15 is continued by bytes adding up to the length, until a byte
+ * is not 255. The literals follow, then the 2 byte offset of the match (little endian)
+ * and the rest of the match length. The last sequence has only literals.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compress length bytes from src to dst. Returns the compressed size, or 0 if it
+ * would exceed capacity. */
+size_t ems_message_lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+/* Decompress length bytes from src to dst. Returns the size of the decompressed
+ * data, or 0 if src is invalid or does not fit into capacity bytes. */
+size_t ems_message_lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
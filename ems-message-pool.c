@@ -0,0 +1,271 @@
+#include "ems-message-pool.h"
+#include "ems-memory.h"
+#include "ems-util.h"
+#include <memory.h>
+#include <stdatomic.h>
+
+/* Number of objects a thread keeps per pool. Half of it is moved at once. */
+#define EMS_MESSAGE_POOL_MAGAZINE_SIZE 32
+
+/* Number of pools a thread caches at the same time. Pools are mapped to
+ * slots by their serial number. */
+#define EMS_MESSAGE_POOL_THREAD_SLOTS  16
+
+/* Approximate size of a slab. */
+#define EMS_MESSAGE_POOL_SLAB_SIZE     16384
+#define EMS_MESSAGE_POOL_SLAB_MIN_OBJECTS 8
+
+typedef struct _EMSMessagePoolObject EMSMessagePoolObject;
+struct _EMSMessagePoolObject {
+    EMSMessagePoolObject *next;
+};
+
+struct _EMSMessagePool {
+    size_t object_size;
+    size_t slab_objects;
+    uint64_t serial;
+
+    pthread_mutex_t lock;
+    EMSMessagePoolObject *free_list;
+    EMSList *slabs;
+
+    atomic_uint_fast64_t allocs;
+    atomic_uint_fast64_t magazine_hits;
+    atomic_uint_fast64_t frees;
+    atomic_uint_fast64_t refills;
+    atomic_uint_fast64_t flushes;
+    atomic_uint_fast64_t slabs_allocated;
+};
+
+/* The objects a thread holds for one pool. The counters are added to the pool
+ * whenever objects are exchanged with it. */
+typedef struct {
+    EMSMessagePool *pool;
+    uint64_t serial;
+    unsigned int epoch;
+    size_t count;
+    uint64_t allocs;
+    uint64_t magazine_hits;
+    uint64_t frees;
+    void *objects[EMS_MESSAGE_POOL_MAGAZINE_SIZE];
+} EMSMessagePoolMagazine;
+
+static __thread EMSMessagePoolMagazine pool_magazines[EMS_MESSAGE_POOL_THREAD_SLOTS];
+static __thread int pool_magazines_registered = 0;
+
+/* Destroying a pool increases the epoch. Magazines from an earlier epoch may refer to
+ * pools that do not exist anymore and are dropped without touching the pool. */
+static atomic_uint pool_epoch = 1;
+static atomic_uint_fast64_t pool_serial = 0;
+
+static pthread_key_t pool_thread_key;
+static pthread_once_t pool_thread_key_once = PTHREAD_ONCE_INIT;
+
+static
+void _ems_message_pool_publish_stats(EMSMessagePoolMagazine *mag)
+{
+    atomic_fetch_add_explicit(&mag->pool->allocs, mag->allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mag->pool->magazine_hits, mag->magazine_hits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mag->pool->frees, mag->frees, memory_order_relaxed);
+    mag->allocs = 0;
+    mag->magazine_hits = 0;
+    mag->frees = 0;
+}
+
+/* Move count objects from the magazine back to the pool. */
+static
+void _ems_message_pool_flush(EMSMessagePoolMagazine *mag, size_t count)
+{
+    EMSMessagePool *pool = mag->pool;
+    EMSMessagePoolObject *head = NULL;
+    EMSMessagePoolObject *tail = NULL;
+    EMSMessagePoolObject *obj;
+
+    if (count > mag->count)
+        count = mag->count;
+
+    /* Chain the objects outside of the lock. */
+    while (count--) {
+        obj = (EMSMessagePoolObject *)mag->objects[--mag->count];
+        obj->next = head;
+        head = obj;
+        if (!tail)
+            tail = obj;
+    }
+
+    if (head) {
+        pthread_mutex_lock(&pool->lock);
+        tail->next = pool->free_list;
+        pool->free_list = head;
+        pthread_mutex_unlock(&pool->lock);
+        atomic_fetch_add_explicit(&pool->flushes, 1, memory_order_relaxed);
+    }
+
+    _ems_message_pool_publish_stats(mag);
+}
+
+static
+void _ems_message_pool_thread_exit(void *data)
+{
+    EMSMessagePoolMagazine *mags = (EMSMessagePoolMagazine *)data;
+    size_t j;
+
+    for (j = 0; j < EMS_MESSAGE_POOL_THREAD_SLOTS; ++j) {
+        if (mags[j].pool && mags[j].epoch == atomic_load(&pool_epoch))
+            _ems_message_pool_flush(&mags[j], mags[j].count);
+        mags[j].pool = NULL;
+        mags[j].count = 0;
+    }
+}
+
+static
+void _ems_message_pool_thread_key_create(void)
+{
+    pthread_key_create(&pool_thread_key, _ems_message_pool_thread_exit);
+}
+
+/* Get the magazine of this thread for the pool. If another pool used this slot,
+ * its objects are returned first. */
+static inline
+EMSMessagePoolMagazine *_ems_message_pool_get_magazine(EMSMessagePool *pool)
+{
+    EMSMessagePoolMagazine *mag = &pool_magazines[pool->serial % EMS_MESSAGE_POOL_THREAD_SLOTS];
+    unsigned int epoch = atomic_load_explicit(&pool_epoch, memory_order_relaxed);
+
+    if (ems_likely(mag->pool == pool && mag->serial == pool->serial && mag->epoch == epoch))
+        return mag;
+
+    if (ems_unlikely(!pool_magazines_registered)) {
+        pthread_once(&pool_thread_key_once, _ems_message_pool_thread_key_create);
+        pthread_setspecific(pool_thread_key, pool_magazines);
+        pool_magazines_registered = 1;
+    }
+
+    if (mag->pool && mag->epoch == epoch)
+        _ems_message_pool_flush(mag, mag->count);
+
+    mag->pool = pool;
+    mag->serial = pool->serial;
+    mag->epoch = epoch;
+    mag->count = 0;
+    mag->allocs = 0;
+    mag->magazine_hits = 0;
+    mag->frees = 0;
+
+    return mag;
+}
+
+/* Allocate a new slab and put all objects but the first to the free list.
+ * The caller has to hold the lock. */
+static
+void *_ems_message_pool_grow_unsafe(EMSMessagePool *pool)
+{
+    uint8_t *slab = ems_alloc(pool->object_size * pool->slab_objects);
+    EMSMessagePoolObject *obj;
+    size_t j;
+
+    pool->slabs = ems_list_prepend(pool->slabs, slab);
+
+    for (j = pool->slab_objects - 1; j > 0; --j) {
+        obj = (EMSMessagePoolObject *)(slab + j * pool->object_size);
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    atomic_fetch_add_explicit(&pool->slabs_allocated, 1, memory_order_relaxed);
+
+    return slab;
+}
+
+EMSMessagePool *ems_message_pool_new(size_t object_size)
+{
+    EMSMessagePool *pool = ems_alloc0(sizeof(EMSMessagePool));
+
+    if (object_size < sizeof(EMSMessagePoolObject))
+        object_size = sizeof(EMSMessagePoolObject);
+    pool->object_size = (object_size + 15) & ~((size_t)15);
+    pool->slab_objects = EMS_MESSAGE_POOL_SLAB_SIZE / pool->object_size;
+    if (pool->slab_objects < EMS_MESSAGE_POOL_SLAB_MIN_OBJECTS)
+        pool->slab_objects = EMS_MESSAGE_POOL_SLAB_MIN_OBJECTS;
+    pool->serial = atomic_fetch_add(&pool_serial, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+void ems_message_pool_destroy(EMSMessagePool *pool)
+{
+    if (!pool)
+        return;
+
+    atomic_fetch_add(&pool_epoch, 1);
+
+    ems_list_free_full(pool->slabs, (EMSDestroyNotifyFunc)ems_free);
+    pthread_mutex_destroy(&pool->lock);
+    ems_free(pool);
+}
+
+void *ems_message_pool_alloc(EMSMessagePool *pool)
+{
+    EMSMessagePoolMagazine *mag = _ems_message_pool_get_magazine(pool);
+    EMSMessagePoolObject *obj;
+    void *result = NULL;
+
+    ++mag->allocs;
+    if (ems_likely(mag->count)) {
+        ++mag->magazine_hits;
+        return mag->objects[--mag->count];
+    }
+
+    /* Refill half of the magazine and take one more object for the caller. */
+    pthread_mutex_lock(&pool->lock);
+    while (mag->count < EMS_MESSAGE_POOL_MAGAZINE_SIZE / 2 && (obj = pool->free_list) != NULL) {
+        pool->free_list = obj->next;
+        mag->objects[mag->count++] = obj;
+    }
+    if ((obj = pool->free_list) != NULL) {
+        pool->free_list = obj->next;
+        result = obj;
+    }
+    else {
+        result = _ems_message_pool_grow_unsafe(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    atomic_fetch_add_explicit(&pool->refills, 1, memory_order_relaxed);
+    _ems_message_pool_publish_stats(mag);
+
+    return result;
+}
+
+void ems_message_pool_free(EMSMessagePool *pool, void *object)
+{
+    if (ems_unlikely(!object))
+        return;
+
+    EMSMessagePoolMagazine *mag = _ems_message_pool_get_magazine(pool);
+
+    ++mag->frees;
+    if (ems_unlikely(mag->count == EMS_MESSAGE_POOL_MAGAZINE_SIZE))
+        _ems_message_pool_flush(mag, EMS_MESSAGE_POOL_MAGAZINE_SIZE / 2);
+
+    mag->objects[mag->count++] = object;
+}
+
+void ems_message_pool_get_stats(EMSMessagePool *pool, EMSMessagePoolStats *stats)
+{
+    EMSMessagePoolMagazine *mag = &pool_magazines[pool->serial % EMS_MESSAGE_POOL_THREAD_SLOTS];
+
+    /* Include our own thread. */
+    if (mag->pool == pool && mag->serial == pool->serial && mag->epoch == atomic_load(&pool_epoch))
+        _ems_message_pool_publish_stats(mag);
+
+    stats->object_size   = pool->object_size;
+    stats->allocs        = atomic_load_explicit(&pool->allocs, memory_order_relaxed);
+    stats->magazine_hits = atomic_load_explicit(&pool->magazine_hits, memory_order_relaxed);
+    stats->frees         = atomic_load_explicit(&pool->frees, memory_order_relaxed);
+    stats->refills       = atomic_load_explicit(&pool->refills, memory_order_relaxed);
+    stats->flushes       = atomic_load_explicit(&pool->flushes, memory_order_relaxed);
+    stats->slabs         = atomic_load_explicit(&pool->slabs_allocated, memory_order_relaxed);
+}
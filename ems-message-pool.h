@@ -0,0 +1,29 @@
+/* Memory pools for messages of a single class.
+ * Objects are carved from slabs and recycled through a free list in the pool.
+ * Each thread keeps a small magazine of free objects per pool, so allocating
+ * and freeing only takes the pool lock when a whole batch of objects is moved
+ * between the magazine and the pool. A message allocated in the communicator
+ * thread and freed in the event loop thread travels back in such batches.
+ */
+#pragma once
+
+#include "ems-message.h"
+#include <pthread.h>
+
+typedef struct _EMSMessagePool EMSMessagePool;
+
+/* Create a pool for objects of the given size. */
+EMSMessagePool *ems_message_pool_new(size_t object_size);
+
+/* Free the pool and all slabs. Objects still in use become invalid. */
+void ems_message_pool_destroy(EMSMessagePool *pool);
+
+/* Get an object from the pool. The memory is not cleared. */
+void *ems_message_pool_alloc(EMSMessagePool *pool);
+
+/* Return an object to the pool. */
+void ems_message_pool_free(EMSMessagePool *pool, void *object);
+
+/* Get the statistics of the pool. Counts of other threads are included as soon as
+ * their magazines exchanged objects with the pool. */
+void ems_message_pool_get_stats(EMSMessagePool *pool, EMSMessagePoolStats *stats);
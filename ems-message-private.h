@@ -0,0 +1,48 @@
+/* Parts of the message used only inside the library. */
+#pragma once
+
+#include "ems-message.h"
+#include "ems-memory.h"
+#include <memory.h>
+#include <stdatomic.h>
+
+/* A received payload. Messages decoded from it with EMS_MESSAGE_CLASS_ZERO_COPY,
+ * and their copies, hold a reference to it. */
+struct _EMSMessagePayload {
+    atomic_int reference_count;
+    size_t length;
+    uint8_t data[];
+};
+
+/* Check whether ptr points into the payload the message borrows from. Memory
+ * there must not be freed or modified. */
+static inline
+int ems_message_is_borrowed(EMSMessage *msg, const void *ptr)
+{
+    return msg->payload &&
+           (const uint8_t *)ptr >= msg->payload->data &&
+           (const uint8_t *)ptr < msg->payload->data + msg->payload->length;
+}
+
+/* Set a small string to length bytes from value, freeing a long previous value.
+ * Value may point into the string itself, so the old value is freed last. */
+static inline
+void ems_message_small_string_assign(EMSMessageSmallString *str, const char *value, size_t length)
+{
+    char *old = str->length >= EMS_MESSAGE_SMALL_STRING_INLINE ? str->heap_data : NULL;
+    char *data;
+
+    if (length < EMS_MESSAGE_SMALL_STRING_INLINE) {
+        data = str->inline_data;
+        if (length)
+            memmove(data, value, length);
+    }
+    else {
+        data = ems_alloc(length + 1);
+        memcpy(data, value, length);
+        str->heap_data = data;
+    }
+    data[length] = 0;
+    ems_free(old);
+    str->length = (uint32_t)length;
+}
@@ -1,257 +1,1493 @@
 #include "ems-message.h"
+#include "ems-message-codec.h"
+#include "ems-message-lz.h"
+#include "ems-message-pool.h"
+#include "ems-message-private.h"
 #include "ems-memory.h"
 #include "ems-util.h"
 #include "ems-error.h"
 #include <memory.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
-typedef struct {
+typedef struct _EMSMessageClassMember EMSMessageClassMember;
+
+/* Set the member from the next value in the argument list. Chosen once when the
+ * member is added, so that constructing a message does not switch on the type. */
+typedef void (*EMSMessageClassMemberSetter)(EMSMessage *, EMSMessageClassMember *, va_list *);
+
+struct _EMSMessageClassMember {
     EMSMessageMemberType type;
     uint32_t id;
     char     *name;
     size_t   offset;
     EMSMessageClassSetMemberCallback set_cb;
-} EMSMessageClassMember;
+    EMSMessageClassMemberSetter setter;
+};
+
+/* Lookup tables for the members of a class, built on first use. */
+#define EMS_MESSAGE_MEMBER_DENSE_IDS 256
+typedef struct {
+    size_t count;
+    EMSMessageClassMember **by_name;   /* sorted by name */
+    EMSMessageClassMember **by_id;     /* indexed by id if dense_ids, else sorted by id */
+    uint32_t dense_ids;                /* number of slots in by_id if directly indexed */
+    EMSMessageCodec *codec;            /* only for EMS_MESSAGE_CLASS_AUTO_CODEC */
+} EMSMessageClassMemberIndex;
+
+typedef struct {
+    EMSMessageClass klass;
+    EMSList *members;        /* [EMSMessageClassMember] */
+    _Atomic(EMSMessageClassMemberIndex *) member_index;
+    EMSList *retired_indices; /* [EMSMessageClassMemberIndex], replaced by adding members */
+    EMSMessagePool *pool;     /* NULL if the class frees messages itself */
+
+    /* See ems_message_type_set_conflation_key. */
+    int conflate;
+    int conflate_by_sender;
+    EMSMessageClassMember *conflate_member;
+
+    /* See EMSMessageCompressionStats. */
+    _Atomic(uint64_t) compressed;
+    _Atomic(uint64_t) rejected;
+    _Atomic(uint64_t) bytes_in;
+    _Atomic(uint64_t) bytes_out;
+    _Atomic(uint64_t) compress_ns;
+    _Atomic(uint64_t) decompressed;
+    _Atomic(uint64_t) decompress_ns;
+} EMSMessageClassInternal;
+
+/* Internal messages (high bit set) are numbered densely from 0x80000001 on.
+ * Those below 0x80000000 + EMS_MESSAGE_CLASS_INTERNAL_SLOTS are directly
+ * indexed, everything else goes to the hash table below. */
+#define EMS_MESSAGE_CLASS_INTERNAL_SLOTS 256
+
+/* A slot in the class table. The slot is in use iff cls is not NULL. The type
+ * is written before cls is published, so a reader seeing cls may read type. */
+typedef struct {
+    uint32_t type;
+    _Atomic(EMSMessageClassInternal *) cls;
+} EMSMessageClassSlot;
+
+/* Open-addressing hash table with linear probing. Types are never removed
+ * individually, so there are no tombstones. If the table gets too full it is
+ * replaced by a larger copy. The old table is kept in retired, since readers
+ * may still look at it, and released in ems_message_types_clear. */
+typedef struct _EMSMessageClassTable EMSMessageClassTable;
+struct _EMSMessageClassTable {
+    size_t mask;                    /* size - 1, size is a power of two */
+    size_t count;                   /* number of used slots */
+    EMSMessageClassTable *retired;  /* the table this one replaced */
+    EMSMessageClassSlot slots[];
+};
+
+#define EMS_MESSAGE_CLASS_TABLE_MIN_SIZE 64
+
+static _Atomic(EMSMessageClassInternal *) msg_classes_internal[EMS_MESSAGE_CLASS_INTERNAL_SLOTS];
+static _Atomic(EMSMessageClassTable *) msg_classes = NULL;
+
+/* Serializes all writers. Lookups do not take this lock. */
+static pthread_mutex_t msg_classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of conflated classes, so that queues skip the lookup if there are none. */
+static atomic_int msg_classes_conflated = 0;
+
+static const EMSMessageCompressor msg_compressor_lz = {
+    .id         = EMS_MESSAGE_COMPRESSOR_LZ,
+    .compress   = ems_message_lz_compress,
+    .decompress = ems_message_lz_decompress,
+};
+
+/* Registered compressors by id. */
+static _Atomic(const EMSMessageCompressor *) msg_compressors[256] = {
+    [EMS_MESSAGE_COMPRESSOR_LZ] = &msg_compressor_lz,
+};
+
+/* A magic 4 byte string indicating a message of this library. */
+char msg_magic[] = "EMSG";
+
+void ems_message_free(EMSMessage *msg);
+
+static inline EMSMessageClassMemberIndex *_ems_message_class_get_member_index(EMSMessageClassInternal *cls);
+static inline void _ems_message_payload_unref(EMSMessagePayload *payload);
+
+static inline
+int _ems_message_type_is_dense(uint32_t type)
+{
+    return type >= 0x80000000 && type < 0x80000000 + EMS_MESSAGE_CLASS_INTERNAL_SLOTS;
+}
+
+static inline
+size_t _ems_message_type_hash(uint32_t type)
+{
+    uint32_t h = type * 0x9e3779b1;
+    return (size_t)(h ^ (h >> 16));
+}
+
+static inline
+EMSMessageClassInternal *_ems_message_type_get_class(uint32_t type)
+{
+    if (_ems_message_type_is_dense(type))
+        return atomic_load_explicit(&msg_classes_internal[type & 0x7fffffff], memory_order_acquire);
+
+    EMSMessageClassTable *table = atomic_load_explicit(&msg_classes, memory_order_acquire);
+    if (ems_unlikely(!table))
+        return NULL;
+
+    EMSMessageClassInternal *cls;
+    size_t j = _ems_message_type_hash(type) & table->mask;
+    while ((cls = atomic_load_explicit(&table->slots[j].cls, memory_order_acquire)) != NULL) {
+        if (table->slots[j].type == type)
+            return cls;
+        j = (j + 1) & table->mask;
+    }
+    return NULL;
+}
+
+/* Put cls into table without checking for duplicates or size. */
+static
+void _ems_message_class_table_insert_unsafe(EMSMessageClassTable *table, EMSMessageClassInternal *cls)
+{
+    size_t j = _ems_message_type_hash(cls->klass.msgtype) & table->mask;
+    while (atomic_load_explicit(&table->slots[j].cls, memory_order_relaxed) != NULL)
+        j = (j + 1) & table->mask;
+
+    table->slots[j].type = cls->klass.msgtype;
+    atomic_store_explicit(&table->slots[j].cls, cls, memory_order_release);
+    ++table->count;
+}
+
+static
+EMSMessageClassTable *_ems_message_class_table_new(size_t size)
+{
+    EMSMessageClassTable *table = ems_alloc0(sizeof(EMSMessageClassTable) + size * sizeof(EMSMessageClassSlot));
+    table->mask = size - 1;
+    return table;
+}
+
+/* Add a class to the table, growing it if the load factor would exceed 1/2.
+ * The caller has to hold msg_classes_lock. */
+static
+void _ems_message_class_table_add_unsafe(EMSMessageClassInternal *cls)
+{
+    EMSMessageClassTable *table = atomic_load_explicit(&msg_classes, memory_order_relaxed);
+    EMSMessageClassTable *new_table;
+    EMSMessageClassInternal *entry;
+    size_t j;
+
+    if (!table) {
+        table = _ems_message_class_table_new(EMS_MESSAGE_CLASS_TABLE_MIN_SIZE);
+        atomic_store_explicit(&msg_classes, table, memory_order_release);
+    }
+    else if (2 * (table->count + 1) > table->mask + 1) {
+        new_table = _ems_message_class_table_new(2 * (table->mask + 1));
+        for (j = 0; j <= table->mask; ++j) {
+            if ((entry = atomic_load_explicit(&table->slots[j].cls, memory_order_relaxed)) != NULL)
+                _ems_message_class_table_insert_unsafe(new_table, entry);
+        }
+        new_table->retired = table;
+        atomic_store_explicit(&msg_classes, new_table, memory_order_release);
+        table = new_table;
+    }
+
+    _ems_message_class_table_insert_unsafe(table, cls);
+}
+
+/* Allocate the memory for a message of this class. */
+static inline
+EMSMessage *_ems_message_alloc(EMSMessageClassInternal *cls)
+{
+    if (cls->pool)
+        return memset(ems_message_pool_alloc(cls->pool), 0, cls->klass.size);
+    return ems_alloc0(cls->klass.size);
+}
+
+/* Release the memory of a message, after its members have been freed. */
+static inline
+void _ems_message_release(EMSMessageClassInternal *cls, EMSMessage *msg)
+{
+    if (cls && cls->pool)
+        ems_message_pool_free(cls->pool, msg);
+    else
+        ems_free(msg);
+}
+
+static inline
+EMSMessageCodec *_ems_message_get_codec(EMSMessage *msg)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    return cls ? _ems_message_class_get_member_index(cls)->codec : NULL;
+}
+
+static
+size_t _ems_message_auto_encode(EMSMessage *msg, uint8_t **buffer, size_t buflen)
+{
+    EMSMessageCodec *codec = _ems_message_get_codec(msg);
+    size_t size = EMS_MESSAGE_HEADER_SIZE + ems_message_codec_payload_size(codec, msg);
+
+    if (buflen < size)
+        *buffer = ems_realloc(*buffer, size);
+
+    return EMS_MESSAGE_HEADER_SIZE + ems_message_codec_encode(codec, msg, *buffer + EMS_MESSAGE_HEADER_SIZE);
+}
+
+static
+size_t _ems_message_auto_encoded_size(EMSMessage *msg)
+{
+    return ems_message_codec_payload_size(_ems_message_get_codec(msg), msg);
+}
+
+static
+void _ems_message_auto_decode(EMSMessage *msg, uint8_t *payload, size_t length)
+{
+    ems_message_codec_decode(_ems_message_get_codec(msg), msg, payload, length);
+}
+
+static
+void _ems_message_auto_copy(EMSMessage *dst, EMSMessage *src)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(src->type);
+    if (ems_likely(cls != NULL))
+        ems_message_codec_copy(_ems_message_class_get_member_index(cls)->codec, cls->klass.size, dst, src);
+}
+
+static
+void _ems_message_auto_free(EMSMessage *msg)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_likely(cls != NULL))
+        ems_message_codec_free_members(_ems_message_class_get_member_index(cls)->codec, msg);
+    _ems_message_release(cls, msg);
+}
+
+/* Register a new message type. The type id shall be a user definded constant, since we want
+ * to use this by multiple, heterogenous hosts. Therefore, we cannot return the type id from
+ * an internal register.
+ * Return an error if the type is already there. Internal messages all have the high bit set,
+ * so avoiding those ids, there should be no type clash.
+ * The user has to provide the functions for encoding/decoding the message as well as
+ * setting values by key.
+ */
+int ems_message_register_type(uint32_t type, EMSMessageClass *msg_class)
+{
+    pthread_mutex_lock(&msg_classes_lock);
+
+    if (_ems_message_type_get_class(type)) {
+        pthread_mutex_unlock(&msg_classes_lock);
+        return EMS_ERROR_MESSAGE_TYPE_EXISTS;
+    }
+
+    EMSMessageClassInternal *new_class = ems_alloc0(sizeof(EMSMessageClassInternal));
+    if (msg_class)
+        *((EMSMessageClass *)new_class) = *msg_class;
+    else
+        new_class->klass.size = sizeof(EMSMessage);
+    new_class->klass.msgtype = type;
+
+    if (new_class->klass.flags & EMS_MESSAGE_CLASS_AUTO_CODEC) {
+        if (!new_class->klass.msg_encode) {
+            new_class->klass.msg_encode = _ems_message_auto_encode;
+            new_class->klass.msg_encoded_size = _ems_message_auto_encoded_size;
+        }
+        if (!new_class->klass.msg_decode)
+            new_class->klass.msg_decode = _ems_message_auto_decode;
+        if (!new_class->klass.msg_copy)
+            new_class->klass.msg_copy = _ems_message_auto_copy;
+        if (!new_class->klass.msg_free)
+            new_class->klass.msg_free = _ems_message_auto_free;
+    }
+
+    /* Messages with a class-specific msg_free are released with ems_free there. */
+    if (!new_class->klass.msg_free || new_class->klass.msg_free == _ems_message_auto_free)
+        new_class->pool = ems_message_pool_new(new_class->klass.size);
+
+    if (_ems_message_type_is_dense(type))
+        atomic_store_explicit(&msg_classes_internal[type & 0x7fffffff], new_class, memory_order_release);
+    else
+        _ems_message_class_table_add_unsafe(new_class);
+
+    pthread_mutex_unlock(&msg_classes_lock);
+
+    return EMS_OK;
+}
+
+static
+void _ems_message_member_set_cb(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    member->set_cb(msg, member->id, (void *)msg + member->offset, va_arg(*args, void *));
+}
+
+static
+void _ems_message_member_set_int(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((int *)((void *)msg + member->offset)) = va_arg(*args, int);
+}
+
+static
+void _ems_message_member_set_int64(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((int64_t *)((void *)msg + member->offset)) = va_arg(*args, int64_t);
+}
+
+static
+void _ems_message_member_set_uint(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((uint32_t *)((void *)msg + member->offset)) = va_arg(*args, uint32_t);
+}
+
+static
+void _ems_message_member_set_uint64(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((uint64_t *)((void *)msg + member->offset)) = va_arg(*args, uint64_t);
+}
+
+static
+void _ems_message_member_set_double(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((double *)((void *)msg + member->offset)) = va_arg(*args, double);
+}
+
+static
+void _ems_message_member_set_pointer(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    *((void **)((void *)msg + member->offset)) = va_arg(*args, void *);
+}
+
+static
+void _ems_message_member_set_fixed_string(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    strcpy((char *)((void *)msg + member->offset), va_arg(*args, char *));
+}
+
+static
+void _ems_message_member_set_string(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    char **dst = (char **)((void *)msg + member->offset);
+    char *value = va_arg(*args, char *);
+    size_t len = value ? strlen(value) : 0;
+    char *old = *dst;
+
+    /* The value may be the old one. */
+    *dst = ems_alloc(len + 1);
+
+    if (value)
+        memcpy(*dst, value, len + 1);
+    else
+        (*dst)[0] = 0;
+    ems_free(old);
+}
+
+static
+void _ems_message_member_set_small_string(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    EMSMessageSmallString *dst = (EMSMessageSmallString *)((void *)msg + member->offset);
+    char *value = va_arg(*args, char *);
+
+    ems_message_small_string_assign(dst, value, value ? strlen(value) : 0);
+}
+
+static
+void _ems_message_member_set_bytes(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    EMSMessageBytes *dst = (EMSMessageBytes *)((void *)msg + member->offset);
+    EMSMessageBytes *value = va_arg(*args, EMSMessageBytes *);
+
+    if (!ems_message_is_borrowed(msg, dst->data))
+        ems_free(dst->data);
+
+    if (value && value->length) {
+        dst->data = memcpy(ems_alloc(value->length), value->data, value->length);
+        dst->length = value->length;
+    }
+    else {
+        dst->data = NULL;
+        dst->length = 0;
+    }
+}
+
+static
+void _ems_message_member_set_array(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    EMSMessageArray *dst = (EMSMessageArray *)((void *)msg + member->offset);
+    EMSMessageArray *value = va_arg(*args, EMSMessageArray *);
+    size_t element_size = value ? ems_message_array_element_size(value->element_type) : 0;
+
+    ems_free(dst->data);
+    dst->data = NULL;
+    dst->length = 0;
+    dst->element_type = value ? value->element_type : EMS_TYPE_UNKNOWN;
+
+    if (value && value->length && !element_size) {
+        fprintf(stderr, "Unsupported array element type %d in member `%s'\n", value->element_type, member->name);
+        return;
+    }
+
+    if (element_size && value->length) {
+        dst->data = memcpy(ems_alloc(value->length * element_size), value->data, value->length * element_size);
+        dst->length = value->length;
+    }
+}
+
+static
+void _ems_message_member_set_unsupported(EMSMessage *msg, EMSMessageClassMember *member, va_list *args)
+{
+    fprintf(stderr, "Unable to set value of type %d in member `%s'\n", member->type, member->name);
+    (void)va_arg(*args, void *);
+}
+
+static
+EMSMessageClassMemberSetter _ems_message_member_get_setter(EMSMessageClassMember *member)
+{
+    if (member->set_cb)
+        return _ems_message_member_set_cb;
+
+    switch (member->type) {
+        case EMS_MSG_MEMBER_INT:
+            return _ems_message_member_set_int;
+        case EMS_MSG_MEMBER_INT64:
+            return _ems_message_member_set_int64;
+        case EMS_MSG_MEMBER_UINT:
+            return _ems_message_member_set_uint;
+        case EMS_MSG_MEMBER_UINT64:
+            return _ems_message_member_set_uint64;
+        case EMS_MSG_MEMBER_DOUBLE:
+            return _ems_message_member_set_double;
+        case EMS_MSG_MEMBER_POINTER:
+            return _ems_message_member_set_pointer;
+        case EMS_MSG_MEMBER_FIXED_STRING:
+            return _ems_message_member_set_fixed_string;
+        case EMS_MSG_MEMBER_STRING:
+            return _ems_message_member_set_string;
+        case EMS_MSG_MEMBER_SMALL_STRING:
+            return _ems_message_member_set_small_string;
+        case EMS_MSG_MEMBER_BYTES:
+            return _ems_message_member_set_bytes;
+        case EMS_MSG_MEMBER_ARRAY:
+            return _ems_message_member_set_array;
+        default:
+            return _ems_message_member_set_unsupported;
+    }
+}
+
+static
+int _ems_message_member_cmp_name(const void *a, const void *b)
+{
+    return strcmp((*(EMSMessageClassMember **)a)->name, (*(EMSMessageClassMember **)b)->name);
+}
+
+static
+int _ems_message_member_cmp_id(const void *a, const void *b)
+{
+    uint32_t ida = (*(EMSMessageClassMember **)a)->id;
+    uint32_t idb = (*(EMSMessageClassMember **)b)->id;
+    return ida < idb ? -1 : (ida > idb ? 1 : 0);
+}
+
+static
+void _ems_message_class_member_index_free(EMSMessageClassMemberIndex *index)
+{
+    if (index) {
+        ems_message_codec_free(index->codec);
+        ems_free(index->by_name);
+        ems_free(index->by_id);
+        ems_free(index);
+    }
+}
+
+/* Build the lookup tables. The caller has to hold msg_classes_lock. */
+static
+EMSMessageClassMemberIndex *_ems_message_class_member_index_build(EMSMessageClassInternal *cls)
+{
+    EMSMessageClassMemberIndex *index = ems_alloc0(sizeof(EMSMessageClassMemberIndex));
+    EMSMessageClassMember *member;
+    EMSList *tmp;
+    uint32_t max_id = 0;
+    size_t j;
+
+    for (tmp = cls->members; tmp; tmp = tmp->next) {
+        member = (EMSMessageClassMember *)tmp->data;
+        if (member->id > max_id)
+            max_id = member->id;
+        ++index->count;
+    }
+
+    index->by_name = ems_alloc(sizeof(EMSMessageClassMember *) * (index->count + 1));
+    for (tmp = cls->members, j = 0; tmp; tmp = tmp->next, ++j)
+        index->by_name[j] = (EMSMessageClassMember *)tmp->data;
+    qsort(index->by_name, index->count, sizeof(EMSMessageClassMember *), _ems_message_member_cmp_name);
+
+    if (max_id < EMS_MESSAGE_MEMBER_DENSE_IDS) {
+        /* The list is in reverse order of addition, so for duplicate ids
+         * the member added first wins. */
+        index->dense_ids = max_id + 1;
+        index->by_id = ems_alloc0(sizeof(EMSMessageClassMember *) * index->dense_ids);
+        for (tmp = cls->members; tmp; tmp = tmp->next)
+            index->by_id[((EMSMessageClassMember *)tmp->data)->id] = (EMSMessageClassMember *)tmp->data;
+    }
+    else {
+        index->by_id = ems_alloc(sizeof(EMSMessageClassMember *) * (index->count + 1));
+        memcpy(index->by_id, index->by_name, sizeof(EMSMessageClassMember *) * index->count);
+        qsort(index->by_id, index->count, sizeof(EMSMessageClassMember *), _ems_message_member_cmp_id);
+    }
+
+    if (cls->klass.flags & EMS_MESSAGE_CLASS_AUTO_CODEC) {
+        EMSMessageCodecOp *ops = ems_alloc(sizeof(EMSMessageCodecOp) * (index->count + 1));
+        for (j = 0; j < index->count; ++j) {
+            ops[j].type = index->by_name[j]->type;
+            ops[j].offset = index->by_name[j]->offset;
+            ops[j].capacity = 0;
+        }
+        index->codec = ems_message_codec_compile(ops, index->count, cls->klass.size);
+        ems_free(ops);
+    }
+
+    return index;
+}
+
+static inline
+EMSMessageClassMemberIndex *_ems_message_class_get_member_index(EMSMessageClassInternal *cls)
+{
+    EMSMessageClassMemberIndex *index = atomic_load_explicit(&cls->member_index, memory_order_acquire);
+    if (ems_likely(index != NULL))
+        return index;
+
+    pthread_mutex_lock(&msg_classes_lock);
+    if ((index = atomic_load_explicit(&cls->member_index, memory_order_relaxed)) == NULL) {
+        index = _ems_message_class_member_index_build(cls);
+        atomic_store_explicit(&cls->member_index, index, memory_order_release);
+    }
+    pthread_mutex_unlock(&msg_classes_lock);
+
+    return index;
+}
+
+int ems_message_type_add_member(uint32_t msgtype,
+                                EMSMessageMemberType member_type,
+                                uint32_t member_id,
+                                const char *member_name,
+                                size_t member_offset,
+                                EMSMessageClassSetMemberCallback member_set_cb)
+{
+    EMSList *tmp;
+    EMSMessageClassMember *member;
+    if (!member_name)
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&msg_classes_lock);
+
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msgtype);
+    if (!cls) {
+        pthread_mutex_unlock(&msg_classes_lock);
+        return EMS_ERROR_INVALID_ARGUMENT;
+    }
+
+    for (tmp = cls->members; tmp; tmp = tmp->next) {
+        if (!strcmp(((EMSMessageClassMember *)tmp->data)->name, member_name)) {
+            pthread_mutex_unlock(&msg_classes_lock);
+            return EMS_ERROR_MEMBER_ALREADY_PRESENT;
+        }
+    }
+
+    member = ems_alloc(sizeof(EMSMessageClassMember));
+    member->type   = member_type;
+    member->id     = member_id;
+    member->offset = member_offset;
+    member->set_cb = member_set_cb;
+    member->name   = strdup(member_name);
+    member->setter = _ems_message_member_get_setter(member);
+
+    cls->members = ems_list_prepend(cls->members, member);
+
+    /* Readers may still use the old index. Keep it until the class is freed. */
+    EMSMessageClassMemberIndex *index = atomic_exchange(&cls->member_index, NULL);
+    if (index)
+        cls->retired_indices = ems_list_prepend(cls->retired_indices, index);
+
+    pthread_mutex_unlock(&msg_classes_lock);
+
+    return EMS_OK;
+}
+
+static
+EMSMessageClassMember *_ems_message_type_get_member(EMSMessageClassInternal *cls, const char *member_name)
+{
+    EMSMessageClassMemberIndex *index = _ems_message_class_get_member_index(cls);
+    size_t lo = 0, hi = index->count, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(member_name, index->by_name[mid]->name);
+        if (cmp == 0)
+            return index->by_name[mid];
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+static
+EMSMessageClassMember *_ems_message_type_get_member_by_id(EMSMessageClassInternal *cls, uint32_t member_id)
+{
+    EMSMessageClassMemberIndex *index = _ems_message_class_get_member_index(cls);
+    size_t lo = 0, hi = index->count, mid;
+
+    if (index->dense_ids)
+        return member_id < index->dense_ids ? index->by_id[member_id] : NULL;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (index->by_id[mid]->id == member_id)
+            return index->by_id[mid];
+        if (member_id < index->by_id[mid]->id)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+static
+void _ems_message_class_member_free(EMSMessageClassMember *member)
+{
+    if (member) {
+        free(member->name);
+        ems_free(member);
+    }
+}
+
+static
+void _ems_message_class_internal_free(EMSMessageClassInternal *msgclass)
+{
+    ems_list_free_full(msgclass->members, (EMSDestroyNotifyFunc)_ems_message_class_member_free);
+    _ems_message_class_member_index_free(atomic_load(&msgclass->member_index));
+    ems_list_free_full(msgclass->retired_indices, (EMSDestroyNotifyFunc)_ems_message_class_member_index_free);
+    ems_message_pool_destroy(msgclass->pool);
+    ems_free(msgclass);
+}
+
+void ems_message_types_clear(void)
+{
+    EMSMessageClassTable *table, *retired;
+    EMSMessageClassInternal *cls;
+    size_t j;
+
+    pthread_mutex_lock(&msg_classes_lock);
+
+    for (j = 0; j < EMS_MESSAGE_CLASS_INTERNAL_SLOTS; ++j) {
+        if ((cls = atomic_exchange(&msg_classes_internal[j], NULL)) != NULL)
+            _ems_message_class_internal_free(cls);
+    }
+
+    table = atomic_exchange(&msg_classes, NULL);
+    if (table) {
+        for (j = 0; j <= table->mask; ++j) {
+            if ((cls = atomic_load(&table->slots[j].cls)) != NULL)
+                _ems_message_class_internal_free(cls);
+        }
+    }
+    while (table) {
+        retired = table->retired;
+        ems_free(table);
+        table = retired;
+    }
+
+    for (j = 0; j < 256; ++j) {
+        if (j != EMS_MESSAGE_COMPRESSOR_LZ)
+            atomic_store(&msg_compressors[j], NULL);
+    }
+    atomic_store(&msg_classes_conflated, 0);
+
+    pthread_mutex_unlock(&msg_classes_lock);
+}
+
+void ems_messages_set_magic(char *magic)
+{
+    memcpy(msg_magic, magic, 4);
+}
+
+static inline
+EMSMessage *_ems_message_new_empty(EMSMessageClassInternal *cls, uint64_t recipient_id, uint64_t sender_id)
+{
+    EMSMessage *msg = _ems_message_alloc(cls);
+    msg->type = cls->klass.msgtype;
+    msg->recipient_id = recipient_id;
+    msg->sender_id = sender_id;
+    atomic_store(&msg->reference_count, 1);
+
+    return msg;
+}
+
+static
+void _ems_message_set_valist(EMSMessageClassInternal *cls, EMSMessage *msg, va_list *args)
+{
+    char *key;
+    EMSMessageClassMember *member;
+
+    while ((key = va_arg(*args, char *)) != NULL) {
+        member = _ems_message_type_get_member(cls, key);
+        if (ems_likely(member != NULL)) {
+            member->setter(msg, member, args);
+        }
+        else {
+            fprintf(stderr, "Message has no member with the name `%s'\n", key);
+            (void)va_arg(*args, void *);
+        }
+    }
+}
+
+static
+void _ems_message_set_by_id_valist(EMSMessageClassInternal *cls, EMSMessage *msg, va_list *args)
+{
+    uint32_t member_id;
+    EMSMessageClassMember *member;
+
+    while ((member_id = va_arg(*args, uint32_t)) != EMS_MESSAGE_MEMBER_ID_END) {
+        member = _ems_message_type_get_member_by_id(cls, member_id);
+        if (ems_likely(member != NULL)) {
+            member->setter(msg, member, args);
+        }
+        else {
+            fprintf(stderr, "Message has no member with the id %u\n", member_id);
+            (void)va_arg(*args, void *);
+        }
+    }
+}
+
+/* Create a new message of the given type, followed by the recipient and sender ids.
+ * After this a “NULL, NULL”-terminated sequence of key/value-pairs may follow.
+ */
+EMSMessage *ems_message_new(uint32_t type, uint64_t recipient_id, uint64_t sender_id, ...)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
+    if (ems_unlikely(!cls))
+        return NULL;
+
+    EMSMessage *msg = _ems_message_new_empty(cls, recipient_id, sender_id);
+
+    va_list args;
+    va_start(args, sender_id);
+    _ems_message_set_valist(cls, msg, &args);
+    va_end(args);
+
+    return msg;
+}
+
+/* Create a new message, setting members by their numeric id. */
+EMSMessage *ems_message_new_by_id(uint32_t type, uint64_t recipient_id, uint64_t sender_id, ...)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
+    if (ems_unlikely(!cls))
+        return NULL;
+
+    EMSMessage *msg = _ems_message_new_empty(cls, recipient_id, sender_id);
+
+    va_list args;
+    va_start(args, sender_id);
+    _ems_message_set_by_id_valist(cls, msg, &args);
+    va_end(args);
+
+    return msg;
+}
+
+/* Shared members of duplicates belong to a hidden message, the owner. The first
+ * duplicate moves the members of the original there, so that neither the original
+ * nor the duplicate frees them. The owner is released with the last message sharing
+ * it. */
+static
+EMSMessage *_ems_message_share_members(EMSMessageClassInternal *cls, EMSMessage *msg)
+{
+    EMSMessage *owner = atomic_load_explicit(&msg->members_owner, memory_order_acquire);
+    EMSMessage *expected = NULL;
+
+    if (owner)
+        return owner;
+
+    owner = _ems_message_alloc(cls);
+    memcpy((char *)owner + sizeof(EMSMessage), (char *)msg + sizeof(EMSMessage), cls->klass.size - sizeof(EMSMessage));
+    owner->type = msg->type;
+    atomic_store(&owner->reference_count, 1);
+    if ((owner->payload = msg->payload) != NULL)
+        atomic_fetch_add(&owner->payload->reference_count, 1);
+
+    if (!atomic_compare_exchange_strong_explicit(&msg->members_owner, &expected, owner,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        /* Someone else shared the members, which are still the same. */
+        _ems_message_payload_unref(owner->payload);
+        _ems_message_release(cls, owner);
+        owner = expected;
+    }
+
+    return owner;
+}
+
+/* Stop sharing the members. If copy is set, the message gets private copies, otherwise
+ * the members are cleared. The copies are made from the current structure of the
+ * message, so values changed in it directly are kept. */
+static
+void _ems_message_unshare_members(EMSMessageClassInternal *cls, EMSMessage *msg, int copy)
+{
+    EMSMessage *owner = atomic_exchange(&msg->members_owner, NULL);
+    EMSMessage *current;
+
+    if (ems_likely(!owner))
+        return;
+
+    if (copy) {
+        /* The pointers in the snapshot still refer to the members of the owner. */
+        current = _ems_message_alloc(cls);
+        memcpy(current, msg, cls->klass.size);
+        memset((char *)msg + sizeof(EMSMessage), 0, cls->klass.size - sizeof(EMSMessage));
+        cls->klass.msg_copy(msg, current);
+        _ems_message_release(cls, current);
+    }
+    else {
+        memset((char *)msg + sizeof(EMSMessage), 0, cls->klass.size - sizeof(EMSMessage));
+    }
+    ems_message_unref(owner);
+}
+
+void ems_message_make_writable(EMSMessage *msg)
+{
+    EMSMessageClassInternal *cls;
+    ems_message_drop_encoding(msg);
+    if (msg && atomic_load(&msg->members_owner) && (cls = _ems_message_type_get_class(msg->type)) != NULL)
+        _ems_message_unshare_members(cls, msg, 1);
+}
+
+EMSMessagePriority ems_message_get_priority(EMSMessage *msg)
+{
+    EMSMessageClassInternal *cls;
+    if (ems_unlikely(!msg || (cls = _ems_message_type_get_class(msg->type)) == NULL))
+        return EMS_MESSAGE_PRIORITY_NORMAL;
+    if (cls->klass.priority == EMS_MESSAGE_PRIORITY_DEFAULT || cls->klass.priority > EMS_MESSAGE_PRIORITY_CONTROL)
+        return EMS_MESSAGE_PRIORITY_NORMAL;
+    return cls->klass.priority;
+}
+
+int ems_message_type_set_conflation_key(uint32_t msgtype, int by_sender, const char *member_name)
+{
+    EMSMessageClassMember *member = NULL;
+    EMSList *tmp;
+
+    pthread_mutex_lock(&msg_classes_lock);
+
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msgtype);
+    if (!cls || (msgtype & 0x80000000)) {
+        pthread_mutex_unlock(&msg_classes_lock);
+        return EMS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (member_name) {
+        for (tmp = cls->members; tmp; tmp = tmp->next) {
+            if (!strcmp(((EMSMessageClassMember *)tmp->data)->name, member_name)) {
+                member = (EMSMessageClassMember *)tmp->data;
+                break;
+            }
+        }
+        switch (member ? member->type : EMS_MSG_MEMBER_UNKNOWN) {
+            case EMS_MSG_MEMBER_UINT:
+            case EMS_MSG_MEMBER_INT:
+            case EMS_MSG_MEMBER_UINT64:
+            case EMS_MSG_MEMBER_INT64:
+            case EMS_MSG_MEMBER_POINTER:
+            case EMS_MSG_MEMBER_FIXED_STRING:
+            case EMS_MSG_MEMBER_STRING:
+            case EMS_MSG_MEMBER_SMALL_STRING:
+                break;
+            default:
+                pthread_mutex_unlock(&msg_classes_lock);
+                return EMS_ERROR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (cls->conflate)
+        atomic_fetch_sub(&msg_classes_conflated, 1);
+    cls->conflate_by_sender = by_sender != 0;
+    cls->conflate_member = member;
+    cls->conflate = by_sender || member;
+    if (cls->conflate)
+        atomic_fetch_add(&msg_classes_conflated, 1);
+
+    pthread_mutex_unlock(&msg_classes_lock);
+
+    return EMS_OK;
+}
+
+/* The bytes of the key member, which are compared and hashed. */
+static
+const void *_ems_message_key_member(EMSMessage *msg, EMSMessageClassMember *member, size_t *length)
+{
+    void *value = (void *)msg + member->offset;
+
+    switch (member->type) {
+        case EMS_MSG_MEMBER_UINT:
+        case EMS_MSG_MEMBER_INT:
+            *length = 4;
+            return value;
+        case EMS_MSG_MEMBER_UINT64:
+        case EMS_MSG_MEMBER_INT64:
+            *length = 8;
+            return value;
+        case EMS_MSG_MEMBER_POINTER:
+            *length = sizeof(void *);
+            return value;
+        case EMS_MSG_MEMBER_FIXED_STRING:
+            *length = strlen((char *)value);
+            return value;
+        case EMS_MSG_MEMBER_STRING:
+            value = *(char **)value;
+            *length = value ? strlen((char *)value) : 0;
+            return value;
+        case EMS_MSG_MEMBER_SMALL_STRING:
+            *length = ((EMSMessageSmallString *)value)->length;
+            return ems_message_small_string_get((EMSMessageSmallString *)value);
+        default:
+            *length = 0;
+            return NULL;
+    }
+}
+
+int ems_message_get_conflation_key(EMSMessage *msg, uint32_t *hash)
+{
+    EMSMessageClassInternal *cls;
+    const uint8_t *value;
+    uint64_t h;
+    size_t length, j;
+
+    if (ems_likely(atomic_load_explicit(&msg_classes_conflated, memory_order_relaxed) == 0) ||
+            !msg || (cls = _ems_message_type_get_class(msg->type)) == NULL || !cls->conflate)
+        return 0;
+
+    /* FNV-1a over the parts of the key. */
+    h = 0xcbf29ce484222325ull ^ msg->type;
+    h = (h ^ msg->recipient_id) * 0x100000001b3ull;
+    if (cls->conflate_by_sender)
+        h = (h ^ msg->sender_id) * 0x100000001b3ull;
+    if (cls->conflate_member) {
+        value = _ems_message_key_member(msg, cls->conflate_member, &length);
+        for (j = 0; j < length; ++j)
+            h = (h ^ value[j]) * 0x100000001b3ull;
+    }
+
+    *hash = (uint32_t)(h ^ (h >> 32));
+    return 1;
+}
+
+int ems_message_conflation_key_equal(EMSMessage *a, EMSMessage *b)
+{
+    EMSMessageClassInternal *cls;
+    const void *va, *vb;
+    size_t la, lb;
+
+    if (!a || !b || a->type != b->type || a->recipient_id != b->recipient_id ||
+            (cls = _ems_message_type_get_class(a->type)) == NULL || !cls->conflate)
+        return 0;
+    if (cls->conflate_by_sender && a->sender_id != b->sender_id)
+        return 0;
+    if (cls->conflate_member) {
+        va = _ems_message_key_member(a, cls->conflate_member, &la);
+        vb = _ems_message_key_member(b, cls->conflate_member, &lb);
+        if (la != lb || (la && memcmp(va, vb, la)))
+            return 0;
+    }
+    return 1;
+}
+
+/* Set members of an existing message by name. */
+int ems_message_set(EMSMessage *msg, ...)
+{
+    if (ems_unlikely(!msg))
+        return EMS_ERROR_INVALID_ARGUMENT;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    ems_message_drop_encoding(msg);
+    _ems_message_unshare_members(cls, msg, 1);
+
+    va_list args;
+    va_start(args, msg);
+    _ems_message_set_valist(cls, msg, &args);
+    va_end(args);
+
+    return EMS_OK;
+}
+
+/* Set members of an existing message by their numeric id. */
+int ems_message_set_by_id(EMSMessage *msg, ...)
+{
+    if (ems_unlikely(!msg))
+        return EMS_ERROR_INVALID_ARGUMENT;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    ems_message_drop_encoding(msg);
+    _ems_message_unshare_members(cls, msg, 1);
+
+    va_list args;
+    va_start(args, msg);
+    _ems_message_set_by_id_valist(cls, msg, &args);
+    va_end(args);
+
+    return EMS_OK;
+}
+
+static inline
+void _ems_message_write_header(EMSMessage *msg, uint8_t *buffer, size_t payload_size)
+{
+    memcpy((char *)buffer, msg_magic, 4);
+    ems_message_write_u32(buffer, 4, msg->type);
+    ems_message_write_u64(buffer, 8, msg->recipient_id);
+    ems_message_write_u64(buffer, 16, msg->sender_id);
+    ems_message_write_u32(buffer, 24, payload_size);
+}
+
+/* Flags in the second byte of the compact header. */
+#define EMS_MESSAGE_COMPACT_SENDER_IMPLIED (1 << 0)
+#define EMS_MESSAGE_COMPACT_RECIPIENT_ALL  (1 << 1)
+#define EMS_MESSAGE_COMPACT_INTERNAL       (1 << 2)
+#define EMS_MESSAGE_COMPACT_CHECKSUM       (1 << 3)
+
+/* The first byte of a compact header never matches the first byte of the magic. */
+static inline
+uint8_t _ems_message_compact_marker(void)
+{
+    return (uint8_t)msg_magic[0] ^ 0x80;
+}
+
+static inline
+size_t _ems_message_write_varint(uint8_t *buffer, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80) {
+        buffer[len++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    buffer[len++] = (uint8_t)value;
+    return len;
+}
+
+/* Returns the length of the varint, 0 if the buffer ends within it, or
+ * (size_t)-1 if it is longer than any 64 bit value. */
+static inline
+size_t _ems_message_read_varint(const uint8_t *buffer, size_t buflen, uint64_t *value)
+{
+    uint64_t result = 0;
+    size_t j;
+    for (j = 0; j < 10; ++j) {
+        if (j == buflen)
+            return 0;
+        result |= (uint64_t)(buffer[j] & 0x7f) << (7 * j);
+        if (!(buffer[j] & 0x80)) {
+            *value = result;
+            return j + 1;
+        }
+    }
+    return (size_t)-1;
+}
+
+size_t ems_message_write_header(EMSMessage *msg, uint8_t *buffer, size_t payload_size)
+{
+    _ems_message_write_header(msg, buffer, payload_size);
+    return EMS_MESSAGE_HEADER_SIZE;
+}
+
+size_t ems_message_write_compact_header(EMSMessage *msg, uint8_t *buffer, size_t payload_size,
+                                        uint64_t implied_sender, int checksum)
+{
+    uint8_t flags = checksum ? EMS_MESSAGE_COMPACT_CHECKSUM : 0;
+    size_t pos = 2;
+
+    if (msg->type & 0x80000000)
+        flags |= EMS_MESSAGE_COMPACT_INTERNAL;
+    pos += _ems_message_write_varint(&buffer[pos], msg->type & 0x7fffffff);
+
+    if (msg->recipient_id == EMS_MESSAGE_RECIPIENT_ALL)
+        flags |= EMS_MESSAGE_COMPACT_RECIPIENT_ALL;
+    else
+        pos += _ems_message_write_varint(&buffer[pos], msg->recipient_id);
+
+    if (msg->sender_id == implied_sender)
+        flags |= EMS_MESSAGE_COMPACT_SENDER_IMPLIED;
+    else
+        pos += _ems_message_write_varint(&buffer[pos], msg->sender_id);
+
+    pos += _ems_message_write_varint(&buffer[pos], payload_size);
+
+    buffer[0] = _ems_message_compact_marker();
+    buffer[1] = flags;
+
+    return pos;
+}
+
+/* The size of the encoded message including the header, or 0 if the class cannot tell. */
+static inline
+size_t _ems_message_get_encoded_size(EMSMessageClassInternal *cls, EMSMessage *msg)
+{
+    if (!cls->klass.msg_encode)
+        return EMS_MESSAGE_HEADER_SIZE;
+    if (cls->klass.msg_encoded_size)
+        return EMS_MESSAGE_HEADER_SIZE + cls->klass.msg_encoded_size(msg);
+    return 0;
+}
+
+/* Encode a message. This calls the function from the class or writes only the generic part. */
+size_t ems_message_encode(EMSMessage *msg, uint8_t **buffer)
+{
+    if (!msg)
+        return 0;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return 0;
+
+    size_t buflen = _ems_message_get_encoded_size(cls, msg);
+    if (!buflen)
+        buflen = EMS_MESSAGE_HEADER_SIZE + cls->klass.min_payload;
+    *buffer = ems_alloc(buflen);
+
+    _ems_message_write_header(msg, *buffer, 0);
+
+    if (cls->klass.msg_encode) {
+        buflen = cls->klass.msg_encode(msg, buffer, buflen);
+        ems_message_write_u32(*buffer, EMS_MESSAGE_HEADER_SIZE - 4, buflen - EMS_MESSAGE_HEADER_SIZE);
+    }
 
-typedef struct {
-    EMSMessageClass klass;
-    EMSList *members;        /* [EMSMessageClassMember] */
-} EMSMessageClassInternal;
+    return buflen;
+}
 
-/* FIXME: Use a better data structure here. For the moment, a list should suffice,
- * but we could think about some form of tree, possibly arranged in such a way that
- * more frequent messages are higher up the tree to reduce the absolute searching time.
- */
-EMSList *msg_classes = NULL;
+/* The size of the encoded message including the header, or 0 if it is not known in advance. */
+size_t ems_message_get_encoded_size(EMSMessage *msg)
+{
+    if (ems_unlikely(!msg))
+        return 0;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return 0;
 
-/* A magic 4 byte string indicating a message of this library. */
-char msg_magic[] = "EMSG";
+    return _ems_message_get_encoded_size(cls, msg);
+}
 
-void ems_message_free(EMSMessage *msg);
+/* Encode a message into a buffer provided by the caller. */
+size_t ems_message_encode_into(EMSMessage *msg, uint8_t *buffer, size_t buflen)
+{
+    if (ems_unlikely(!msg || !buffer))
+        return 0;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return 0;
+
+    size_t size = _ems_message_get_encoded_size(cls, msg);
+    if (!size || size > buflen)
+        return 0;
+
+    _ems_message_write_header(msg, buffer, size - EMS_MESSAGE_HEADER_SIZE);
+
+    if (cls->klass.msg_encode)
+        cls->klass.msg_encode(msg, &buffer, size);
+
+    return size;
+}
+
+struct _EMSMessageEncoding {
+    /* Held by the message and by everyone sending it. */
+    atomic_int reference_count;
+    size_t length;
+    uint8_t *buffer;
+    /* See ems_message_encoding_get_frame. Points to this encoding if the
+     * payload is not compressed, and is freed with it otherwise. */
+    _Atomic(EMSMessageEncoding *) compressed;
+};
+
+/* Taking a reference to the encoding of a message must not race with dropping it.
+ * Messages are spread over these locks by their address. */
+#define EMS_MESSAGE_ENCODING_LOCKS 64
+static pthread_mutex_t msg_encoding_locks[EMS_MESSAGE_ENCODING_LOCKS] = {
+    [0 ... EMS_MESSAGE_ENCODING_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
 static inline
-EMSMessageClassInternal *_ems_message_type_get_class(uint32_t type)
+pthread_mutex_t *_ems_message_encoding_lock(EMSMessage *msg)
 {
-    EMSList *tmp;
-    for (tmp = msg_classes; tmp; tmp = tmp->next) {
-        if (((EMSMessageClass *)tmp->data)->msgtype == type)
-            return (EMSMessageClassInternal *)tmp->data;
+    return &msg_encoding_locks[((uintptr_t)msg / EMS_CACHE_LINE_SIZE) % EMS_MESSAGE_ENCODING_LOCKS];
+}
+
+static
+void _ems_message_encoding_free(EMSMessageEncoding *encoding)
+{
+    EMSMessageEncoding *compressed = atomic_load(&encoding->compressed);
+    if (compressed && compressed != encoding) {
+        ems_free(compressed->buffer);
+        ems_free(compressed);
     }
-    return NULL;
+    ems_free(encoding->buffer);
+    ems_free(encoding);
 }
 
-/* Register a new message type. The type id shall be a user definded constant, since we want
- * to use this by multiple, heterogenous hosts. Therefore, we cannot return the type id from
- * an internal register.
- * Return an error if the type is already there. Internal messages all have the high bit set,
- * so avoiding those ids, there should be no type clash.
- * The user has to provide the functions for encoding/decoding the message as well as
- * setting values by key.
- */
-int ems_message_register_type(uint32_t type, EMSMessageClass *msg_class)
+/* The first caller encodes the message and publishes the result. If two threads
+ * race, the loser drops its own encoding and uses the published one. */
+EMSMessageEncoding *ems_message_get_encoding(EMSMessage *msg)
 {
-    if (_ems_message_type_get_class(type))
-        return EMS_ERROR_MESSAGE_TYPE_EXISTS;
+    EMSMessageEncoding *encoding, *published;
+    pthread_mutex_t *lock;
 
-    EMSMessageClassInternal *new_class = ems_alloc(sizeof(EMSMessageClassInternal));
-    if (msg_class) {
-        *((EMSMessageClass *)new_class) = *msg_class;
-        new_class->members = NULL;
+    if (ems_unlikely(!msg))
+        return NULL;
+
+    lock = _ems_message_encoding_lock(msg);
+    pthread_mutex_lock(lock);
+    if ((encoding = atomic_load_explicit(&msg->encoding, memory_order_relaxed)) != NULL)
+        atomic_fetch_add_explicit(&encoding->reference_count, 1, memory_order_relaxed);
+    pthread_mutex_unlock(lock);
+    if (encoding)
+        return encoding;
+
+    encoding = ems_alloc(sizeof(EMSMessageEncoding));
+    atomic_init(&encoding->reference_count, 2);
+    atomic_init(&encoding->compressed, NULL);
+    encoding->length = ems_message_encode(msg, &encoding->buffer);
+    if (ems_unlikely(!encoding->length)) {
+        ems_free(encoding);
+        return NULL;
     }
-    else {
-        memset(new_class, 0, sizeof(EMSMessageClass));
-        new_class->klass.size = sizeof(EMSMessage);
+
+    pthread_mutex_lock(lock);
+    if ((published = atomic_load_explicit(&msg->encoding, memory_order_relaxed)) != NULL)
+        atomic_fetch_add_explicit(&published->reference_count, 1, memory_order_relaxed);
+    else
+        atomic_store_explicit(&msg->encoding, encoding, memory_order_relaxed);
+    pthread_mutex_unlock(lock);
+
+    if (published) {
+        _ems_message_encoding_free(encoding);
+        encoding = published;
     }
-    new_class->klass.msgtype = type;
 
-    msg_classes = ems_list_prepend(msg_classes, new_class);
+    return encoding;
+}
 
-    return EMS_OK;
+void ems_message_encoding_unref(EMSMessageEncoding *encoding)
+{
+    if (encoding && atomic_fetch_sub_explicit(&encoding->reference_count, 1, memory_order_acq_rel) == 1)
+        _ems_message_encoding_free(encoding);
 }
 
-int ems_message_type_add_member(uint32_t msgtype,
-                                EMSMessageMemberType member_type,
-                                uint32_t member_id,
-                                const char *member_name,
-                                size_t member_offset,
-                                EMSMessageClassSetMemberCallback member_set_cb)
+void ems_message_drop_encoding(EMSMessage *msg)
 {
-    EMSList *tmp;
-    EMSMessageClassMember *member;
-    if (!member_name)
-        return EMS_ERROR_INVALID_ARGUMENT;
+    EMSMessageEncoding *encoding;
+    pthread_mutex_t *lock;
 
-    EMSMessageClassInternal *cls = _ems_message_type_get_class(msgtype);
-    if (!cls)
-        return EMS_ERROR_INVALID_ARGUMENT;
+    if (!msg || !atomic_load_explicit(&msg->encoding, memory_order_relaxed))
+        return;
 
-    for (tmp = cls->members; tmp; tmp = tmp->next) {
-        if (!strcmp(((EMSMessageClassMember *)tmp->data)->name, member_name))
-            return EMS_ERROR_MEMBER_ALREADY_PRESENT;
-    }
+    lock = _ems_message_encoding_lock(msg);
+    pthread_mutex_lock(lock);
+    encoding = atomic_exchange_explicit(&msg->encoding, NULL, memory_order_relaxed);
+    pthread_mutex_unlock(lock);
 
-    member = ems_alloc(sizeof(EMSMessageClassMember));
-    member->type   = member_type;
-    member->id     = member_id;
-    member->offset = member_offset;
-    member->set_cb = member_set_cb;
-    member->name   = strdup(member_name);
+    ems_message_encoding_unref(encoding);
+}
 
-    cls->members = ems_list_prepend(cls->members, member);
+int ems_message_register_compressor(const EMSMessageCompressor *compressor)
+{
+    const EMSMessageCompressor *expected = NULL;
+
+    if (!compressor || !compressor->id || !compressor->compress || !compressor->decompress)
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    if (!atomic_compare_exchange_strong(&msg_compressors[compressor->id], &expected, compressor))
+        return EMS_ERROR_COMPRESSOR_EXISTS;
 
     return EMS_OK;
 }
 
+/* The CPU time of the calling thread, for the compression statistics. */
+static inline
+uint64_t _ems_message_cpu_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* The compressed payload starts with the compressor id and the original size. */
+#define EMS_MESSAGE_COMPRESSED_PREFIX_SIZE 5
+
+/* Compress the payload of the encoding. Returns the encoding itself if the class
+ * does not compress this message or the payload does not get smaller. */
 static
-EMSMessageClassMember *_ems_message_type_get_member(EMSMessageClassInternal *cls, const char *member_name)
+EMSMessageEncoding *_ems_message_compress_encoding(EMSMessageEncoding *encoding)
 {
-    EMSList *tmp;
-    for (tmp = cls->members; tmp; tmp = tmp->next) {
-        if (!strcmp(((EMSMessageClassMember *)tmp->data)->name, member_name))
-            return (EMSMessageClassMember *)tmp->data;
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(ems_message_read_u32(encoding->buffer, 4));
+    size_t payload_size = encoding->length - EMS_MESSAGE_HEADER_SIZE;
+    const EMSMessageCompressor *compressor;
+    EMSMessageEncoding *compressed;
+    uint8_t *buffer;
+    uint64_t start;
+    size_t size;
+
+    if (!cls || !cls->klass.compress_threshold || payload_size < cls->klass.compress_threshold)
+        return encoding;
+    /* The compressed data has to be smaller than the payload, and the size field
+     * needs its high bit for the flag. */
+    if (payload_size <= EMS_MESSAGE_COMPRESSED_PREFIX_SIZE + 1 || payload_size > 0x7fffffff)
+        return encoding;
+
+    compressor = atomic_load_explicit(&msg_compressors[cls->klass.compressor ? cls->klass.compressor
+                                                                              : EMS_MESSAGE_COMPRESSOR_LZ],
+                                      memory_order_acquire);
+    if (ems_unlikely(!compressor))
+        return encoding;
+
+    buffer = ems_alloc(encoding->length);
+
+    start = _ems_message_cpu_time_ns();
+    size = compressor->compress(&encoding->buffer[EMS_MESSAGE_HEADER_SIZE], payload_size,
+                                &buffer[EMS_MESSAGE_HEADER_SIZE + EMS_MESSAGE_COMPRESSED_PREFIX_SIZE],
+                                payload_size - EMS_MESSAGE_COMPRESSED_PREFIX_SIZE - 1);
+    atomic_fetch_add_explicit(&cls->compress_ns, _ems_message_cpu_time_ns() - start, memory_order_relaxed);
+
+    if (!size) {
+        atomic_fetch_add_explicit(&cls->rejected, 1, memory_order_relaxed);
+        ems_free(buffer);
+        return encoding;
     }
-    return NULL;
+    size += EMS_MESSAGE_COMPRESSED_PREFIX_SIZE;
+
+    memcpy(buffer, encoding->buffer, EMS_MESSAGE_HEADER_SIZE - 4);
+    ems_message_write_u32(buffer, EMS_MESSAGE_HEADER_SIZE - 4, size | EMS_MESSAGE_PAYLOAD_COMPRESSED);
+    buffer[EMS_MESSAGE_HEADER_SIZE] = compressor->id;
+    ems_message_write_u32(buffer, EMS_MESSAGE_HEADER_SIZE + 1, payload_size);
+
+    compressed = ems_alloc(sizeof(EMSMessageEncoding));
+    compressed->length = EMS_MESSAGE_HEADER_SIZE + size;
+    compressed->buffer = ems_realloc(buffer, compressed->length);
+    atomic_init(&compressed->compressed, NULL);
+
+    atomic_fetch_add_explicit(&cls->compressed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cls->bytes_in, payload_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cls->bytes_out, size, memory_order_relaxed);
+
+    return compressed;
 }
 
-static
-void _ems_message_class_member_free(EMSMessageClassMember *member)
+/* The compressed frame is published like the encoding in ems_message_get_encoding. */
+const uint8_t *ems_message_encoding_get_frame(EMSMessageEncoding *encoding, int compressed, size_t *length)
 {
-    if (member) {
-        free(member->name);
-        ems_free(member);
+    EMSMessageEncoding *frame, *expected = NULL;
+
+    if (ems_unlikely(!encoding))
+        return NULL;
+
+    frame = encoding;
+    if (compressed && (frame = atomic_load_explicit(&encoding->compressed, memory_order_acquire)) == NULL) {
+        frame = _ems_message_compress_encoding(encoding);
+        if (!atomic_compare_exchange_strong_explicit(&encoding->compressed, &expected, frame,
+                                                     memory_order_acq_rel, memory_order_acquire)) {
+            if (frame != encoding) {
+                ems_free(frame->buffer);
+                ems_free(frame);
+            }
+            frame = expected;
+        }
     }
+
+    if (length)
+        *length = frame->length;
+
+    return frame->buffer;
 }
 
-static
-void _ems_message_class_internal_free(EMSMessageClassInternal *msgclass)
+static inline
+void _ems_message_payload_unref(EMSMessagePayload *payload)
 {
-    ems_list_free_full(msgclass->members, (EMSDestroyNotifyFunc)_ems_message_class_member_free);
-    ems_free(msgclass);
+    if (payload && atomic_fetch_sub(&payload->reference_count, 1) == 1)
+        ems_free(payload);
 }
 
-void ems_message_types_clear(void)
+uint8_t *ems_message_alloc_payload(EMSMessage *msg, size_t size)
 {
-    ems_list_free_full(msg_classes, (EMSDestroyNotifyFunc)_ems_message_class_internal_free);
-    msg_classes = NULL;
+    EMSMessageClassInternal *cls = msg ? _ems_message_type_get_class(msg->type) : NULL;
+    EMSMessagePayload *payload;
+
+    if (!cls || !(cls->klass.flags & EMS_MESSAGE_CLASS_ZERO_COPY))
+        return ems_alloc(size);
+
+    payload = ems_alloc(sizeof(EMSMessagePayload) + size);
+    atomic_store(&payload->reference_count, 1);
+    payload->length = size;
+
+    _ems_message_payload_unref(msg->payload);
+    msg->payload = payload;
+
+    return payload->data;
 }
 
-void ems_messages_set_magic(char *magic)
+void ems_message_release_payload(EMSMessage *msg, uint8_t *payload)
 {
-    memcpy(msg_magic, magic, 4);
+    if (msg && msg->payload && payload == msg->payload->data)
+        return;
+    ems_free(payload);
 }
 
-/* Create a new message of the given type, followed by the recipient and sender ids.
- * After this a “NULL, NULL”-terminated sequence of key/value-pairs may follow.
- */
-EMSMessage *ems_message_new(uint32_t type, uint64_t recipient_id, uint64_t sender_id, ...)
+uint8_t *ems_message_decompress_payload(EMSMessage *msg, const uint8_t *data, size_t length, size_t max_size,
+                                        size_t *payload_size)
 {
-    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
-    if (ems_unlikely(!cls))
-        return NULL;
+    const EMSMessageCompressor *compressor;
+    EMSMessageClassInternal *cls;
+    uint8_t *payload;
+    uint64_t start;
+    size_t size;
 
-    EMSMessage *msg = ems_alloc0(cls->klass.size);
-    msg->type = type;
-    msg->recipient_id = recipient_id;
-    msg->sender_id = sender_id;
-    atomic_store(&msg->reference_count, 1);
+    if (ems_unlikely(!msg || !data || length <= EMS_MESSAGE_COMPRESSED_PREFIX_SIZE))
+        return NULL;
+    if (ems_unlikely((cls = _ems_message_type_get_class(msg->type)) == NULL))
+        return NULL;
+    if (ems_unlikely((compressor = atomic_load_explicit(&msg_compressors[data[0]], memory_order_acquire)) == NULL))
+        return NULL;
 
-    va_list args;
-    va_start(args, sender_id);
+    /* The size comes from the wire, check it before allocating. */
+    size = ems_message_read_u32((uint8_t *)data, 1);
+    if (ems_unlikely(!size || size > 0x7fffffff || (max_size && size > max_size)))
+        return NULL;
 
-    char *key;
-    EMSMessageClassMember *member;
+    payload = ems_message_alloc_payload(msg, size);
 
-    while ((key = va_arg(args, char *)) != NULL) {
-        member =  _ems_message_type_get_member(cls, key);
-        if (ems_unlikely(!member)) {
-            fprintf(stderr, "Message has no member with the name `%s'\n", key);
-            (void)va_arg(args, void *);
-        }
-        else if (member->set_cb) {
-            member->set_cb(msg,
-                           member->id,
-                           (void *)(((void *)msg) + member->offset),
-                           va_arg(args, void *));
-        }
-        else {
-            switch (member->type) {
-                case EMS_MSG_MEMBER_INT:
-                    *((int *)(((void *)msg) + member->offset)) = va_arg(args, int);
-                    break;
-                case EMS_MSG_MEMBER_INT64:
-                    *((int64_t *)(((void *)msg) + member->offset)) = va_arg(args, int64_t);
-                    break;
-                case EMS_MSG_MEMBER_UINT:
-                    *((uint32_t *)(((void *)msg) + member->offset)) = va_arg(args, uint32_t);
-                    break;
-                case EMS_MSG_MEMBER_UINT64:
-                    *((uint64_t *)(((void *)msg) + member->offset)) = va_arg(args, uint64_t);
-                    break;
-                case EMS_MSG_MEMBER_DOUBLE:
-                    *((double *)(((void *)msg) + member->offset)) = va_arg(args, double);
-                    break;
-                case EMS_MSG_MEMBER_POINTER:
-                    *((void **)(((void *)msg) + member->offset)) = va_arg(args, void *);
-                    break;
-                case EMS_MSG_MEMBER_FIXED_STRING:
-                    strcpy((char *)(((void *)msg) + member->offset), va_arg(args, char *));
-                    break;
-                case EMS_MSG_MEMBER_STRING:
-                    {
-                        char *value = va_arg(args, char *);
-                        size_t len = value ? strlen(value) : 0;
-                                                ems_free(*(char **)(((void *)msg) + member->offset));
-
-                        *((char **)(((void *)msg) + member->offset)) = ems_alloc(len + 1);
-
-                        if (value)
-                            strncpy(*(char **)(((void *)msg) + member->offset), value, len + 1);
-                        else
-                            (*((char **)(((void *)msg) + member->offset)))[0] = 0;
-                    }
-                    break;
-/*                case EMS_MSG_MEMBER_ARRAY:
-                    ems_array_copy(((EMSArray *)(((void *)msg) + member->offset)),
-                                   (EMSArray *)va_arg(args, void *));
-                    break;*/
-                default:
-                    fprintf(stderr, "Unable to set value of type %d in member `%s'\n", member->type, key);
-                    (void)va_arg(args, void *);
-                    break;
-            }
-        }
+    start = _ems_message_cpu_time_ns();
+    if (compressor->decompress(&data[EMS_MESSAGE_COMPRESSED_PREFIX_SIZE], length - EMS_MESSAGE_COMPRESSED_PREFIX_SIZE,
+                               payload, size) != size) {
+        ems_message_release_payload(msg, payload);
+        return NULL;
     }
+    atomic_fetch_add_explicit(&cls->decompress_ns, _ems_message_cpu_time_ns() - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cls->decompressed, 1, memory_order_relaxed);
 
-    va_end(args);
+    if (payload_size)
+        *payload_size = size;
 
-    return msg;
+    return payload;
 }
 
-/* Encode a message. This calls the function from the class or writes only the generic part. */
-size_t ems_message_encode(EMSMessage *msg, uint8_t **buffer)
+int ems_message_type_get_compression_stats(uint32_t type, EMSMessageCompressionStats *stats)
 {
-    if (!msg)
-        return 0;
-    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
-    if (ems_unlikely(!cls))
-        return 0;
-
-    size_t buflen = EMS_MESSAGE_HEADER_SIZE + cls->klass.min_payload;
-    *buffer = ems_alloc(buflen);
-
-    memcpy((char *)(*buffer), msg_magic, 4);
-    ems_message_write_u32(*buffer, 4, msg->type);
-    ems_message_write_u64(*buffer, 8, msg->recipient_id);
-    ems_message_write_u64(*buffer, 16, msg->sender_id);
-    ems_message_write_u32(*buffer, 24, 0);
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
+    if (ems_unlikely(!cls || !stats))
+        return EMS_ERROR_INVALID_ARGUMENT;
 
-    if (cls->klass.msg_encode) {
-        buflen = cls->klass.msg_encode(msg, buffer, buflen);
-        ems_message_write_u32(*buffer, EMS_MESSAGE_HEADER_SIZE - 4, buflen - EMS_MESSAGE_HEADER_SIZE);
-    }
+    stats->compressed    = atomic_load_explicit(&cls->compressed, memory_order_relaxed);
+    stats->rejected      = atomic_load_explicit(&cls->rejected, memory_order_relaxed);
+    stats->bytes_in      = atomic_load_explicit(&cls->bytes_in, memory_order_relaxed);
+    stats->bytes_out     = atomic_load_explicit(&cls->bytes_out, memory_order_relaxed);
+    stats->compress_ns   = atomic_load_explicit(&cls->compress_ns, memory_order_relaxed);
+    stats->decompressed  = atomic_load_explicit(&cls->decompressed, memory_order_relaxed);
+    stats->decompress_ns = atomic_load_explicit(&cls->decompress_ns, memory_order_relaxed);
 
-    return buflen;
+    return EMS_OK;
 }
 
 /* Decode a message. */
@@ -267,6 +1503,22 @@ void ems_message_decode_payload(EMSMessage *msg, uint8_t *payload, size_t payloa
         cls->klass.msg_decode(msg, payload, payload_size);
 }
 
+static inline
+EMSMessage *_ems_message_new_received(uint32_t type, uint64_t recipient_id, uint64_t sender_id)
+{
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
+    if (ems_unlikely(!cls))
+        return NULL;
+
+    EMSMessage *msg = _ems_message_alloc(cls);
+    msg->type = type;
+    msg->recipient_id = recipient_id;
+    msg->sender_id = sender_id;
+    atomic_store(&msg->reference_count, 1);
+
+    return msg;
+}
+
 EMSMessage *ems_message_decode_header(uint8_t *buffer, size_t buflen, size_t *payload_size)
 {
     if (buflen < EMS_MESSAGE_HEADER_SIZE || !buffer)
@@ -275,33 +1527,111 @@ EMSMessage *ems_message_decode_header(uint8_t *buffer, size_t buflen, size_t *pa
     if (strncmp((char *)buffer, msg_magic, 4))
         return NULL;
 
-    uint32_t type = ems_message_read_u32(buffer, 4);
-    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
-    if (ems_unlikely(!cls))
+    EMSMessage *msg = _ems_message_new_received(ems_message_read_u32(buffer, 4),
+                                                ems_message_read_u64(buffer, 8),
+                                                ems_message_read_u64(buffer, 16));
+    if (ems_unlikely(!msg))
         return NULL;
 
-    EMSMessage *msg = ems_alloc(cls->klass.size);
-    msg->type = type;
-    msg->recipient_id = ems_message_read_u64(buffer, 8);
-    msg->sender_id = ems_message_read_u64(buffer, 16);
-    atomic_store(&msg->reference_count, 1);
-
     if (payload_size)
         *payload_size = (size_t)ems_message_read_u32(buffer, 24);
 
     return msg;
 }
 
+int ems_message_decode_frame_header(uint8_t *buffer, size_t buflen, uint64_t implied_sender,
+                                    EMSMessage **msg, EMSMessageFrameInfo *frame)
+{
+    uint64_t type, recipient_id, sender_id, size;
+    size_t pos, len;
+    uint8_t flags;
+
+    if (ems_unlikely(!buffer || !msg || !frame))
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    *msg = NULL;
+
+    if (buflen < 2)
+        return EMS_ERROR_INCOMPLETE;
+
+    if (buffer[0] != _ems_message_compact_marker()) {
+        if (buflen >= 4 && strncmp((char *)buffer, msg_magic, 4))
+            return EMS_ERROR_INVALID_ARGUMENT;
+        if (buflen < EMS_MESSAGE_HEADER_SIZE)
+            return EMS_ERROR_INCOMPLETE;
+
+        type         = ems_message_read_u32(buffer, 4);
+        recipient_id = ems_message_read_u64(buffer, 8);
+        sender_id    = ems_message_read_u64(buffer, 16);
+        size         = ems_message_read_u32(buffer, 24);
+        pos          = EMS_MESSAGE_HEADER_SIZE;
+        flags        = 0;
+    }
+    else {
+        flags = buffer[1];
+        pos = 2;
+
+#define READ_VARINT(value) do { \
+            if ((len = _ems_message_read_varint(&buffer[pos], buflen - pos, &(value))) == 0) \
+                return EMS_ERROR_INCOMPLETE; \
+            if (len == (size_t)-1) \
+                return EMS_ERROR_INVALID_ARGUMENT; \
+            pos += len; \
+        } while (0)
+
+        READ_VARINT(type);
+        if (type > 0x7fffffff)
+            return EMS_ERROR_INVALID_ARGUMENT;
+        if (flags & EMS_MESSAGE_COMPACT_INTERNAL)
+            type |= 0x80000000;
+
+        if (flags & EMS_MESSAGE_COMPACT_RECIPIENT_ALL)
+            recipient_id = EMS_MESSAGE_RECIPIENT_ALL;
+        else
+            READ_VARINT(recipient_id);
+
+        if (flags & EMS_MESSAGE_COMPACT_SENDER_IMPLIED)
+            sender_id = implied_sender;
+        else
+            READ_VARINT(sender_id);
+
+        READ_VARINT(size);
+        if (size > 0xffffffff)
+            return EMS_ERROR_INVALID_ARGUMENT;
+#undef READ_VARINT
+    }
+
+    frame->header_size  = pos;
+    frame->payload_size = (size_t)(size & ~(uint64_t)EMS_MESSAGE_PAYLOAD_COMPRESSED);
+    frame->compressed   = (size & EMS_MESSAGE_PAYLOAD_COMPRESSED) != 0;
+    frame->checksum     = (flags & EMS_MESSAGE_COMPACT_CHECKSUM) != 0;
+
+    if ((*msg = _ems_message_new_received((uint32_t)type, recipient_id, sender_id)) == NULL)
+        return EMS_ERROR_MESSAGE_TYPE_UNKNOWN;
+
+    return EMS_OK;
+}
+
 /* Free a message. */
 void ems_message_free(EMSMessage *msg)
 {
     EMSMessageClassInternal *cls;
+    EMSMessagePayload *payload;
+    EMSMessage *owner;
     if (msg) {
+        ems_message_drop_encoding(msg);
+        /* The members may point into the payload until the message is gone. */
+        payload = msg->payload;
         cls = _ems_message_type_get_class(msg->type);
-        if (cls && cls->klass.msg_free)
+        /* Shared members are freed with their owner. */
+        if ((owner = atomic_load(&msg->members_owner)) != NULL)
+            _ems_message_release(cls, msg);
+        else if (cls && cls->klass.msg_free)
             cls->klass.msg_free(msg);
         else
-            ems_free(msg);
+            _ems_message_release(cls, msg);
+        _ems_message_payload_unref(payload);
+        ems_message_unref(owner);
     }
 }
 
@@ -323,12 +1653,24 @@ int ems_message_copy(EMSMessage *dst, EMSMessage *src)
     if (!dst || !src || dst->type != src->type)
         return EMS_ERROR_MESSAGE_TYPE_MISMATCH;
 
+    ems_message_drop_encoding(dst);
+
     dst->recipient_id = src->recipient_id;
     dst->sender_id = src->sender_id;
 
     EMSMessageClassInternal *cls = _ems_message_type_get_class(src->type);
-    if (cls && cls->klass.msg_copy)
+    if (cls && cls->klass.msg_copy) {
+        _ems_message_unshare_members(cls, dst, 0);
         cls->klass.msg_copy(dst, src);
+    }
+
+    /* Borrowed members of src are shared with dst. */
+    if (dst->payload != src->payload) {
+        if (src->payload)
+            atomic_fetch_add(&src->payload->reference_count, 1);
+        _ems_message_payload_unref(dst->payload);
+        dst->payload = src->payload;
+    }
 
     return EMS_OK;
 }
@@ -343,7 +1685,7 @@ EMSMessage *ems_message_dup(EMSMessage *msg)
     if (ems_unlikely(!cls))
         return NULL;
 
-    EMSMessage *new_msg = ems_alloc0(cls->klass.size);
+    EMSMessage *new_msg = _ems_message_alloc(cls);
     new_msg->type = msg->type;
     atomic_store(&new_msg->reference_count, 1);
 
@@ -351,3 +1693,51 @@ EMSMessage *ems_message_dup(EMSMessage *msg)
 
     return new_msg;
 }
+
+/* Duplicate a message, sharing the members pointing to memory. */
+EMSMessage *ems_message_dup_shared(EMSMessage *msg)
+{
+    if (ems_unlikely(!msg))
+        return NULL;
+
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(msg->type);
+    if (ems_unlikely(!cls))
+        return NULL;
+
+    EMSMessage *new_msg = _ems_message_alloc(cls);
+    new_msg->type = msg->type;
+    atomic_store(&new_msg->reference_count, 1);
+
+    if (!cls->klass.msg_copy) {
+        ems_message_copy(new_msg, msg);
+        return new_msg;
+    }
+
+    EMSMessage *owner = _ems_message_share_members(cls, msg);
+    ems_message_ref(owner);
+
+    /* Members not pointing to memory may have been changed in msg directly. */
+    memcpy((char *)new_msg + sizeof(EMSMessage), (char *)msg + sizeof(EMSMessage), cls->klass.size - sizeof(EMSMessage));
+    new_msg->recipient_id = msg->recipient_id;
+    new_msg->sender_id = msg->sender_id;
+    if ((new_msg->payload = msg->payload) != NULL)
+        atomic_fetch_add(&new_msg->payload->reference_count, 1);
+    atomic_store_explicit(&new_msg->members_owner, owner, memory_order_release);
+
+    return new_msg;
+}
+
+/* Get statistics of the memory pool of a message type. */
+int ems_message_type_get_pool_stats(uint32_t type, EMSMessagePoolStats *stats)
+{
+    if (ems_unlikely(!stats))
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    EMSMessageClassInternal *cls = _ems_message_type_get_class(type);
+    if (!cls || !cls->pool)
+        return EMS_ERROR_INVALID_ARGUMENT;
+
+    ems_message_pool_get_stats(cls->pool, stats);
+
+    return EMS_OK;
+}
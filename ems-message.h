@@ -13,22 +13,86 @@
  * to ems-status-messages.h. */
 #define EMS_MESSAGE_USER                   0x00000010
 
-typedef struct {
+typedef struct _EMSMessageEncoding EMSMessageEncoding;
+typedef struct _EMSMessagePayload EMSMessagePayload;
+
+typedef struct _EMSMessage EMSMessage;
+
+/* The link of a message in an EMSMessageQueue, see ems-msg-queue.h. */
+typedef struct _EMSMessageQueueEntry EMSMessageQueueEntry;
+struct _EMSMessageQueueEntry {
+    EMSMessage *data;
+    EMSMessageQueueEntry *prev;
+    EMSMessageQueueEntry *next;
+    EMSMessageQueueEntry *type_prev; /* the queued messages of the same type */
+    EMSMessageQueueEntry *type_next;
+    uint64_t seq;                    /* position in the queue */
+    uint8_t level;                   /* the priority, see EMSMessagePriority */
+    uint8_t keyed;                   /* the entry is in the key table of the queue */
+    uint32_t key_hash;               /* see ems_message_get_conflation_key */
+    size_t bytes;                    /* counted against EMSMessageQueueLimits.max_bytes */
+    EMSMessageQueueEntry *key_next;  /* the next queued message in the same key bucket */
+};
+
+/* The priority of a message in queues. Higher priorities are served first, messages
+ * of the same priority in the order they were queued. */
+typedef enum {
+    /* Use the priority of the message class. */
+    EMS_MESSAGE_PRIORITY_DEFAULT = 0,
+    EMS_MESSAGE_PRIORITY_LOW,
+    EMS_MESSAGE_PRIORITY_NORMAL,
+    EMS_MESSAGE_PRIORITY_HIGH,
+    /* For control and heartbeat messages, which must not wait for bulk data. */
+    EMS_MESSAGE_PRIORITY_CONTROL,
+} EMSMessagePriority;
+
+#define EMS_MESSAGE_PRIORITY_COUNT EMS_MESSAGE_PRIORITY_CONTROL
+
+struct _EMSMessage {
     uint32_t type;           /* The application-defined message type. */
     uint64_t recipient_id;   /* The identifier of the recipient or (uint32_t)(-1) for all. */
     uint64_t sender_id;      /* The identifier of the sender. */
     atomic_int reference_count;
-} EMSMessage;
+
+    /* <private> */
+    _Atomic(EMSMessageEncoding *) encoding; /* see ems_message_get_encoding */
+    EMSMessagePayload *payload;             /* see EMS_MESSAGE_CLASS_ZERO_COPY */
+    _Atomic(EMSMessage *) members_owner;    /* see ems_message_dup_shared */
+    EMSMessageQueueEntry queue_entry;       /* used by the first queue holding the message */
+    atomic_bool queue_entry_used;
+};
 
 /* In the binary stream, the generic message header consists of the following:
  * 4 byte: magic string, indicating the start of a message used with this library
  * 4 byte: type, uint32_t in network byte order
  * 8 byte: recipient_id
  * 8 byte: sender_id
- * 4 byte: payload size
+ * 4 byte: payload size, the high bit is set for compressed payloads
  */
 #define EMS_MESSAGE_HEADER_SIZE 28 /* magic + the above + payload_size*/
 
+/* Connections may agree on a compact header instead (see ems_message_write_compact_header):
+ * 1 byte:    the first byte of the magic string with the high bit flipped
+ * 1 byte:    flags
+ * varint:    type without the high bit, which is given by a flag
+ * varint:    recipient_id, omitted if it is EMS_MESSAGE_RECIPIENT_ALL
+ * varint:    sender_id, omitted if it is implied by the connection
+ * varint:    payload size, as in the 28 byte header
+ * Varints use 7 bits per byte, least significant group first. If a flag says so, the
+ * payload is followed by a 4 byte CRC32C of the header and the payload.
+ */
+#define EMS_MESSAGE_COMPACT_HEADER_MAX_SIZE 32
+#define EMS_MESSAGE_CHECKSUM_SIZE 4
+
+/* Set in the payload size of the header if the payload is compressed. Such a payload
+ * starts with the 1 byte id of the compressor and the 4 byte size of the original
+ * payload, followed by the compressed data. */
+#define EMS_MESSAGE_PAYLOAD_COMPRESSED 0x80000000
+
+/* Describes a message type. New members are only ever appended, and 0 selects the
+ * default for all of them, so zero the structure (memset or "= { 0 }") before
+ * filling it in.
+ */
 typedef struct {
     /* The type of the message belonging to this class. */
     uint32_t msgtype;
@@ -51,14 +115,53 @@ typedef struct {
      */
     void (*msg_decode)(EMSMessage *, uint8_t *, size_t);
 
-    /* Free the message. If this is NULL, ems_free() will be used.
-     * Be sure to call ems_free on the message itself after freeing all other resources. */
+    /* Free the message. If this is NULL, the message is returned to the memory pool
+     * of its class. Be sure to call ems_free on the message itself after freeing all
+     * other resources. Messages of classes setting this are not pooled. */
     void (*msg_free)(EMSMessage *);
 
     /* Copy the message. */
     void (*msg_copy)(EMSMessage *, EMSMessage *);
+
+    /* Flags, see EMSMessageClassFlags. */
+    uint32_t flags;
+
+    /* Compress payloads of at least this many bytes when sending them to peers
+     * supporting compression. 0 disables compression. */
+    size_t compress_threshold;
+
+    /* The compressor to use, see ems_message_register_compressor.
+     * 0 selects EMS_MESSAGE_COMPRESSOR_LZ. */
+    uint8_t compressor;
+
+    /* The priority of the messages in queues, see EMSMessagePriority.
+     * EMS_MESSAGE_PRIORITY_DEFAULT means EMS_MESSAGE_PRIORITY_NORMAL. */
+    uint8_t priority;
+
+    /* Optional. Return the exact payload size msg_encode will produce for this message.
+     * If set, msg_encode always gets a buffer of at least this size (plus the header)
+     * and must not reallocate it.
+     */
+    size_t (*msg_encoded_size)(EMSMessage *);
 } EMSMessageClass;
 
+typedef enum {
+    /* Derive msg_encode, msg_decode, msg_copy and msg_free from the members added
+     * with ems_message_type_add_member. Functions set in the class take precedence.
+     * UINT, INT, UINT64, INT64, DOUBLE, FIXED_STRING, STRING, SMALL_STRING, BYTES and
+     * ARRAY members are encoded, and STRING, BYTES and ARRAY members as well as long
+     * SMALL_STRING members are freed with ems_free.
+     */
+    EMS_MESSAGE_CLASS_AUTO_CODEC = (1 << 0),
+
+    /* Keep the received payload with the decoded message instead of freeing it after
+     * msg_decode. The payload passed to msg_decode stays valid as long as the message
+     * (or a copy of it) exists, so the decoder may keep pointers into it. The generic
+     * codec decodes BYTES members as views into the payload.
+     */
+    EMS_MESSAGE_CLASS_ZERO_COPY  = (1 << 1),
+} EMSMessageClassFlags;
+
 /* Register a new message type. The type id shall be a user definded constant, since we want
  * to use this by multiple, heterogenous hosts. Therefore, we cannot return the type id from
  * an internal register.
@@ -81,9 +184,68 @@ typedef enum {
     EMS_MSG_MEMBER_POINTER = EMS_TYPE_POINTER,
     EMS_MSG_MEMBER_FIXED_STRING = EMS_TYPE_FIXED_STRING,
     EMS_MSG_MEMBER_STRING = EMS_TYPE_STRING,
+    EMS_MSG_MEMBER_BYTES = EMS_TYPE_BYTES,
+    EMS_MSG_MEMBER_ARRAY = EMS_TYPE_ARRAY,
+    EMS_MSG_MEMBER_SMALL_STRING = EMS_TYPE_SMALL_STRING,
     EMS_MSG_MEMBER_CUSTOM
 } EMSMessageMemberType;
 
+/* A sequence of bytes, the member type of EMS_MSG_MEMBER_BYTES. When setting the
+ * member, a pointer to an EMSMessageBytes is passed and the data is copied.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t length;
+} EMSMessageBytes;
+
+/* A contiguous array, the member type of EMS_MSG_MEMBER_ARRAY. The elements are of
+ * element_type, which is one of EMS_TYPE_UINT, EMS_TYPE_INT (32 bit), EMS_TYPE_UINT64,
+ * EMS_TYPE_INT64 or EMS_TYPE_DOUBLE. When setting the member, a pointer to an
+ * EMSMessageArray is passed and the elements are copied.
+ */
+typedef struct {
+    EMSType element_type;
+    size_t length;           /* number of elements */
+    void *data;
+} EMSMessageArray;
+
+/* A string, the member type of EMS_MSG_MEMBER_SMALL_STRING. Strings shorter than
+ * EMS_MESSAGE_SMALL_STRING_INLINE are stored in the message itself, only longer ones
+ * are allocated. When setting the member, a char * is passed like for STRING members,
+ * NULL gives an empty string. On the wire, both are the same. Read the string with
+ * ems_message_small_string_get.
+ */
+#define EMS_MESSAGE_SMALL_STRING_INLINE 24
+typedef struct {
+    union {
+        char inline_data[EMS_MESSAGE_SMALL_STRING_INLINE];
+        char *heap_data;      /* if length >= EMS_MESSAGE_SMALL_STRING_INLINE */
+    };
+    uint32_t length;
+} EMSMessageSmallString;
+
+/* The 0-terminated value of a small string. */
+static inline const char *ems_message_small_string_get(const EMSMessageSmallString *str)
+{
+    return str->length < EMS_MESSAGE_SMALL_STRING_INLINE ? str->inline_data : str->heap_data;
+}
+
+/* The size of an element of an EMSMessageArray, or 0 if the type is not supported. */
+static inline size_t ems_message_array_element_size(EMSType element_type)
+{
+    switch (element_type) {
+        case EMS_TYPE_UINT:
+        case EMS_TYPE_INT:
+            return 4;
+        case EMS_TYPE_UINT64:
+        case EMS_TYPE_INT64:
+        case EMS_TYPE_DOUBLE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
 /* Callback to set a member of a message.
  * EMSMessage *: pointer to the message
  * uint32_t:     identifier given during registration
@@ -118,21 +280,201 @@ void ems_messages_set_magic(char *magic);
  */
 EMSMessage *ems_message_new(uint32_t type, uint64_t recipient_id, uint64_t sender_id, ...);
 
+/* Terminates the id/value-pairs of the *_by_id functions. */
+#define EMS_MESSAGE_MEMBER_ID_END ((uint32_t)0xffffffff)
+
+/* Same as ems_message_new, but members are given by the member_id passed to
+ * ems_message_type_add_member instead of their name. This avoids the name lookup,
+ * but requires the ids to be unique within the class.
+ * The id/value-pairs are terminated by “EMS_MESSAGE_MEMBER_ID_END”.
+ */
+EMSMessage *ems_message_new_by_id(uint32_t type, uint64_t recipient_id, uint64_t sender_id, ...);
+
+/* Set members of an existing message by a “NULL, NULL”-terminated sequence of key/value-pairs. */
+int ems_message_set(EMSMessage *msg, ...);
+
+/* Set members of an existing message by an “EMS_MESSAGE_MEMBER_ID_END”-terminated
+ * sequence of id/value-pairs. */
+int ems_message_set_by_id(EMSMessage *msg, ...);
+
 /* Copy a message. */
 int ems_message_copy(EMSMessage *dst, EMSMessage *src);
 
 /* Duplicate a message. */
 EMSMessage *ems_message_dup(EMSMessage *msg);
 
+/* Duplicate a message copy-on-write. For classes with msg_copy, the duplicate gets its
+ * own copy of the message structure, but members pointing to memory, like strings, share
+ * that memory with the original. Values stored in the structure itself, like integers,
+ * may be changed in either message directly. Both get private copies of the shared
+ * members when they are changed with ems_message_set, ems_message_set_by_id or
+ * ems_message_copy. Before freeing or replacing such members otherwise, in the original
+ * as well as in the duplicate, call ems_message_make_writable.
+ */
+EMSMessage *ems_message_dup_shared(EMSMessage *msg);
+
+/* Make sure the members of msg are not shared with duplicates, see ems_message_dup_shared,
+ * and drop its encoding. Call this before changing a message directly. */
+void ems_message_make_writable(EMSMessage *msg);
+
+/* The priority of the message according to its class, never EMS_MESSAGE_PRIORITY_DEFAULT. */
+EMSMessagePriority ems_message_get_priority(EMSMessage *msg);
+
+/* Conflate the messages of a type in queues using EMS_MESSAGE_QUEUE_CONFLATE: a queued
+ * message is replaced by a newer one with the same key. The key is made up of the
+ * recipient, the sender if by_sender is set, and the member member_name unless it is
+ * NULL. Integer, pointer and string members may be used. Without sender and member,
+ * the type is not conflated. Set the key before messages of the type are queued.
+ */
+int ems_message_type_set_conflation_key(uint32_t msgtype, int by_sender, const char *member_name);
+
+/* Get the hash of the conflation key of msg. Returns 0 if its type is not conflated. */
+int ems_message_get_conflation_key(EMSMessage *msg, uint32_t *hash);
+
+/* Check whether two messages of the same conflated type have the same key. */
+int ems_message_conflation_key_equal(EMSMessage *a, EMSMessage *b);
+
 /* Encode a message. This calls the function from the class or writes only the generic part. */
 size_t ems_message_encode(EMSMessage *msg, uint8_t **buffer);
 
+/* The size of the encoded message including the header. Returns 0 if the class
+ * has a msg_encode function, but no msg_encoded_size. */
+size_t ems_message_get_encoded_size(EMSMessage *msg);
+
+/* Encode a message into a buffer provided by the caller. This only works if the
+ * size is known in advance, see ems_message_get_encoded_size.
+ * Returns the number of bytes written, or 0 if the buffer is too small or the size unknown.
+ */
+size_t ems_message_encode_into(EMSMessage *msg, uint8_t *buffer, size_t buflen);
+
+/* Get a reference to the encoded message. The message is only encoded on the first
+ * call, all further calls, possibly from other threads, share this encoding until it
+ * is dropped. Release the reference with ems_message_encoding_unref. Returns NULL if
+ * the message cannot be encoded.
+ */
+EMSMessageEncoding *ems_message_get_encoding(EMSMessage *msg);
+
+/* Release a reference from ems_message_get_encoding. */
+void ems_message_encoding_unref(EMSMessageEncoding *encoding);
+
+/* Drop the encoding cached with the message, so it is encoded anew. Holders of a
+ * reference keep using the old one. This is done by ems_message_set, ems_message_copy,
+ * ems_message_make_writable and ems_peer_send_message.
+ */
+void ems_message_drop_encoding(EMSMessage *msg);
+
+/* Get the frame of an encoding, valid as long as the reference is held. If compressed
+ * is set, the payload is compressed according to the class. Like the encoding, the
+ * compressed frame is built once and shared. If the class does not compress the
+ * message, or it does not get smaller, this is the plain frame. Only send compressed
+ * frames to peers supporting compression.
+ */
+const uint8_t *ems_message_encoding_get_frame(EMSMessageEncoding *encoding, int compressed, size_t *length);
+
+/* Decompress a payload received with EMS_MESSAGE_PAYLOAD_COMPRESSED. The result
+ * is allocated with ems_message_alloc_payload and its size stored in payload_size.
+ * Returns NULL if the data is invalid, the compressor unknown, or the announced size
+ * exceeds max_size (0 only keeps the limit of the wire format).
+ */
+uint8_t *ems_message_decompress_payload(EMSMessage *msg, const uint8_t *data, size_t length, size_t max_size,
+                                        size_t *payload_size);
+
+/* A compressor for payloads, see EMSMessageClass.compress_threshold. */
+typedef struct {
+    /* Identifies the compressor on the wire. Both sides have to register it. */
+    uint8_t id;
+
+    /* Compress length bytes from src to dst. Returns the compressed size, or 0 if
+     * it exceeds capacity. */
+    size_t (*compress)(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+    /* Decompress length bytes from src to dst. Returns the decompressed size,
+     * or 0 on errors. */
+    size_t (*decompress)(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+} EMSMessageCompressor;
+
+/* The bundled compressor of the LZ77 family, registered by default. */
+#define EMS_MESSAGE_COMPRESSOR_LZ 1
+
+/* Register a compressor. Ids are 1 to 255, and must not be in use. The compressor
+ * has to stay valid until ems_message_types_clear, which unregisters it. */
+int ems_message_register_compressor(const EMSMessageCompressor *compressor);
+
+/* Allocate a buffer for receiving the payload of msg. Pass it to ems_message_decode_payload
+ * and release it afterwards with ems_message_release_payload. For classes using
+ * EMS_MESSAGE_CLASS_ZERO_COPY, the buffer is attached to the message.
+ */
+uint8_t *ems_message_alloc_payload(EMSMessage *msg, size_t size);
+
+/* Release a buffer from ems_message_alloc_payload, unless the message keeps it. */
+void ems_message_release_payload(EMSMessage *msg, uint8_t *payload);
+
 /* Decode a message. */
 void ems_message_decode_payload(EMSMessage *msg, uint8_t *payload, size_t payload_size);
 
-/* Only decode the payload size. This is used to read the rest of the message. */
+/* Only decode the payload size. This is used to read the rest of the message.
+ * The size is the raw field, which may include EMS_MESSAGE_PAYLOAD_COMPRESSED. */
 EMSMessage *ems_message_decode_header(uint8_t *buffer, size_t buflen, size_t *payload_size);
 
+/* Write the EMS_MESSAGE_HEADER_SIZE byte header for msg to buffer. payload_size is the
+ * value of the size field. Returns the length of the header.
+ */
+size_t ems_message_write_header(EMSMessage *msg, uint8_t *buffer, size_t payload_size);
+
+/* Write a compact header for msg to buffer, which must hold EMS_MESSAGE_COMPACT_HEADER_MAX_SIZE
+ * bytes. payload_size is the value of the size field, including EMS_MESSAGE_PAYLOAD_COMPRESSED.
+ * The sender is omitted if it equals implied_sender, i.e., the id the receiver
+ * associates with the connection. If checksum is set, the header announces a
+ * checksum following the payload. Returns the length of the header.
+ */
+size_t ems_message_write_compact_header(EMSMessage *msg, uint8_t *buffer, size_t payload_size,
+                                        uint64_t implied_sender, int checksum);
+
+/* A frame as found by ems_message_decode_frame_header. */
+typedef struct {
+    size_t header_size;
+    size_t payload_size;     /* the size of the payload on the wire */
+    int    compressed;       /* see EMS_MESSAGE_PAYLOAD_COMPRESSED */
+    int    checksum;         /* the payload is followed by EMS_MESSAGE_CHECKSUM_SIZE bytes */
+} EMSMessageFrameInfo;
+
+/* Decode a header in either format from the start of buffer and create the message.
+ * Returns EMS_ERROR_INCOMPLETE if more data is needed and EMS_ERROR_INVALID_ARGUMENT
+ * if the data is no header. For EMS_ERROR_MESSAGE_TYPE_UNKNOWN, *msg is NULL, but the
+ * frame info is set, so the frame can be skipped.
+ */
+int ems_message_decode_frame_header(uint8_t *buffer, size_t buflen, uint64_t implied_sender,
+                                    EMSMessage **msg, EMSMessageFrameInfo *frame);
+
+/* Statistics of the memory pool of a message type. */
+typedef struct {
+    size_t   object_size;    /* size of a pooled object */
+    uint64_t allocs;         /* number of allocated messages */
+    uint64_t magazine_hits;  /* allocations served by the thread without locking */
+    uint64_t frees;          /* number of released messages */
+    uint64_t refills;        /* a thread got new objects from the pool */
+    uint64_t flushes;        /* a thread returned objects to the pool */
+    uint64_t slabs;          /* number of slabs allocated */
+} EMSMessagePoolStats;
+
+/* Get statistics of the memory pool of a message type. Classes with their own
+ * msg_free have no pool. */
+int ems_message_type_get_pool_stats(uint32_t type, EMSMessagePoolStats *stats);
+
+/* Compression statistics of a message type. */
+typedef struct {
+    uint64_t compressed;     /* number of compressed payloads */
+    uint64_t rejected;       /* payloads sent uncompressed, since they did not get smaller */
+    uint64_t bytes_in;       /* size of the compressed payloads before compression */
+    uint64_t bytes_out;      /* size of the compressed payloads after compression */
+    uint64_t compress_ns;    /* CPU time spent compressing, including rejected payloads */
+    uint64_t decompressed;   /* number of decompressed payloads */
+    uint64_t decompress_ns;  /* CPU time spent decompressing */
+} EMSMessageCompressionStats;
+
+/* Get the compression statistics of a message type. */
+int ems_message_type_get_compression_stats(uint32_t type, EMSMessageCompressionStats *stats);
+
 /* Increase reference count of a message. */
 void ems_message_ref(EMSMessage *msg);
 
@@ -153,6 +495,14 @@ typedef void (*EMSHandleMessage)(EMSMessage *, void *);
  * for you.
  */
 
+/* Write a 16 bit value to the payload at a given offset. */
+static inline void ems_message_write_u16(uint8_t *payload, uint32_t offset, uint16_t value)
+{
+    value = htons(value);
+    payload[offset    ] = value & 0xff;
+    payload[offset + 1] = (value >> 8) & 0xff;
+}
+
 /* Write a 32 bit value to the payload at a given offset. */
 static inline void ems_message_write_u32(uint8_t *payload, uint32_t offset, uint32_t value)
 {
@@ -172,14 +522,24 @@ static inline void ems_message_write_u64(uint8_t *payload, uint32_t offset, uint
     ems_message_write_u32(payload, offset + 4, vh);
 }
 
+/* Read a 16 bit value from the payload at a given offset. */
+static inline uint16_t ems_message_read_u16(uint8_t *payload, uint32_t offset)
+{
+    uint16_t value;
+    value = (uint16_t)(((payload[offset + 1] & 0xff) << 8) |
+                       (payload[offset] & 0xff));
+
+    return ntohs(value);
+}
+
 /* Read a 32 bit value from the payload at a given offset. */
 static inline uint32_t ems_message_read_u32(uint8_t *payload, uint32_t offset)
 {
     uint32_t value;
-    value = ((payload[offset + 3] & 0xff) << 24) |
-            ((payload[offset + 2] & 0xff) << 16) |
-            ((payload[offset + 1] & 0xff) << 8) |
-            (payload[offset] & 0xff);
+    value = ((uint32_t)(payload[offset + 3] & 0xff) << 24) |
+            ((uint32_t)(payload[offset + 2] & 0xff) << 16) |
+            ((uint32_t)(payload[offset + 1] & 0xff) << 8) |
+            ((uint32_t)payload[offset] & 0xff);
 
     return ntohl(value);
 }
@@ -194,3 +554,32 @@ static inline uint64_t ems_message_read_u64(uint8_t *payload, uint32_t offset)
 
     return (((uint64_t)vh) << 32) | (((uint64_t)vl) & 0x00000000ffffffff);
 }
+
+/* Write or read arrays of values. The result is the same as calling the functions
+ * above for each element (floats and doubles are treated as their bit patterns of
+ * 32 or 64 bit), but large arrays are converted with SIMD instructions if available.
+ * The payload need not be aligned.
+ */
+void ems_message_write_u16_array(uint8_t *payload, uint32_t offset, const uint16_t *values, size_t count);
+void ems_message_write_u32_array(uint8_t *payload, uint32_t offset, const uint32_t *values, size_t count);
+void ems_message_write_u64_array(uint8_t *payload, uint32_t offset, const uint64_t *values, size_t count);
+void ems_message_write_float_array(uint8_t *payload, uint32_t offset, const float *values, size_t count);
+void ems_message_write_double_array(uint8_t *payload, uint32_t offset, const double *values, size_t count);
+
+void ems_message_read_u16_array(uint8_t *payload, uint32_t offset, uint16_t *values, size_t count);
+void ems_message_read_u32_array(uint8_t *payload, uint32_t offset, uint32_t *values, size_t count);
+void ems_message_read_u64_array(uint8_t *payload, uint32_t offset, uint64_t *values, size_t count);
+void ems_message_read_float_array(uint8_t *payload, uint32_t offset, float *values, size_t count);
+void ems_message_read_double_array(uint8_t *payload, uint32_t offset, double *values, size_t count);
+
+/* The kernels used by the array functions, chosen by CPU when the library is loaded. */
+typedef enum {
+    EMS_MESSAGE_BULK_SCALAR = 0,
+    EMS_MESSAGE_BULK_SSSE3,
+    EMS_MESSAGE_BULK_AVX2
+} EMSMessageBulkKernels;
+
+/* Use other kernels for the array functions. Returns EMS_ERROR_INVALID_ARGUMENT if the
+ * CPU or the build lacks them. This is meant for benchmarks and tests, call it while
+ * no other thread converts arrays. */
+int ems_message_bulk_use_kernels(EMSMessageBulkKernels kernels);
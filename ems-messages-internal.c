@@ -8,16 +8,33 @@
 #include <stddef.h>
 
 /* __EMS_MESSAGE_SET_ID */
+/* The wire capabilities are only appended if there are some, so the message
+ * looks the same as before to old slaves. */
+static
+size_t _ems_message_int_set_id_encoded_size(EMSMessage *msg)
+{
+    return ((EMSMessageIntSetId *)msg)->wire_caps ? 12 : 8;
+}
+
 static
 size_t _ems_message_int_set_id_encode(EMSMessage *msg, uint8_t **buffer, size_t buflen)
 {
-    if (ems_unlikely(buflen < EMS_MESSAGE_HEADER_SIZE + 8))
-        *buffer = ems_realloc(*buffer, EMS_MESSAGE_HEADER_SIZE + 8);
+    size_t size = EMS_MESSAGE_HEADER_SIZE + _ems_message_int_set_id_encoded_size(msg);
+    if (ems_unlikely(buflen < size))
+        *buffer = ems_realloc(*buffer, size);
 
     /* the actual data */
     ems_message_write_u64(*buffer, EMS_MESSAGE_HEADER_SIZE, ((EMSMessageIntSetId *)msg)->peer_id);
+    if (((EMSMessageIntSetId *)msg)->wire_caps)
+        ems_message_write_u32(*buffer, EMS_MESSAGE_HEADER_SIZE + 8, ((EMSMessageIntSetId *)msg)->wire_caps);
 
-    return EMS_MESSAGE_HEADER_SIZE + 8;
+    return size;
+}
+
+static
+size_t _ems_message_int_u64_encoded_size(EMSMessage *msg)
+{
+    return 8;
 }
 
 static
@@ -25,16 +42,19 @@ void _ems_message_int_set_id_decode(EMSMessage *msg, uint8_t *payload, size_t bu
 {
     if (ems_unlikely(buflen < 8)) {
         ((EMSMessageIntSetId *)msg)->peer_id = 0;
+        ((EMSMessageIntSetId *)msg)->wire_caps = 0;
         return;
     }
 
     ((EMSMessageIntSetId *)msg)->peer_id = ems_message_read_u64(payload, 0);
+    ((EMSMessageIntSetId *)msg)->wire_caps = buflen >= 12 ? ems_message_read_u32(payload, 8) : 0;
 }
 
 static
 void _ems_message_int_set_id_copy(EMSMessage *dst, EMSMessage *src)
 {
     ((EMSMessageIntSetId *)dst)->peer_id = ((EMSMessageIntSetId *)src)->peer_id;
+    ((EMSMessageIntSetId *)dst)->wire_caps = ((EMSMessageIntSetId *)src)->wire_caps;
 }
 
 /* __EMS_MESSAGE_LEAVE */
@@ -105,6 +125,7 @@ int ems_messages_register_internal_types(void)
     msgclass.size          = sizeof(EMSMessageIntSetId);
     msgclass.min_payload   = 8;
     msgclass.msg_encode    = _ems_message_int_set_id_encode;
+    msgclass.msg_encoded_size = _ems_message_int_set_id_encoded_size;
     msgclass.msg_decode    = _ems_message_int_set_id_decode;
     msgclass.msg_copy      = _ems_message_int_set_id_copy;
 
@@ -117,6 +138,12 @@ int ems_messages_register_internal_types(void)
                                 "peer-id",
                                 offsetof(EMSMessageIntSetId, peer_id),
                                 NULL);
+    ems_message_type_add_member(__EMS_MESSAGE_SET_ID,
+                                EMS_MSG_MEMBER_UINT,
+                                1,
+                                "wire-caps",
+                                offsetof(EMSMessageIntSetId, wire_caps),
+                                NULL);
 
     /* __EMS_MESSAGE_LEAVE */
     memset(&msgclass, 0, sizeof(EMSMessageClass));
@@ -156,6 +183,7 @@ int ems_messages_register_internal_types(void)
     msgclass.size          = sizeof(EMSMessageIntConnectionDel);
     msgclass.min_payload   = 8;
     msgclass.msg_encode    = _ems_message_int_connection_del_encode;
+    msgclass.msg_encoded_size = _ems_message_int_u64_encoded_size;
     msgclass.msg_decode    = _ems_message_int_connection_del_decode;
     msgclass.msg_copy      = _ems_message_int_connection_del_copy;
 
@@ -177,6 +205,38 @@ int ems_messages_register_internal_types(void)
     if ((rc = ems_message_register_type(__EMS_MESSAGE_QUEUE_DISABLED, &msgclass)) != EMS_OK)
         return rc;
 
+    /* __EMS_MESSAGE_WIRE_CAPS */
+    memset(&msgclass, 0, sizeof(EMSMessageClass));
+    msgclass.msgtype       = __EMS_MESSAGE_WIRE_CAPS;
+    msgclass.size          = sizeof(EMSMessageIntWireCaps);
+    msgclass.flags         = EMS_MESSAGE_CLASS_AUTO_CODEC;
+
+    if ((rc = ems_message_register_type(__EMS_MESSAGE_WIRE_CAPS, &msgclass)) != EMS_OK)
+        return rc;
+
+    ems_message_type_add_member(__EMS_MESSAGE_WIRE_CAPS,
+                                EMS_MSG_MEMBER_UINT,
+                                0,
+                                "wire-caps",
+                                offsetof(EMSMessageIntWireCaps, wire_caps),
+                                NULL);
+
+    /* __EMS_MESSAGE_BATCH */
+    memset(&msgclass, 0, sizeof(EMSMessageClass));
+    msgclass.msgtype       = __EMS_MESSAGE_BATCH;
+    msgclass.size          = sizeof(EMSMessageIntBatch);
+
+    if ((rc = ems_message_register_type(__EMS_MESSAGE_BATCH, &msgclass)) != EMS_OK)
+        return rc;
+
+    /* __EMS_MESSAGE_WAKEUP */
+    memset(&msgclass, 0, sizeof(EMSMessageClass));
+    msgclass.msgtype       = __EMS_MESSAGE_WAKEUP;
+    msgclass.size          = sizeof(EMSMessageIntWakeup);
+
+    if ((rc = ems_message_register_type(__EMS_MESSAGE_WAKEUP, &msgclass)) != EMS_OK)
+        return rc;
+
     /* EMS_MESSAGE_STATUS_PEER_CHANGED */
     memset(&msgclass, 0, sizeof(EMSMessageClass));
     msgclass.msgtype       = EMS_MESSAGE_STATUS_PEER_CHANGED;
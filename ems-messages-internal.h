@@ -8,14 +8,22 @@
 #include "ems-message.h"
 
 /* Internal messages have the high bit set to 1. */
-/* When we accepted a new slave, inform it about its id. */
+/* When we accepted a new slave, inform it about its id. The master also offers
+ * the wire capabilities it supports. Older slaves ignore them. */
 #define __EMS_MESSAGE_SET_ID   0x80000001
 typedef struct {
     EMSMessage parent;
 
     uint64_t peer_id;
+    uint32_t wire_caps;
 } EMSMessageIntSetId;
 
+/* Wire capabilities of a connection. */
+#define EMS_WIRE_CAP_COMPACT_HEADER (1 << 0)
+#define EMS_WIRE_CAP_BATCH          (1 << 1)
+#define EMS_WIRE_CAP_COMPRESSION    (1 << 2)
+#define EMS_WIRE_CAP_CHECKSUM       (1 << 3)
+
 /* Either the master or the slave is about to leave */
 #define __EMS_MESSAGE_LEAVE    0x80000002
 typedef EMSMessage EMSMessageIntLeave;
@@ -46,5 +54,24 @@ typedef struct {
     EMSMessage parent;
 } EMSMessageQueueDisabled;
 
+/* The slave accepts the wire capabilities offered with __EMS_MESSAGE_SET_ID.
+ * This is only sent to masters offering some. */
+#define __EMS_MESSAGE_WIRE_CAPS 0x80000008
+typedef struct {
+    EMSMessage parent;
+
+    uint32_t wire_caps;
+} EMSMessageIntWireCaps;
+
+/* Several messages in one frame. The payload consists of the frames of the messages,
+ * each with a compact header. */
+#define __EMS_MESSAGE_BATCH 0x80000009
+typedef EMSMessage EMSMessageIntBatch;
+
+/* Wake up the event loop of a peer, so that it checks whether it is to stop.
+ * This is only pushed locally. */
+#define __EMS_MESSAGE_WAKEUP 0x8000000a
+typedef EMSMessage EMSMessageIntWakeup;
+
 /* Register those internal types. This gets called once from ems_init. */
 int ems_messages_register_internal_types(void);
@@ -1,23 +1,621 @@
 #include "ems-msg-queue.h"
 #include <memory.h>
 #include "ems-memory.h"
+#include "ems-error.h"
 #include "ems-util.h"
 #include "ems-messages-internal.h"
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
-struct _EMSMessageQueueEntry {
-    EMSMessage *data;
-    struct _EMSMessageQueueEntry *prev;
-    struct _EMSMessageQueueEntry *next;
+/* A message is linked into the first queue by the entry embedded in it. Only if it
+ * is in more than one queue at a time, further entries are allocated. */
+static inline
+EMSMessageQueueEntry *_ems_message_queue_entry_new(EMSMessage *msg)
+{
+    EMSMessageQueueEntry *entry;
+    if (ems_likely(!atomic_exchange_explicit(&msg->queue_entry_used, 1, memory_order_acquire)))
+        entry = &msg->queue_entry;
+    else
+        entry = ems_alloc(sizeof(EMSMessageQueueEntry));
+    entry->data = msg;
+    return entry;
+}
+
+/* The entry must not be accessed afterwards, it may be reused by another queue at once. */
+static inline
+void _ems_message_queue_entry_free(EMSMessageQueueEntry *entry)
+{
+    if (ems_likely(entry == &entry->data->queue_entry))
+        atomic_store_explicit(&entry->data->queue_entry_used, 0, memory_order_release);
+    else
+        ems_free(entry);
+}
+
+/* The level in the queue for a message sent with the given priority. */
+static inline
+uint8_t _ems_message_queue_level(EMSMessage *msg, EMSMessagePriority priority)
+{
+    if (priority == EMS_MESSAGE_PRIORITY_DEFAULT)
+        priority = ems_message_get_priority(msg);
+    else if (ems_unlikely(priority > EMS_MESSAGE_PRIORITY_CONTROL))
+        priority = EMS_MESSAGE_PRIORITY_CONTROL;
+    return (uint8_t)(priority - 1);
+}
+
+/* The queued messages of one type and level, linked by type_prev and type_next. */
+struct _EMSMessageQueueTypeList {
+    uint32_t type;
+    uint8_t level;
+    uint8_t used;
+    EMSMessageQueueEntry *head;
+    EMSMessageQueueEntry *tail;
 };
 
+static inline
+size_t _ems_message_queue_type_hash(uint32_t type, uint8_t level)
+{
+    return (size_t)(type * 2654435761u + level * 0x9e3779b9u);
+}
+
+static
+EMSMessageQueueTypeList *_ems_message_queue_find_type(EMSMessageQueue *mq, uint32_t type, uint8_t level)
+{
+    size_t j;
+    if (ems_unlikely(!mq->types))
+        return NULL;
+    for (j = _ems_message_queue_type_hash(type, level) & (mq->type_max - 1);
+            mq->types[j].used;
+            j = (j + 1) & (mq->type_max - 1)) {
+        if (mq->types[j].type == type && mq->types[j].level == level)
+            return &mq->types[j];
+    }
+    return NULL;
+}
+
+/* Find the list of the type, add it if it is not there yet. Lists are never removed,
+ * there are not that many different types. */
+static
+EMSMessageQueueTypeList *_ems_message_queue_get_type(EMSMessageQueue *mq, uint32_t type, uint8_t level)
+{
+    EMSMessageQueueTypeList *list = _ems_message_queue_find_type(mq, type, level);
+    EMSMessageQueueTypeList *old_types;
+    size_t old_max, j, k;
+
+    if (ems_likely(list != NULL))
+        return list;
+
+    if (2 * (mq->type_count + 1) > mq->type_max) {
+        old_types = mq->types;
+        old_max = mq->type_max;
+        mq->type_max = old_max ? 2 * old_max : 16;
+        mq->types = ems_alloc0(sizeof(EMSMessageQueueTypeList) * mq->type_max);
+        for (k = 0; k < old_max; ++k) {
+            if (!old_types[k].used)
+                continue;
+            for (j = _ems_message_queue_type_hash(old_types[k].type, old_types[k].level) & (mq->type_max - 1);
+                    mq->types[j].used;
+                    j = (j + 1) & (mq->type_max - 1));
+            mq->types[j] = old_types[k];
+        }
+        ems_free(old_types);
+    }
+
+    for (j = _ems_message_queue_type_hash(type, level) & (mq->type_max - 1);
+            mq->types[j].used;
+            j = (j + 1) & (mq->type_max - 1));
+    mq->types[j].type = type;
+    mq->types[j].level = level;
+    mq->types[j].used = 1;
+    ++mq->type_count;
+
+    return &mq->types[j];
+}
+
+static inline
+EMSMessageQueueEntry **_ems_message_queue_key_bucket(EMSMessageQueue *mq, uint32_t hash)
+{
+    return &mq->keyed[hash & (mq->keyed_max - 1)];
+}
+
+/* Add the entry to the key table, growing it if there are more entries than buckets. */
+static
+void _ems_message_queue_add_keyed_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    EMSMessageQueueEntry **old_keyed, *tmp, *next, **bucket;
+    size_t old_max, j;
+
+    if (mq->keyed_count + 1 > mq->keyed_max) {
+        old_keyed = mq->keyed;
+        old_max = mq->keyed_max;
+        mq->keyed_max = old_max ? 2 * old_max : 16;
+        mq->keyed = ems_alloc0(sizeof(EMSMessageQueueEntry *) * mq->keyed_max);
+        for (j = 0; j < old_max; ++j) {
+            for (tmp = old_keyed[j]; tmp; tmp = next) {
+                next = tmp->key_next;
+                bucket = _ems_message_queue_key_bucket(mq, tmp->key_hash);
+                tmp->key_next = *bucket;
+                *bucket = tmp;
+            }
+        }
+        ems_free(old_keyed);
+    }
+
+    bucket = _ems_message_queue_key_bucket(mq, entry->key_hash);
+    entry->key_next = *bucket;
+    *bucket = entry;
+    entry->keyed = 1;
+    ++mq->keyed_count;
+}
+
+static
+void _ems_message_queue_remove_keyed_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    EMSMessageQueueEntry **link = _ems_message_queue_key_bucket(mq, entry->key_hash);
+
+    while (*link != entry)
+        link = &(*link)->key_next;
+    *link = entry->key_next;
+    entry->keyed = 0;
+    --mq->keyed_count;
+}
+
+/* Put entry in the place of old, which has the same type and level, and release old. */
+static
+void _ems_message_queue_replace_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *old, EMSMessageQueueEntry *entry)
+{
+    EMSMessageQueueTypeList *list = _ems_message_queue_find_type(mq, old->data->type, old->level);
+    EMSMessageQueueLevel *level = &mq->levels[old->level];
+    EMSMessage *msg = old->data;
+
+    entry->seq = old->seq;
+
+    entry->prev = old->prev;
+    entry->next = old->next;
+    if (entry->prev)
+        entry->prev->next = entry;
+    else
+        level->head = entry;
+    if (entry->next)
+        entry->next->prev = entry;
+    else
+        level->tail = entry;
+
+    entry->type_prev = old->type_prev;
+    entry->type_next = old->type_next;
+    if (entry->type_prev)
+        entry->type_prev->type_next = entry;
+    else
+        list->head = entry;
+    if (entry->type_next)
+        entry->type_next->type_prev = entry;
+    else
+        list->tail = entry;
+
+    /* The new message has been counted against the limits when it was pushed. */
+    atomic_fetch_sub_explicit(&mq->used_count, 1, memory_order_relaxed);
+    if (old->bytes)
+        atomic_fetch_sub_explicit(&mq->used_bytes, old->bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mq->conflated, 1, memory_order_relaxed);
+
+    _ems_message_queue_entry_free(old);
+    ems_message_unref(msg);
+}
+
+/* CONFLATE: If a queued message has the key of the entry, the entry takes its place.
+ * Returns 1 in that case, otherwise the entry is to be linked. */
+static inline
+int _ems_message_queue_conflate_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    EMSMessageQueueEntry *old;
+
+    entry->keyed = 0;
+    if (ems_likely(!(mq->flags & EMS_MESSAGE_QUEUE_CONFLATE)) ||
+            !ems_message_get_conflation_key(entry->data, &entry->key_hash))
+        return 0;
+
+    if (mq->keyed_count) {
+        for (old = *_ems_message_queue_key_bucket(mq, entry->key_hash); old; old = old->key_next) {
+            if (old->key_hash == entry->key_hash && old->level == entry->level &&
+                    ems_message_conflation_key_equal(old->data, entry->data)) {
+                _ems_message_queue_remove_keyed_unsafe(mq, old);
+                _ems_message_queue_replace_unsafe(mq, old, entry);
+                _ems_message_queue_add_keyed_unsafe(mq, entry);
+                return 1;
+            }
+        }
+    }
+
+    _ems_message_queue_add_keyed_unsafe(mq, entry);
+    return 0;
+}
+
+static
+void _ems_message_queue_link_tail_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    if (_ems_message_queue_conflate_unsafe(mq, entry))
+        return;
+
+    EMSMessageQueueTypeList *list = _ems_message_queue_get_type(mq, entry->data->type, entry->level);
+    EMSMessageQueueLevel *level = &mq->levels[entry->level];
+
+    entry->seq = mq->tail_seq++;
+
+    entry->next = NULL;
+    entry->prev = level->tail;
+    if (level->tail)
+        level->tail->next = entry;
+    else
+        level->head = entry;
+    level->tail = entry;
+    mq->level_mask |= 1u << entry->level;
+
+    entry->type_next = NULL;
+    entry->type_prev = list->tail;
+    if (list->tail)
+        list->tail->type_next = entry;
+    else
+        list->head = entry;
+    list->tail = entry;
+
+    if (EMS_MESSAGE_IS_INTERNAL(entry->data))
+        ++mq->internal_count;
+    ++mq->count;
+}
+
+static
+void _ems_message_queue_link_head_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    if (_ems_message_queue_conflate_unsafe(mq, entry))
+        return;
+
+    EMSMessageQueueTypeList *list = _ems_message_queue_get_type(mq, entry->data->type, entry->level);
+    EMSMessageQueueLevel *level = &mq->levels[entry->level];
+
+    entry->seq = --mq->head_seq;
+
+    entry->prev = NULL;
+    entry->next = level->head;
+    if (level->head)
+        level->head->prev = entry;
+    else
+        level->tail = entry;
+    level->head = entry;
+    level->overtaken = 0;
+    mq->level_mask |= 1u << entry->level;
+
+    entry->type_prev = NULL;
+    entry->type_next = list->head;
+    if (list->head)
+        list->head->type_prev = entry;
+    else
+        list->tail = entry;
+    list->head = entry;
+
+    if (EMS_MESSAGE_IS_INTERNAL(entry->data))
+        ++mq->internal_count;
+    ++mq->count;
+}
+
+/* Remove the entry from the queue, but do not free it. */
+static
+void _ems_message_queue_unlink_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    EMSMessageQueueTypeList *list = _ems_message_queue_find_type(mq, entry->data->type, entry->level);
+    EMSMessageQueueLevel *level = &mq->levels[entry->level];
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        level->tail = entry->prev;
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    }
+    else {
+        level->head = entry->next;
+        level->overtaken = 0;
+        if (!level->head)
+            mq->level_mask &= ~(1u << entry->level);
+    }
+
+    atomic_fetch_sub_explicit(&mq->used_count, 1, memory_order_relaxed);
+    if (entry->bytes)
+        atomic_fetch_sub_explicit(&mq->used_bytes, entry->bytes, memory_order_relaxed);
+
+    if (entry->type_next)
+        entry->type_next->type_prev = entry->type_prev;
+    else
+        list->tail = entry->type_prev;
+    if (entry->type_prev)
+        entry->type_prev->type_next = entry->type_next;
+    else
+        list->head = entry->type_next;
+
+    if (entry->keyed)
+        _ems_message_queue_remove_keyed_unsafe(mq, entry);
+
+    if (EMS_MESSAGE_IS_INTERNAL(entry->data))
+        --mq->internal_count;
+    --mq->count;
+}
+
+/* Choose the level to serve among the levels in mask, which must not be 0: the
+ * highest one, unless a lower level has been overtaken too often. If the message
+ * is going to be removed, count that it overtakes the waiting lower levels.
+ * A starving level is served once, even if the message is not its head, as
+ * happens for filtered pops. */
+static
+uint8_t _ems_message_queue_select_level_unsafe(EMSMessageQueue *mq, unsigned int mask, int remove)
+{
+    uint8_t level = 31 - __builtin_clz(mask);
+    uint8_t j;
+
+    for (j = 0; j < level; ++j) {
+        if ((mask & (1u << j)) && mq->levels[j].overtaken >= EMS_MESSAGE_QUEUE_STARVATION_LIMIT) {
+            level = j;
+            if (remove)
+                mq->levels[j].overtaken = 0;
+            break;
+        }
+    }
+    if (remove) {
+        for (j = 0; j < level; ++j) {
+            if (mq->level_mask & (1u << j))
+                ++mq->levels[j].overtaken;
+        }
+    }
+    return level;
+}
+
+/* The next message to serve, NULL if the queue is empty. */
+static inline
+EMSMessageQueueEntry *_ems_message_queue_find_head_unsafe(EMSMessageQueue *mq, int remove)
+{
+    if (!mq->level_mask)
+        return NULL;
+    return mq->levels[_ems_message_queue_select_level_unsafe(mq, mq->level_mask, remove)].head;
+}
+
+/* The next message of any of the filtered types, NULL if there is none. */
+static
+EMSMessageQueueEntry *_ems_message_queue_find_filtered_unsafe(EMSMessageQueue *mq, int remove)
+{
+    EMSMessageQueueEntry *entries[EMS_MESSAGE_PRIORITY_COUNT] = { NULL };
+    EMSMessageQueueTypeList *list;
+    unsigned int mask = 0;
+    size_t j;
+    uint8_t level;
+
+    for (level = 0; level < EMS_MESSAGE_PRIORITY_COUNT; ++level) {
+        if (!(mq->level_mask & (1u << level)))
+            continue;
+        for (j = 0; j < mq->filter_count; ++j) {
+            list = _ems_message_queue_find_type(mq, mq->filters[j], level);
+            if (list && list->head && (!entries[level] || list->head->seq < entries[level]->seq))
+                entries[level] = list->head;
+        }
+        if (entries[level])
+            mask |= 1u << level;
+    }
+    if (!mask)
+        return NULL;
+    return entries[_ems_message_queue_select_level_unsafe(mq, mask, remove)];
+}
+
 void ems_message_queue_init(EMSMessageQueue *mq)
+{
+    ems_message_queue_init_full(mq, 0);
+}
+
+void ems_message_queue_init_full(EMSMessageQueue *mq, unsigned int flags)
 {
     memset(mq, 0, sizeof(EMSMessageQueue));
 
+    mq->flags = flags;
+    atomic_init(&mq->pushed, NULL);
+
+    /* Leave room for push_head, the numbers must not wrap. */
+    mq->head_seq = mq->tail_seq = (uint64_t)1 << 63;
+
     mq->filter_max = 32;
     mq->filters = ems_alloc(sizeof(uint32_t) * mq->filter_max);
 
+    atomic_init(&mq->used_count, 0);
+    atomic_init(&mq->used_bytes, 0);
+    atomic_init(&mq->above_high, 0);
+    atomic_init(&mq->dropped, 0);
+    atomic_init(&mq->conflated, 0);
+    atomic_init(&mq->avail_waiters, 0);
+    atomic_init(&mq->internal_waiters, 0);
+    atomic_init(&mq->event_fd, -1);
+
     pthread_mutex_init(&mq->queue_lock, NULL);
+    pthread_cond_init(&mq->space_cond, NULL);
+
+    /* Timed waits are not affected by changes of the system time. */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mq->avail_cond, &attr);
+    pthread_cond_init(&mq->internal_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* A single-producer, single-consumer ring of entries. The producer owns tail, the
+ * consumer, i.e. whoever holds the lock of the queue, owns head. Both indices only
+ * grow, the slot of an index is index & mask. */
+struct _EMSMessageQueueRing {
+    atomic_size_t head;
+    uint8_t head_pad[EMS_CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+
+    atomic_size_t tail;
+    size_t cached_head;          /* the producer's last view of head */
+    uint8_t tail_pad[EMS_CACHE_LINE_SIZE - sizeof(atomic_size_t) - sizeof(size_t)];
+
+    EMSMessageQueue *mq;
+    EMSMessageQueueRing *next;   /* the next ring of the queue */
+    size_t mask;
+    EMSMessageQueueEntry *slots[];
+};
+
+/* MPSC: Move the pushed entries to the end of the consumer's list. */
+static
+void _ems_message_queue_collect_pushed_unsafe(EMSMessageQueue *mq)
+{
+    EMSMessageQueueEntry *entry, *next, *first = NULL;
+
+    if (atomic_load_explicit(&mq->pushed, memory_order_relaxed) == NULL)
+        return;
+    entry = atomic_exchange_explicit(&mq->pushed, NULL, memory_order_acquire);
+
+    /* The pushed entries are linked newest first. */
+    while (entry) {
+        next = entry->next;
+        entry->next = first;
+        first = entry;
+        entry = next;
+    }
+    while (first) {
+        next = first->next;
+        _ems_message_queue_link_tail_unsafe(mq, first);
+        first = next;
+    }
+}
+
+/* Move the entries of all rings to the end of the list. */
+static
+void _ems_message_queue_collect_rings_unsafe(EMSMessageQueue *mq)
+{
+    EMSMessageQueueRing *ring;
+    size_t head, tail;
+
+    for (ring = mq->rings; ring; ring = ring->next) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == tail)
+            continue;
+        for (; head != tail; ++head)
+            _ems_message_queue_link_tail_unsafe(mq, ring->slots[head & ring->mask]);
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+}
+
+/* Move everything published by lock-free producers into the list. */
+static inline
+void _ems_message_queue_collect_unsafe(EMSMessageQueue *mq)
+{
+    if (mq->rings)
+        _ems_message_queue_collect_rings_unsafe(mq);
+    if (mq->flags & EMS_MESSAGE_QUEUE_MPSC)
+        _ems_message_queue_collect_pushed_unsafe(mq);
+}
+
+/* Whether lock-free producers have published messages, which are not collected yet. */
+static inline
+int _ems_message_queue_has_published(EMSMessageQueue *mq)
+{
+    EMSMessageQueueRing *ring;
+
+    if ((mq->flags & EMS_MESSAGE_QUEUE_MPSC) && atomic_load(&mq->pushed) != NULL)
+        return 1;
+    for (ring = mq->rings; ring; ring = ring->next) {
+        if (atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed))
+            return 1;
+    }
+    return 0;
+}
+
+/* Get exclusive access to the list. Producers of an MPSC queue and of rings never
+ * take the lock, it only keeps consumers apart. */
+static inline
+void _ems_message_queue_lock(EMSMessageQueue *mq)
+{
+    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_collect_unsafe(mq);
+}
+
+/* Call the watermark function if the queue crossed a watermark. */
+static inline
+void _ems_message_queue_check_watermarks(EMSMessageQueue *mq)
+{
+    EMSMessageQueueLimits *limits = &mq->limits;
+    uint64_t count;
+    size_t bytes;
+
+    if (ems_likely(!limits->watermark_func))
+        return;
+
+    count = atomic_load_explicit(&mq->used_count, memory_order_relaxed);
+    bytes = atomic_load_explicit(&mq->used_bytes, memory_order_relaxed);
+    if (!atomic_load_explicit(&mq->above_high, memory_order_relaxed)) {
+        if (((limits->high_count && count >= limits->high_count) ||
+             (limits->high_bytes && bytes >= limits->high_bytes)) &&
+                atomic_exchange(&mq->above_high, 1) == 0)
+            limits->watermark_func(mq, 1, limits->watermark_data);
+    }
+    else if ((!limits->high_count || count <= limits->low_count) &&
+             (!limits->high_bytes || bytes <= limits->low_bytes) &&
+             atomic_exchange(&mq->above_high, 0) == 1) {
+        limits->watermark_func(mq, 0, limits->watermark_data);
+    }
+}
+
+/* Make the eventfd readable, the lock is held. */
+static inline
+void _ems_message_queue_arm_event_unsafe(EMSMessageQueue *mq)
+{
+    const uint64_t u = 1;
+    int fd = atomic_load_explicit(&mq->event_fd, memory_order_relaxed);
+
+    if (fd >= 0 && !mq->event_armed && write(fd, &u, sizeof(uint64_t)) == sizeof(uint64_t))
+        mq->event_armed = 1;
+}
+
+/* Make the eventfd unreadable if the queue has become empty, the lock is held. */
+static inline
+void _ems_message_queue_disarm_event_unsafe(EMSMessageQueue *mq)
+{
+    uint64_t u;
+
+    if (ems_likely(!mq->event_armed) || mq->count)
+        return;
+    /* Lock-free producers publishing from now on arm the eventfd again. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (_ems_message_queue_has_published(mq))
+        return;
+    (void)read(atomic_load_explicit(&mq->event_fd, memory_order_relaxed), &u, sizeof(uint64_t));
+    mq->event_armed = 0;
+}
+
+/* Wake up waiting consumers after a message has been linked, the lock is held. Waiters
+ * for internal messages are only woken if internal is set. */
+static inline
+void _ems_message_queue_signal_unsafe(EMSMessageQueue *mq, int internal)
+{
+    if (atomic_load_explicit(&mq->avail_waiters, memory_order_relaxed))
+        pthread_cond_broadcast(&mq->avail_cond);
+    if (internal && atomic_load_explicit(&mq->internal_waiters, memory_order_relaxed))
+        pthread_cond_broadcast(&mq->internal_cond);
+    _ems_message_queue_arm_event_unsafe(mq);
+}
+
+/* Whether a lock-free producer has to lock the queue and signal it after publishing. */
+static inline
+int _ems_message_queue_needs_signal(EMSMessageQueue *mq, int internal)
+{
+    return atomic_load_explicit(&mq->avail_waiters, memory_order_relaxed) ||
+           (internal && atomic_load_explicit(&mq->internal_waiters, memory_order_relaxed));
+}
+
+static inline
+void _ems_message_queue_unlock(EMSMessageQueue *mq)
+{
+    if (mq->space_waiters)
+        pthread_cond_broadcast(&mq->space_cond);
+    _ems_message_queue_disarm_event_unsafe(mq);
+    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_check_watermarks(mq);
 }
 
 void ems_message_queue_clear(EMSMessageQueue *mq)
@@ -25,15 +623,34 @@ void ems_message_queue_clear(EMSMessageQueue *mq)
     if (mq) {
         ems_free(mq->filters);
         pthread_mutex_destroy(&mq->queue_lock);
+        pthread_cond_destroy(&mq->space_cond);
+        pthread_cond_destroy(&mq->avail_cond);
+        pthread_cond_destroy(&mq->internal_cond);
+        if (atomic_load(&mq->event_fd) >= 0)
+            close(atomic_load(&mq->event_fd));
+        _ems_message_queue_collect_unsafe(mq);
+        while (mq->rings) {
+            EMSMessageQueueRing *ring = mq->rings;
+            mq->rings = ring->next;
+            ems_free(ring);
+        }
 
-        EMSMessageQueueEntry *tmp;;
-        while (mq->head) {
-            tmp = mq->head->next;
-            ems_message_unref(mq->head->data);
-            ems_message_unref(mq->priv);
-            ems_free(mq->head);
-            mq->head = tmp;
+        EMSMessageQueueEntry *entry, *tmp;
+        EMSMessage *msg;
+        size_t level;
+        for (level = 0; level < EMS_MESSAGE_PRIORITY_COUNT; ++level) {
+            entry = mq->levels[level].head;
+            while (entry) {
+                tmp = entry->next;
+                msg = entry->data;
+                _ems_message_queue_entry_free(entry);
+                ems_message_unref(msg);
+                ems_message_unref(mq->priv);
+                entry = tmp;
+            }
         }
+        ems_free(mq->types);
+        ems_free(mq->keyed);
 
         memset(mq, 0, sizeof(EMSMessageQueue));
     }
@@ -44,7 +661,7 @@ void ems_message_queue_add_filter(EMSMessageQueue *mq, uint32_t msgtype)
     if (ems_unlikely(!mq))
         return;
 
-    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_lock(mq);
     int j;
     for (j = 0; j < mq->filter_count; ++j) {
         if (mq->filters[j] == msgtype) /* Filter is already in list. */
@@ -57,94 +674,395 @@ void ems_message_queue_add_filter(EMSMessageQueue *mq, uint32_t msgtype)
     mq->filters[mq->filter_count++] = msgtype;
 
 done:
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 }
 
 void ems_message_queue_clear_filter(EMSMessageQueue *mq)
 {
     if (ems_unlikely(!mq))
         return;
-    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_lock(mq);
     mq->filter_count = 0;
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
+}
+
+static inline
+EMSMessage *_ems_message_queue_remove_entry_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+{
+    EMSMessage *msg = entry->data;
+    _ems_message_queue_unlink_unsafe(mq, entry);
+    _ems_message_queue_entry_free(entry);
+    return msg;
+}
+
+static inline
+EMSMessage *_ems_message_queue_pop_head_unsafe(EMSMessageQueue *mq)
+{
+    EMSMessageQueueEntry *entry = _ems_message_queue_find_head_unsafe(mq, 1);
+    if (entry)
+        return _ems_message_queue_remove_entry_unsafe(mq, entry);
+    return NULL;
 }
 
-void ems_message_queue_push_tail(EMSMessageQueue *mq, EMSMessage *msg)
+void ems_message_queue_set_limits(EMSMessageQueue *mq, const EMSMessageQueueLimits *limits)
 {
     if (ems_unlikely(!mq))
         return;
-    EMSMessageQueueEntry *entry = ems_alloc(sizeof(EMSMessageQueueEntry));
-    entry->data = msg;
-    entry->next = NULL;
 
     pthread_mutex_lock(&mq->queue_lock);
-
-    entry->prev = mq->tail;
-    if (mq->tail)
-        mq->tail->next = entry;
+    if (limits)
+        mq->limits = *limits;
     else
-        mq->head = entry;
-    mq->tail = entry;
+        memset(&mq->limits, 0, sizeof(EMSMessageQueueLimits));
+    if (mq->space_waiters)
+        pthread_cond_broadcast(&mq->space_cond);
+    pthread_mutex_unlock(&mq->queue_lock);
+}
 
-    ++mq->count;
+uint64_t ems_message_queue_get_dropped(EMSMessageQueue *mq)
+{
+    return mq ? atomic_load(&mq->dropped) : 0;
+}
 
-    pthread_mutex_unlock(&mq->queue_lock);
+uint64_t ems_message_queue_get_conflated(EMSMessageQueue *mq)
+{
+    return mq ? atomic_load(&mq->conflated) : 0;
 }
 
-void ems_message_queue_push_head(EMSMessageQueue *mq, EMSMessage *msg)
+static inline
+int _ems_message_queue_is_over(EMSMessageQueue *mq, uint64_t count, size_t bytes)
 {
-    if (ems_unlikely(!mq))
-        return;
-    EMSMessageQueueEntry *entry = ems_alloc(sizeof(EMSMessageQueueEntry));
-    entry->data = msg;
-    entry->prev = NULL;
+    return (mq->limits.max_count && count > mq->limits.max_count) ||
+           (mq->limits.max_bytes && bytes > mq->limits.max_bytes);
+}
 
-    pthread_mutex_lock(&mq->queue_lock);
+/* The size counted against the byte limits. */
+static inline
+size_t _ems_message_queue_bytes(EMSMessageQueue *mq, EMSMessage *msg)
+{
+    EMSMessageEncoding *encoding;
+    size_t size = 0;
+    if (ems_likely(!mq->limits.max_bytes && !mq->limits.high_bytes))
+        return 0;
+    /* Encoding keeps the work for sending the message. */
+    if ((size = ems_message_get_encoded_size(msg)) == 0 && (encoding = ems_message_get_encoding(msg)) != NULL) {
+        ems_message_encoding_get_frame(encoding, 0, &size);
+        ems_message_encoding_unref(encoding);
+    }
+    return size;
+}
 
-    entry->next = mq->head;
-    if (mq->head)
-        mq->head->prev = entry;
-    else
-        mq->tail = entry;
-    mq->head = entry;
+#define _EMS_MESSAGE_QUEUE_DROPPED (-1)
 
-    ++mq->count;
+/* Count a message about to be pushed against the limits and apply the policy if the
+ * queue is full. Returns EMS_OK if the message is to be queued, EMS_ERROR_QUEUE_FULL,
+ * or _EMS_MESSAGE_QUEUE_DROPPED if it has been dropped. */
+static
+int _ems_message_queue_reserve(EMSMessageQueue *mq, EMSMessage *msg, size_t bytes)
+{
+    EMSMessageQueueEntry *entry;
+    EMSMessage *dropped;
+    uint64_t count = atomic_fetch_add_explicit(&mq->used_count, 1, memory_order_relaxed) + 1;
+    size_t total = atomic_fetch_add_explicit(&mq->used_bytes, bytes, memory_order_relaxed) + bytes;
+    uint8_t level;
 
-    pthread_mutex_unlock(&mq->queue_lock);
+    if (ems_likely(!_ems_message_queue_is_over(mq, count, total)) || EMS_MESSAGE_IS_INTERNAL(msg))
+        return EMS_OK;
+
+    if (mq->limits.policy == EMS_MESSAGE_QUEUE_DROP_OLDEST) {
+        _ems_message_queue_lock(mq);
+        while (_ems_message_queue_is_over(mq, atomic_load(&mq->used_count), atomic_load(&mq->used_bytes))) {
+            /* Internal messages are kept. */
+            for (level = 0; level < EMS_MESSAGE_PRIORITY_COUNT; ++level) {
+                entry = mq->levels[level].head;
+                if (entry && !EMS_MESSAGE_IS_INTERNAL(entry->data))
+                    break;
+            }
+            if (level == EMS_MESSAGE_PRIORITY_COUNT)
+                break;
+            dropped = _ems_message_queue_remove_entry_unsafe(mq, entry);
+            ems_message_unref(dropped);
+            atomic_fetch_add(&mq->dropped, 1);
+        }
+        pthread_mutex_unlock(&mq->queue_lock);
+        return EMS_OK;
+    }
+
+    atomic_fetch_sub_explicit(&mq->used_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&mq->used_bytes, bytes, memory_order_relaxed);
+
+    switch (mq->limits.policy) {
+        case EMS_MESSAGE_QUEUE_BLOCK:
+            /* The consumer removes messages with the lock held. A message too large
+             * for the limits is accepted if the queue is empty. */
+            pthread_mutex_lock(&mq->queue_lock);
+            ++mq->space_waiters;
+            while ((count = atomic_load(&mq->used_count)) > 0 &&
+                    _ems_message_queue_is_over(mq, count + 1, atomic_load(&mq->used_bytes) + bytes))
+                pthread_cond_wait(&mq->space_cond, &mq->queue_lock);
+            --mq->space_waiters;
+            atomic_fetch_add_explicit(&mq->used_count, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&mq->used_bytes, bytes, memory_order_relaxed);
+            pthread_mutex_unlock(&mq->queue_lock);
+            return EMS_OK;
+        case EMS_MESSAGE_QUEUE_DROP_NEWEST:
+            ems_message_unref(msg);
+            atomic_fetch_add(&mq->dropped, 1);
+            return _EMS_MESSAGE_QUEUE_DROPPED;
+        default:
+            return EMS_ERROR_QUEUE_FULL;
+    }
 }
 
-static inline
-EMSMessage *_ems_message_queue_pop_head_unsafe(EMSMessageQueue *mq)
+/* Append the entries, linked by next and oldest first, to the end of the queue with
+ * one atomic exchange or one lock. */
+static
+void _ems_message_queue_append(EMSMessageQueue *mq, EMSMessageQueueEntry *first)
 {
-    EMSMessage *msg = NULL;
-    EMSMessageQueueEntry *tmp;
-    if (mq->head) {
-        tmp = mq->head->next;
-        msg = mq->head->data;
-        ems_free(mq->head);
-        mq->head = tmp;
-        if (mq->head)
-            mq->head->prev = NULL;
+    EMSMessageQueueEntry *entry, *next, *newest = NULL, *head;
+    int internal = 0;
+
+    for (entry = first; entry; entry = entry->next)
+        internal |= EMS_MESSAGE_IS_INTERNAL(entry->data);
+
+    if (mq->flags & EMS_MESSAGE_QUEUE_MPSC) {
+        /* The pushed entries are linked newest first. */
+        for (entry = first; entry; entry = next) {
+            next = entry->next;
+            entry->next = newest;
+            newest = entry;
+        }
+        head = atomic_load_explicit(&mq->pushed, memory_order_relaxed);
+        do {
+            first->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&mq->pushed, &head, newest,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+
+        /* Pairs with the waiter checking pushed after announcing itself, and with
+         * the consumer checking pushed before disarming the eventfd. Only the push
+         * to an empty list arms it. */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (_ems_message_queue_needs_signal(mq, internal) ||
+                (head == NULL && atomic_load_explicit(&mq->event_fd, memory_order_relaxed) >= 0)) {
+            pthread_mutex_lock(&mq->queue_lock);
+            _ems_message_queue_signal_unsafe(mq, internal);
+            pthread_mutex_unlock(&mq->queue_lock);
+        }
+    }
+    else {
+        /* Messages the pushing thread has put into its ring are queued first. */
+        _ems_message_queue_lock(mq);
+        for (entry = first; entry; entry = next) {
+            next = entry->next;
+            _ems_message_queue_link_tail_unsafe(mq, entry);
+        }
+        _ems_message_queue_signal_unsafe(mq, internal);
+        pthread_mutex_unlock(&mq->queue_lock);
+    }
+}
+
+int ems_message_queue_push_tail(EMSMessageQueue *mq, EMSMessage *msg)
+{
+    return ems_message_queue_push_tail_with_priority(mq, msg, EMS_MESSAGE_PRIORITY_DEFAULT);
+}
+
+int ems_message_queue_push_tail_with_priority(EMSMessageQueue *mq, EMSMessage *msg, EMSMessagePriority priority)
+{
+    if (ems_unlikely(!mq || !msg))
+        return EMS_ERROR_INVALID_ARGUMENT;
+    size_t bytes = _ems_message_queue_bytes(mq, msg);
+    int rc;
+    if (ems_unlikely((rc = _ems_message_queue_reserve(mq, msg, bytes)) != EMS_OK))
+        return rc == EMS_ERROR_QUEUE_FULL ? rc : EMS_OK;
+
+    EMSMessageQueueEntry *entry = _ems_message_queue_entry_new(msg);
+    entry->level = _ems_message_queue_level(msg, priority);
+    entry->bytes = bytes;
+    entry->next = NULL;
+
+    _ems_message_queue_append(mq, entry);
+
+    _ems_message_queue_check_watermarks(mq);
+    return EMS_OK;
+}
+
+size_t ems_message_queue_push_many(EMSMessageQueue *mq, EMSMessage **msgs, size_t count)
+{
+    EMSMessageQueueEntry *first = NULL, *last = NULL, *entry;
+    size_t j, bytes;
+    int rc;
+
+    if (ems_unlikely(!mq || !msgs))
+        return 0;
+
+    /* Blocked, the producer would wait for room taken by its own messages. */
+    if (ems_unlikely(mq->limits.policy == EMS_MESSAGE_QUEUE_BLOCK &&
+                     (mq->limits.max_count || mq->limits.max_bytes))) {
+        for (j = 0; j < count; ++j) {
+            if (msgs[j])
+                ems_message_queue_push_tail(mq, msgs[j]);
+        }
+        return count;
+    }
+
+    for (j = 0; j < count; ++j) {
+        if (ems_unlikely(!msgs[j]))
+            continue;
+        bytes = _ems_message_queue_bytes(mq, msgs[j]);
+        if (ems_unlikely((rc = _ems_message_queue_reserve(mq, msgs[j], bytes)) != EMS_OK)) {
+            if (rc == EMS_ERROR_QUEUE_FULL)
+                break;
+            continue;
+        }
+        entry = _ems_message_queue_entry_new(msgs[j]);
+        entry->level = _ems_message_queue_level(msgs[j], EMS_MESSAGE_PRIORITY_DEFAULT);
+        entry->bytes = bytes;
+        entry->next = NULL;
+        if (last)
+            last->next = entry;
         else
-            mq->tail = NULL;
-        --mq->count;
+            first = entry;
+        last = entry;
     }
-    return msg;
+
+    if (first) {
+        _ems_message_queue_append(mq, first);
+        _ems_message_queue_check_watermarks(mq);
+    }
+
+    return j;
 }
 
-static inline
-void _ems_message_queue_remove_entry_unsafe(EMSMessageQueue *mq, EMSMessageQueueEntry *entry)
+EMSMessageQueueRing *ems_message_queue_add_ring(EMSMessageQueue *mq, size_t size)
 {
-    if (entry->next)
-        entry->next->prev = entry->prev;
-    else
-        mq->tail = entry->prev;
-    if (entry->prev)
-        entry->prev->next = entry->next;
-    else
-        mq->head = entry->next;
-    ems_free(entry);
-    --mq->count;
+    if (ems_unlikely(!mq || !size))
+        return NULL;
+
+    size_t slots = 1;
+    while (slots < size)
+        slots <<= 1;
+
+    EMSMessageQueueRing *ring = ems_alloc0(sizeof(EMSMessageQueueRing) +
+                                           slots * sizeof(EMSMessageQueueEntry *));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mq = mq;
+    ring->mask = slots - 1;
+
+    pthread_mutex_lock(&mq->queue_lock);
+    ring->next = mq->rings;
+    mq->rings = ring;
+    pthread_mutex_unlock(&mq->queue_lock);
+
+    return ring;
+}
+
+void ems_message_queue_remove_ring(EMSMessageQueue *mq, EMSMessageQueueRing *ring)
+{
+    if (ems_unlikely(!mq || !ring))
+        return;
+
+    EMSMessageQueueRing **link;
+
+    _ems_message_queue_lock(mq);
+    for (link = &mq->rings; *link; link = &(*link)->next) {
+        if (*link == ring) {
+            *link = ring->next;
+            break;
+        }
+    }
+    _ems_message_queue_unlock(mq);
+
+    ems_free(ring);
+}
+
+size_t ems_message_queue_ring_push_many(EMSMessageQueueRing *ring, EMSMessage **msgs, size_t count)
+{
+    if (ems_unlikely(!ring || !msgs))
+        return 0;
+
+    EMSMessageQueue *mq = ring->mq;
+    EMSMessageQueueEntry *entry;
+    size_t start, tail, j, bytes;
+    int rc = EMS_OK, internal = 0;
+
+    /* Blocked, the producer would wait for room taken by messages not yet published. */
+    if (ems_unlikely(mq->limits.policy == EMS_MESSAGE_QUEUE_BLOCK &&
+                     (mq->limits.max_count || mq->limits.max_bytes)))
+        return ems_message_queue_push_many(mq, msgs, count);
+
+    start = tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (j = 0; j < count; ++j) {
+        if (ems_unlikely(!msgs[j]))
+            continue;
+        if (ems_unlikely(tail - ring->cached_head > ring->mask)) {
+            ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (tail - ring->cached_head > ring->mask)
+                break;
+        }
+        bytes = _ems_message_queue_bytes(mq, msgs[j]);
+        if (ems_unlikely((rc = _ems_message_queue_reserve(mq, msgs[j], bytes)) != EMS_OK)) {
+            if (rc == EMS_ERROR_QUEUE_FULL)
+                break;
+            continue;
+        }
+        entry = _ems_message_queue_entry_new(msgs[j]);
+        entry->level = _ems_message_queue_level(msgs[j], EMS_MESSAGE_PRIORITY_DEFAULT);
+        entry->bytes = bytes;
+        internal |= EMS_MESSAGE_IS_INTERNAL(msgs[j]);
+        ring->slots[tail & ring->mask] = entry;
+        ++tail;
+    }
+
+    if (tail != start) {
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        /* Pairs with the waiter and with disarming the eventfd, like for MPSC pushes.
+         * The eventfd is armed unless older messages are still in the ring, since
+         * then it has been armed for those. */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (_ems_message_queue_needs_signal(mq, internal) ||
+                (atomic_load_explicit(&ring->head, memory_order_relaxed) - start <= tail - start &&
+                 atomic_load_explicit(&mq->event_fd, memory_order_relaxed) >= 0)) {
+            pthread_mutex_lock(&mq->queue_lock);
+            _ems_message_queue_signal_unsafe(mq, internal);
+            pthread_mutex_unlock(&mq->queue_lock);
+        }
+        _ems_message_queue_check_watermarks(mq);
+    }
+
+    /* The ring is full, the queue merges it before taking the rest. */
+    if (j < count && rc != EMS_ERROR_QUEUE_FULL)
+        j += ems_message_queue_push_many(mq, &msgs[j], count - j);
+
+    return j;
+}
+
+int ems_message_queue_push_head(EMSMessageQueue *mq, EMSMessage *msg)
+{
+    return ems_message_queue_push_head_with_priority(mq, msg, EMS_MESSAGE_PRIORITY_DEFAULT);
+}
+
+int ems_message_queue_push_head_with_priority(EMSMessageQueue *mq, EMSMessage *msg, EMSMessagePriority priority)
+{
+    if (ems_unlikely(!mq || !msg))
+        return EMS_ERROR_INVALID_ARGUMENT;
+    size_t bytes = _ems_message_queue_bytes(mq, msg);
+    int rc;
+    if (ems_unlikely((rc = _ems_message_queue_reserve(mq, msg, bytes)) != EMS_OK))
+        return rc == EMS_ERROR_QUEUE_FULL ? rc : EMS_OK;
+
+    EMSMessageQueueEntry *entry = _ems_message_queue_entry_new(msg);
+    entry->level = _ems_message_queue_level(msg, priority);
+    entry->bytes = bytes;
+
+    _ems_message_queue_lock(mq);
+    _ems_message_queue_link_head_unsafe(mq, entry);
+    _ems_message_queue_signal_unsafe(mq, EMS_MESSAGE_IS_INTERNAL(msg));
+    _ems_message_queue_unlock(mq);
+
+    return EMS_OK;
 }
 
 EMSMessage *ems_message_queue_pop_head(EMSMessageQueue *mq)
@@ -154,7 +1072,7 @@ EMSMessage *ems_message_queue_pop_head(EMSMessageQueue *mq)
 
     EMSMessage *msg = NULL;
 
-    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_lock(mq);
     msg = _ems_message_queue_pop_head_unsafe(mq);
 
     if (!msg) {
@@ -162,7 +1080,7 @@ EMSMessage *ems_message_queue_pop_head(EMSMessageQueue *mq)
         msg = mq->priv;
     }
 
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 
     return msg;
 }
@@ -174,12 +1092,14 @@ EMSMessage *ems_message_queue_peek_head(EMSMessageQueue *mq)
 
     EMSMessage *msg = NULL;
 
-    pthread_mutex_lock(&mq->queue_lock);
-    if (mq->head)
-        msg = mq->head->data;
+    EMSMessageQueueEntry *entry;
+
+    _ems_message_queue_lock(mq);
+    if ((entry = _ems_message_queue_find_head_unsafe(mq, 0)) != NULL)
+        msg = entry->data;
     else
         msg = mq->priv;
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 
     return msg;
 }
@@ -190,65 +1110,58 @@ EMSMessage *ems_message_queue_pop_filtered(EMSMessageQueue *mq)
         return NULL;
     EMSMessage *msg = NULL;
     EMSMessageQueueEntry *tmp;
-    size_t j;
 
-    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_lock(mq);
     if (!mq->filter_count) {
         msg = _ems_message_queue_pop_head_unsafe(mq);
     }
-    else {
-        for (tmp = mq->head; tmp; tmp = tmp->next) {
-            for (j = 0; j < mq->filter_count; ++j) {
-                if (tmp->data->type == mq->filters[j]) {
-                    goto found;
-                }
-            }
-        }
-        goto done;
-found:
-        msg = tmp->data;
-        _ems_message_queue_remove_entry_unsafe(mq, tmp);
+    else if ((tmp = _ems_message_queue_find_filtered_unsafe(mq, 1)) != NULL) {
+        msg = _ems_message_queue_remove_entry_unsafe(mq, tmp);
     }
 
-done:
     if (!msg) {
         ems_message_ref(mq->priv);
         msg = mq->priv;
     }
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 
     return msg;
 }
 
-EMSMessage *ems_message_queue_pop_matching(EMSMessageQueue *mq, EMSMessageFilterFunc filter, void *userdata)
+/* Remove the first message matching filter, or the head if there is no filter. */
+static
+EMSMessage *_ems_message_queue_pop_matching_unsafe(EMSMessageQueue *mq, EMSMessageFilterFunc filter, void *userdata)
 {
-    if (ems_unlikely(!mq))
-        return NULL;
-
-    EMSMessage *msg = NULL;
     EMSMessageQueueEntry *tmp;
+    int level;
 
-    pthread_mutex_lock(&mq->queue_lock);
-    if (ems_unlikely(!filter)) {
-        msg = _ems_message_queue_pop_head_unsafe(mq);
-    }
-    else {
-        for (tmp = mq->head; tmp; tmp = tmp->next) {
+    if (ems_unlikely(!filter))
+        return _ems_message_queue_pop_head_unsafe(mq);
+
+    for (level = EMS_MESSAGE_PRIORITY_COUNT - 1; level >= 0; --level) {
+        for (tmp = mq->levels[level].head; tmp; tmp = tmp->next) {
             if (filter(tmp->data, userdata) == 0)
-                goto found;
+                return _ems_message_queue_remove_entry_unsafe(mq, tmp);
         }
-        goto done;
-found:
-        msg = tmp->data;
-        _ems_message_queue_remove_entry_unsafe(mq, tmp);
     }
 
-done:
+    return NULL;
+}
+
+EMSMessage *ems_message_queue_pop_matching(EMSMessageQueue *mq, EMSMessageFilterFunc filter, void *userdata)
+{
+    if (ems_unlikely(!mq))
+        return NULL;
+
+    EMSMessage *msg = NULL;
+
+    _ems_message_queue_lock(mq);
+    msg = _ems_message_queue_pop_matching_unsafe(mq, filter, userdata);
     if (!msg) {
         ems_message_ref(mq->priv);
         msg = mq->priv;
     }
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 
     return msg;
 }
@@ -260,36 +1173,240 @@ EMSMessage *ems_message_queue_peek_filtered(EMSMessageQueue *mq)
 
     EMSMessage *msg = NULL;
     EMSMessageQueueEntry *tmp;
-    size_t j;
 
-    pthread_mutex_lock(&mq->queue_lock);
+    _ems_message_queue_lock(mq);
     if (!mq->filter_count)
-        msg = mq->head ? mq->head->data : NULL;
-    else {
-        for (tmp = mq->head; tmp; tmp = tmp->next) {
-            for (j = 0; j < mq->filter_count; ++j) {
-                if (tmp->data->type == mq->filters[j]) {
-                    msg = tmp->data;
-                    goto done;
-                }
-            }
-        }
-    }
-done:
+        tmp = _ems_message_queue_find_head_unsafe(mq, 0);
+    else
+        tmp = _ems_message_queue_find_filtered_unsafe(mq, 0);
+    if (tmp)
+        msg = tmp->data;
+
     if (!msg) {
         msg = mq->priv;
     }
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 
     return msg;
 }
 
-void ems_message_queue_enable(EMSMessageQueue *mq, int enable)
+size_t ems_message_queue_pop_many(EMSMessageQueue *mq, EMSMessage **msgs, size_t max)
+{
+    if (ems_unlikely(!mq || !msgs))
+        return 0;
+
+    EMSMessageQueueEntry *entry;
+    size_t count = 0;
+
+    _ems_message_queue_lock(mq);
+    while (count < max) {
+        if (mq->filter_count)
+            entry = _ems_message_queue_find_filtered_unsafe(mq, 1);
+        else
+            entry = _ems_message_queue_find_head_unsafe(mq, 1);
+        if (!entry)
+            break;
+        msgs[count++] = _ems_message_queue_remove_entry_unsafe(mq, entry);
+    }
+    _ems_message_queue_unlock(mq);
+
+    return count;
+}
+
+size_t ems_message_queue_drain(EMSMessageQueue *mq, EMSMessage **msgs, size_t max)
+{
+    if (ems_unlikely(!mq || !msgs))
+        return 0;
+
+    size_t count = 0;
+
+    _ems_message_queue_lock(mq);
+    while (count < max && mq->level_mask)
+        msgs[count++] = _ems_message_queue_pop_head_unsafe(mq);
+    _ems_message_queue_unlock(mq);
+
+    return count;
+}
+
+/* The absolute time timeout_ms milliseconds from now, for the clock of avail_cond. */
+static
+void _ems_message_queue_deadline(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* Wait with the lock held until a message is pushed, or an internal message if
+ * internal is set. Returns 0 if the wait timed out or waits are cancelled, the caller
+ * checks the queue again otherwise. */
+static
+int _ems_message_queue_wait_unsafe(EMSMessageQueue *mq, int internal, int timeout_ms, const struct timespec *deadline)
+{
+    atomic_int *waiters = internal ? &mq->internal_waiters : &mq->avail_waiters;
+    pthread_cond_t *cond = internal ? &mq->internal_cond : &mq->avail_cond;
+    int rc = 0;
+
+    if (mq->waits_cancelled || timeout_ms == 0)
+        return 0;
+
+    atomic_fetch_add(waiters, 1);
+    /* Lock-free producers either see the waiter, or their messages are seen here. */
+    if (!_ems_message_queue_has_published(mq)) {
+        if (timeout_ms < 0)
+            rc = pthread_cond_wait(cond, &mq->queue_lock);
+        else
+            rc = pthread_cond_timedwait(cond, &mq->queue_lock, deadline);
+    }
+    atomic_fetch_sub(waiters, 1);
+
+    _ems_message_queue_collect_unsafe(mq);
+
+    return rc != ETIMEDOUT && !mq->waits_cancelled;
+}
+
+EMSMessage *ems_message_queue_pop_wait(EMSMessageQueue *mq, int timeout_ms)
+{
+    if (ems_unlikely(!mq))
+        return NULL;
+
+    EMSMessage *msg;
+    struct timespec deadline = { 0, 0 };
+
+    if (timeout_ms > 0)
+        _ems_message_queue_deadline(&deadline, timeout_ms);
+
+    _ems_message_queue_lock(mq);
+    while ((msg = _ems_message_queue_pop_head_unsafe(mq)) == NULL) {
+        if (mq->priv) {
+            ems_message_ref(mq->priv);
+            msg = mq->priv;
+            break;
+        }
+        if (!_ems_message_queue_wait_unsafe(mq, 0, timeout_ms, &deadline))
+            break;
+    }
+    _ems_message_queue_unlock(mq);
+
+    return msg;
+}
+
+EMSMessage *ems_message_queue_pop_matching_wait(EMSMessageQueue *mq, EMSMessageFilterFunc filter,
+                                                void *userdata, int timeout_ms)
+{
+    if (ems_unlikely(!mq))
+        return NULL;
+
+    EMSMessage *msg;
+    struct timespec deadline = { 0, 0 };
+
+    if (timeout_ms > 0)
+        _ems_message_queue_deadline(&deadline, timeout_ms);
+
+    _ems_message_queue_lock(mq);
+    while ((msg = _ems_message_queue_pop_matching_unsafe(mq, filter, userdata)) == NULL) {
+        if (!_ems_message_queue_wait_unsafe(mq, 0, timeout_ms, &deadline))
+            break;
+    }
+    _ems_message_queue_unlock(mq);
+
+    return msg;
+}
+
+/* The first internal message matching filter, served like the others by priority and
+ * then in order. Only the lists of the internal types are looked at. */
+static
+EMSMessageQueueEntry *_ems_message_queue_find_internal_unsafe(EMSMessageQueue *mq, EMSMessageFilterFunc filter,
+                                                              void *userdata)
+{
+    EMSMessageQueueEntry *entry, *found = NULL;
+    size_t j;
+
+    if (!mq->internal_count)
+        return NULL;
+
+    for (j = 0; j < mq->type_max; ++j) {
+        if (!mq->types[j].used || !(mq->types[j].type & 0x80000000))
+            continue;
+        for (entry = mq->types[j].head; entry; entry = entry->type_next) {
+            if (!filter || filter(entry->data, userdata) == 0)
+                break;
+        }
+        if (entry && (!found || entry->level > found->level ||
+                      (entry->level == found->level && entry->seq < found->seq)))
+            found = entry;
+    }
+    return found;
+}
+
+EMSMessage *ems_message_queue_pop_internal_wait(EMSMessageQueue *mq, EMSMessageFilterFunc filter,
+                                                void *userdata, int timeout_ms)
+{
+    if (ems_unlikely(!mq))
+        return NULL;
+
+    EMSMessage *msg = NULL;
+    EMSMessageQueueEntry *entry;
+    struct timespec deadline = { 0, 0 };
+
+    if (timeout_ms > 0)
+        _ems_message_queue_deadline(&deadline, timeout_ms);
+
+    _ems_message_queue_lock(mq);
+    while ((entry = _ems_message_queue_find_internal_unsafe(mq, filter, userdata)) == NULL) {
+        if (!_ems_message_queue_wait_unsafe(mq, 1, timeout_ms, &deadline))
+            break;
+    }
+    if (entry)
+        msg = _ems_message_queue_remove_entry_unsafe(mq, entry);
+    _ems_message_queue_unlock(mq);
+
+    return msg;
+}
+
+int ems_message_queue_get_fd(EMSMessageQueue *mq)
+{
+    if (ems_unlikely(!mq))
+        return -1;
+
+    int fd;
+
+    _ems_message_queue_lock(mq);
+    if ((fd = atomic_load(&mq->event_fd)) < 0 &&
+            (fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0) {
+        atomic_store(&mq->event_fd, fd);
+        /* Lock-free producers, which have not seen the eventfd yet, are checked here. */
+        if (mq->count || _ems_message_queue_has_published(mq))
+            _ems_message_queue_arm_event_unsafe(mq);
+    }
+    _ems_message_queue_unlock(mq);
+
+    return fd;
+}
+
+void ems_message_queue_cancel_waits(EMSMessageQueue *mq)
 {
     if (ems_unlikely(!mq))
         return;
 
     pthread_mutex_lock(&mq->queue_lock);
+    mq->waits_cancelled = 1;
+    pthread_cond_broadcast(&mq->avail_cond);
+    pthread_cond_broadcast(&mq->internal_cond);
+    pthread_mutex_unlock(&mq->queue_lock);
+}
+
+void ems_message_queue_enable(EMSMessageQueue *mq, int enable)
+{
+    if (ems_unlikely(!mq))
+        return;
+
+    _ems_message_queue_lock(mq);
 
     if (enable) {
         ems_message_unref(mq->priv);
@@ -301,7 +1418,9 @@ void ems_message_queue_enable(EMSMessageQueue *mq, int enable)
                                        EMS_MESSAGE_RECIPIENT_ALL,
                                        EMS_MESSAGE_RECIPIENT_ALL,
                                        NULL, NULL);
+        /* Waiting consumers get the disabled message now. */
+        pthread_cond_broadcast(&mq->avail_cond);
     }
 
-    pthread_mutex_unlock(&mq->queue_lock);
+    _ems_message_queue_unlock(mq);
 }
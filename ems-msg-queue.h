@@ -4,29 +4,134 @@
  * will only ever use it here for messages.
  * It is possible to add a filter for specific message types
  * so that other messages in the queue are ignored. This may be
- * used to get some form of priority queue.
+ * used to get some form of priority queue. The messages are indexed
+ * by type, a filtered pop does not depend on the length of the queue.
+ * Messages are served by priority (see EMSMessagePriority), then in the
+ * order they were queued. So that low priorities do not starve, the first
+ * waiting message of a priority is served anyway once messages of higher
+ * priorities have overtaken it EMS_MESSAGE_QUEUE_STARVATION_LIMIT times.
+ * Queues are unbounded, unless limits are set with ems_message_queue_set_limits.
+ * Pushing does not allocate, unless the message is in another queue already.
+ * Consumers may wait for messages with ems_message_queue_pop_wait. Producers only
+ * signal the queue if a consumer is waiting. To integrate the queue into an existing
+ * poll loop, use the file descriptor of ems_message_queue_get_fd.
+ *
+ * A queue initialized with EMS_MESSAGE_QUEUE_MPSC is a multi-producer,
+ * single-consumer queue: pushing to the tail, also with push_many, is lock-free,
+ * everything else is meant for the consumer. Use ems_message_queue_drain to take all
+ * pushed messages at once.
+ *
+ * A thread that is the only one to push a stream of messages may get a ring with
+ * ems_message_queue_add_ring instead. Pushing to the ring neither locks nor allocates,
+ * the rings are merged into the queue whenever it is locked. Messages pushed by the
+ * same thread directly to the queue are queued after those in its ring.
+ *
+ * A queue initialized with EMS_MESSAGE_QUEUE_CONFLATE keeps only the latest message per
+ * conflation key (see ems_message_type_set_conflation_key) and priority: a pushed message
+ * with the key of a queued one takes its place in the queue, the older one is released.
+ * Limits are applied before, so a full queue may refuse a message that would have
+ * replaced another. Messages pushed lock-free are conflated when they are collected.
  */
 #pragma once
 
 #include "ems-message.h"
 #include <pthread.h>
+#include <stdatomic.h>
 
-typedef struct _EMSMessageQueueEntry EMSMessageQueueEntry;
+/* Flags for ems_message_queue_init_full. */
+#define EMS_MESSAGE_QUEUE_MPSC (1 << 0)
+#define EMS_MESSAGE_QUEUE_CONFLATE (1 << 1)
 
+#define EMS_MESSAGE_QUEUE_STARVATION_LIMIT 16
+
+typedef struct _EMSMessageQueueTypeList EMSMessageQueueTypeList;
+typedef struct _EMSMessageQueueRing EMSMessageQueueRing;
+typedef struct _EMSMessageQueue EMSMessageQueue;
+
+/* What to do with a message pushed to a full queue. Internal messages are always queued. */
+typedef enum {
+    /* The push fails with EMS_ERROR_QUEUE_FULL, the caller keeps the message. */
+    EMS_MESSAGE_QUEUE_FAIL = 0,
+    /* The push waits until the consumer has made room. */
+    EMS_MESSAGE_QUEUE_BLOCK,
+    /* Make room by dropping the oldest messages of the lowest priority. */
+    EMS_MESSAGE_QUEUE_DROP_OLDEST,
+    /* Drop the pushed message. */
+    EMS_MESSAGE_QUEUE_DROP_NEWEST,
+} EMSMessageQueuePolicy;
+
+/* Called with above set when the queue reaches a high watermark, and with above
+ * unset when it is down to the low watermarks again. The callback runs in the pushing
+ * or popping thread, without the queue being locked. */
+typedef void (*EMSMessageQueueWatermarkFunc)(EMSMessageQueue *mq, int above, void *userdata);
+
+/* The limits of a queue. Counts and sizes of 0 mean there is no limit or high
+ * watermark, a low watermark of 0 means the queue is empty. Bytes are those of the
+ * encoded messages, with concurrent producers the limits may be exceeded slightly. */
+typedef struct {
+    uint64_t max_count;
+    size_t max_bytes;
+    EMSMessageQueuePolicy policy;
+
+    uint64_t high_count;
+    uint64_t low_count;
+    size_t high_bytes;
+    size_t low_bytes;
+    EMSMessageQueueWatermarkFunc watermark_func;
+    void *watermark_data;
+} EMSMessageQueueLimits;
+
+/* The queued messages of one priority. */
 typedef struct {
     EMSMessageQueueEntry *head;
     EMSMessageQueueEntry *tail;
+    uint32_t overtaken;          /* number of messages served before head */
+} EMSMessageQueueLevel;
+
+struct _EMSMessageQueue {
+    EMSMessageQueueLevel levels[EMS_MESSAGE_PRIORITY_COUNT]; /* index is the priority - 1 */
+    unsigned int level_mask;     /* bit set for each non-empty level */
     uint64_t count;              /* number of elements in queue */
     uint32_t *filters;           /* array of msgtypes */
     size_t filter_count;         /* number of active filters */
     size_t filter_max;           /* maximal number of filters */
+    EMSMessageQueueTypeList *types; /* hash table of the messages by type */
+    size_t type_count;           /* number of types in the table */
+    size_t type_max;             /* size of the table, a power of 2 */
+    uint64_t head_seq;           /* the seq numbers in use are [head_seq, tail_seq) */
+    uint64_t tail_seq;
     pthread_mutex_t queue_lock;  /* lock the queue */
     void *priv;                  /* private, do not read or write here */
-} EMSMessageQueue;
+    unsigned int flags;
+    _Atomic(EMSMessageQueueEntry *) pushed; /* MPSC: pushed, but not yet seen by the consumer (newest first) */
+    EMSMessageQueueLimits limits;
+    _Atomic(uint64_t) used_count; /* pushed and not yet popped, including those in pushed */
+    _Atomic(size_t) used_bytes;
+    atomic_int above_high;       /* a high watermark has been reached */
+    _Atomic(uint64_t) dropped;   /* number of messages dropped due to the limits */
+    pthread_cond_t space_cond;   /* signaled for blocked producers when there is room */
+    int space_waiters;
+    pthread_cond_t avail_cond;   /* signaled for waiting consumers when a message is pushed */
+    atomic_int avail_waiters;
+    pthread_cond_t internal_cond; /* the same for consumers waiting for internal messages */
+    atomic_int internal_waiters;
+    uint64_t internal_count;     /* number of internal messages in the queue */
+    int waits_cancelled;
+    atomic_int event_fd;         /* eventfd readable while the queue is not empty, or -1 */
+    int event_armed;             /* the eventfd is readable */
+    EMSMessageQueueRing *rings;  /* single-producer rings to merge */
+    EMSMessageQueueEntry **keyed; /* CONFLATE: hash table of the entries with a key */
+    size_t keyed_count;
+    size_t keyed_max;            /* size of the table, a power of 2 */
+    _Atomic(uint64_t) conflated; /* number of messages replaced by newer ones */
+};
 
 /* Initialize the queue. */
 void ems_message_queue_init(EMSMessageQueue *mq);
 
+/* Initialize the queue with EMS_MESSAGE_QUEUE_* flags. */
+void ems_message_queue_init_full(EMSMessageQueue *mq, unsigned int flags);
+
 /* Free used resources. */
 void ems_message_queue_clear(EMSMessageQueue *mq);
 
@@ -36,13 +141,52 @@ void ems_message_queue_add_filter(EMSMessageQueue *mq, uint32_t msgtype);
 /* Clear all filters. */
 void ems_message_queue_clear_filter(EMSMessageQueue *mq);
 
+/* Limit the queue, see EMSMessageQueueLimits. NULL removes all limits. Set the limits
+ * before pushing messages from other threads. */
+void ems_message_queue_set_limits(EMSMessageQueue *mq, const EMSMessageQueueLimits *limits);
+
+/* The number of messages dropped so far due to the limits. */
+uint64_t ems_message_queue_get_dropped(EMSMessageQueue *mq);
+
+/* The number of messages replaced by newer ones with the same key so far. */
+uint64_t ems_message_queue_get_conflated(EMSMessageQueue *mq);
+
+/* The push functions take over the reference to the message. They return EMS_OK, also if
+ * the message has been dropped due to the limits, or EMS_ERROR_QUEUE_FULL, in which case
+ * the caller keeps the reference. */
+
 /* Push a message to the end of the queue. */
-void ems_message_queue_push_tail(EMSMessageQueue *mq, EMSMessage *msg);
+int ems_message_queue_push_tail(EMSMessageQueue *mq, EMSMessage *msg);
+
+/* Push a message to the start of the queue, before the other messages of its priority. */
+int ems_message_queue_push_head(EMSMessageQueue *mq, EMSMessage *msg);
+
+/* Push a message to the end of the queue, overriding the priority of its class
+ * unless priority is EMS_MESSAGE_PRIORITY_DEFAULT. */
+int ems_message_queue_push_tail_with_priority(EMSMessageQueue *mq, EMSMessage *msg, EMSMessagePriority priority);
+
+/* Like ems_message_queue_push_tail_with_priority, but push to the start of the queue. */
+int ems_message_queue_push_head_with_priority(EMSMessageQueue *mq, EMSMessage *msg, EMSMessagePriority priority);
+
+/* Push count messages to the end of the queue at once. Returns the number of messages
+ * taken over. If that is less than count, the queue is full, and the remaining messages
+ * stay with the caller. */
+size_t ems_message_queue_push_many(EMSMessageQueue *mq, EMSMessage **msgs, size_t count);
 
-/* Push a message to the start of the queue. */
-void ems_message_queue_push_head(EMSMessageQueue *mq, EMSMessage *msg);
+/* Add a ring of at least size slots, through which a single thread pushes to the tail
+ * of the queue. Returns NULL on error. */
+EMSMessageQueueRing *ems_message_queue_add_ring(EMSMessageQueue *mq, size_t size);
 
-/* Get a message from the start of the head. */
+/* Merge the remaining messages of the ring into the queue and free it. The producer of
+ * the ring must not push anymore. */
+void ems_message_queue_remove_ring(EMSMessageQueue *mq, EMSMessageQueueRing *ring);
+
+/* Push count messages to the end of the queue of the ring, like ems_message_queue_push_many.
+ * Only the producer of the ring may call this. If the ring is full, the remaining
+ * messages are pushed to the queue directly. */
+size_t ems_message_queue_ring_push_many(EMSMessageQueueRing *ring, EMSMessage **msgs, size_t count);
+
+/* Get a message from the start of the head, the first one with the highest priority. */
 EMSMessage *ems_message_queue_pop_head(EMSMessageQueue *mq);
 
 /* Check the next message, but do not remove it from the queue. */
@@ -54,12 +198,48 @@ EMSMessage *ems_message_queue_pop_filtered(EMSMessageQueue *mq);
 /* Check if there is a message matching the specified filter. */
 EMSMessage *ems_message_queue_peek_filtered(EMSMessageQueue *mq);
 
-/* If the queue is disabled and the queue is empty, the special message EMSMessageQueueDisabled
- * will be returned. Other messages still on the queue will be delivered as usual. */
-void ems_message_queue_enable(EMSMessageQueue *mq, int enable);
+/* Like ems_message_queue_pop_filtered, but remove up to max messages at once and store
+ * them in msgs. Returns the number of messages, the disabled message is not returned. */
+size_t ems_message_queue_pop_many(EMSMessageQueue *mq, EMSMessage **msgs, size_t max);
+
+/* Remove up to max messages from the start of the queue and store them in msgs.
+ * Filters are ignored. Returns the number of messages, the disabled message is
+ * not returned. In MPSC mode everything pushed so far is collected at once. */
+size_t ems_message_queue_drain(EMSMessageQueue *mq, EMSMessage **msgs, size_t max);
 
 /* This function gets a message and user-defined data.
  * It shall return 0 if the message matches the filter criteria.
  */
 typedef int (*EMSMessageFilterFunc)(EMSMessage *, void *);
 EMSMessage *ems_message_queue_pop_matching(EMSMessageQueue *mq, EMSMessageFilterFunc filter, void *userdata);
+
+/* Like ems_message_queue_pop_head, but wait up to timeout_ms milliseconds for a message
+ * if the queue is empty. A negative timeout waits forever. Returns NULL if the wait timed
+ * out or waits have been cancelled. */
+EMSMessage *ems_message_queue_pop_wait(EMSMessageQueue *mq, int timeout_ms);
+
+/* Like ems_message_queue_pop_matching, but wait up to timeout_ms milliseconds for a
+ * matching message. A NULL filter matches all messages. The disabled message is not
+ * returned, since matching messages may still be pushed. */
+EMSMessage *ems_message_queue_pop_matching_wait(EMSMessageQueue *mq, EMSMessageFilterFunc filter,
+                                                void *userdata, int timeout_ms);
+
+/* Like ems_message_queue_pop_matching_wait, but only internal messages are considered.
+ * They are found by their types, so this does not depend on the number of other
+ * messages, and only pushing internal messages wakes the waiting thread. */
+EMSMessage *ems_message_queue_pop_internal_wait(EMSMessageQueue *mq, EMSMessageFilterFunc filter,
+                                                void *userdata, int timeout_ms);
+
+/* Get an eventfd, which is readable as long as the queue is not empty. It is created
+ * with the first call and closed by ems_message_queue_clear. Do not read from it, this
+ * is done by popping the last message. Returns -1 on error. */
+int ems_message_queue_get_fd(EMSMessageQueue *mq);
+
+/* Wake up all threads waiting in the queue. From now on, waits return NULL at once
+ * instead of blocking. This is meant for shutting the consumers down. */
+void ems_message_queue_cancel_waits(EMSMessageQueue *mq);
+
+/* If the queue is disabled and the queue is empty, the special message EMSMessageQueueDisabled
+ * will be returned. Other messages still on the queue will be delivered as usual. */
+void ems_message_queue_enable(EMSMessageQueue *mq, int enable);
+
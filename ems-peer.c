@@ -1,17 +1,54 @@
 #include "ems-peer.h"
 #include "ems-memory.h"
+#include "ems-error.h"
 #include <memory.h>
 #include "ems-messages-internal.h"
 #include "ems-status-messages.h"
 
 #include <stdio.h>
-#include <inttypes.h>
+
+/* Slots of the ring of each communicator feeding the message queue. */
+#define EMS_PEER_RING_SIZE 1024
 
 static void _ems_peer_handle_internal_message(EMSPeer *peer, EMSMessage *msg);
 static void *ems_peer_check_messages(EMSPeer *peer);
-static void ems_peer_signal_new_message(EMSPeer *peer);
-static void ems_peer_wait_for_message(EMSPeer *peer);
-static void ems_peer_wait_for_message_timeout(EMSPeer *peer, uint32_t timeout_ms);
+
+/* Set in senders once the communicators are about to be destroyed. */
+#define EMS_PEER_SENDERS_CLOSING (1u << 31)
+
+/* Wait until no thread is sending anymore, before the communicators are destroyed.
+ * Senders blocked for a full queue are released by lifting the limits, since the
+ * queue may not be drained anymore. The lock is held. */
+static
+void _ems_peer_wait_for_senders_unsafe(EMSPeer *peer)
+{
+    EMSList *tmp;
+
+    if (!(atomic_fetch_or(&peer->senders, EMS_PEER_SENDERS_CLOSING) & ~EMS_PEER_SENDERS_CLOSING))
+        return;
+    for (tmp = peer->communicators; tmp; tmp = tmp->next)
+        ems_message_queue_set_limits(&((EMSCommunicator *)tmp->data)->msg_queue_outgoing, NULL);
+    while (atomic_load(&peer->senders) & ~EMS_PEER_SENDERS_CLOSING)
+        pthread_cond_wait(&peer->senders_cond, &peer->peer_lock);
+}
+
+/* Stop sending. Once the communicators are about to be destroyed, the count is only
+ * changed under the lock, so the peer is not freed before we are done with it. */
+static
+void _ems_peer_leave_senders(EMSPeer *peer)
+{
+    unsigned int senders = atomic_load(&peer->senders);
+
+    do {
+        if (ems_unlikely(senders & EMS_PEER_SENDERS_CLOSING)) {
+            pthread_mutex_lock(&peer->peer_lock);
+            atomic_fetch_sub(&peer->senders, 1);
+            pthread_cond_broadcast(&peer->senders_cond);
+            pthread_mutex_unlock(&peer->peer_lock);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&peer->senders, &senders, senders - 1));
+}
 
 static
 void _ems_peer_signal_change(EMSPeer *peer, uint32_t peer_status, uint64_t remote_id)
@@ -34,11 +71,11 @@ EMSPeer *ems_peer_create(EMSPeerRole role)
     peer->is_alive = 1;
 
     peer->role = role;
-    ems_message_queue_init(&peer->msgqueue);
+    ems_message_queue_init_full(&peer->msgqueue, EMS_MESSAGE_QUEUE_CONFLATE);
 
     pthread_mutex_init(&peer->peer_lock, NULL);
-    pthread_mutex_init(&peer->msg_available_lock, NULL);
-    pthread_cond_init(&peer->msg_available_cond, NULL);
+    pthread_cond_init(&peer->connection_cond, NULL);
+    pthread_cond_init(&peer->senders_cond, NULL);
 
     int rc;
 
@@ -57,25 +94,30 @@ void ems_peer_destroy(EMSPeer *peer)
 
     EMSList *tmp;
     int rc;
+    /* ems_peer_terminate may still be running in another thread. */
+    pthread_mutex_lock(&peer->peer_lock);
+    _ems_peer_wait_for_senders_unsafe(peer);
     while (peer->communicators) {
         tmp = peer->communicators->next;
         ems_communicator_destroy((EMSCommunicator *)peer->communicators->data);
         ems_free(peer->communicators);
         peer->communicators = tmp;
     }
+    pthread_mutex_unlock(&peer->peer_lock);
 
     ems_peer_stop_event_loop(peer);
 
-    /* signal message to wake up thread */
-    ems_peer_signal_new_message(peer);
+    /* wake up thread */
+    peer->is_alive = 0;
+    ems_message_queue_cancel_waits(&peer->msgqueue);
     if ((rc = pthread_join(peer->check_message_thread, NULL)) != 0)
         fprintf(stderr, "%d ems_peer_destroy: pthread_join failed. rc: %d\n", getpid(), rc);
 
     ems_message_queue_clear(&peer->msgqueue);
 
     pthread_mutex_destroy(&peer->peer_lock);
-    pthread_mutex_destroy(&peer->msg_available_lock);
-    pthread_cond_destroy(&peer->msg_available_cond);
+    pthread_cond_destroy(&peer->connection_cond);
+    pthread_cond_destroy(&peer->senders_cond);
 
     ems_free(peer);
 }
@@ -100,14 +142,51 @@ void ems_peer_disconnect(EMSPeer *peer)
     pthread_mutex_unlock(&peer->peer_lock);
 }
 
-void ems_peer_send_message(EMSPeer *peer, EMSMessage *msg)
+int ems_peer_send_message(EMSPeer *peer, EMSMessage *msg)
+{
+    return ems_peer_send_message_with_priority(peer, msg, EMS_MESSAGE_PRIORITY_DEFAULT);
+}
+
+int ems_peer_send_message_with_priority(EMSPeer *peer, EMSMessage *msg, EMSMessagePriority priority)
 {
     EMSList *tmp;
+    int rc = EMS_OK;
     if (ems_unlikely(!peer->is_alive))
+        return EMS_OK;
+
+    /* Pushing may block for a full queue, which the communicator threads only drain
+     * if they can take peer_lock, so it is not held. Communicators are prepended, so
+     * the list from the head on does not change while we are registered as a sender. */
+    if (ems_unlikely(atomic_fetch_add(&peer->senders, 1) & EMS_PEER_SENDERS_CLOSING)) {
+        _ems_peer_leave_senders(peer);
+        return EMS_OK;
+    }
+
+    /* The message may have been changed since it was sent last time. This send
+     * encodes it anew, once for all communicators. */
+    ems_message_drop_encoding(msg);
+
+    for (tmp = atomic_load_explicit(&peer->communicators, memory_order_acquire); tmp; tmp = tmp->next) {
+        if (ems_communicator_send_message_with_priority((EMSCommunicator *)tmp->data, msg, priority) == EMS_ERROR_QUEUE_FULL)
+            rc = EMS_ERROR_QUEUE_FULL;
+    }
+
+    _ems_peer_leave_senders(peer);
+    return rc;
+}
+
+void ems_peer_set_outgoing_limits(EMSPeer *peer, const EMSMessageQueueLimits *limits)
+{
+    EMSList *tmp;
+    if (ems_unlikely(!peer))
         return;
     pthread_mutex_lock(&peer->peer_lock);
+    if (limits)
+        peer->outgoing_limits = *limits;
+    else
+        memset(&peer->outgoing_limits, 0, sizeof(EMSMessageQueueLimits));
     for (tmp = peer->communicators; tmp; tmp = tmp->next) {
-        ems_communicator_send_message((EMSCommunicator *)tmp->data, msg);
+        ems_message_queue_set_limits(&((EMSCommunicator *)tmp->data)->msg_queue_outgoing, limits);
     }
     pthread_mutex_unlock(&peer->peer_lock);
 }
@@ -117,6 +196,7 @@ void ems_peer_terminate(EMSPeer *peer)
 {
     EMSList *tmp;
     pthread_mutex_lock(&peer->peer_lock);
+    _ems_peer_wait_for_senders_unsafe(peer);
     while (peer->communicators) {
         tmp = peer->communicators->next;
         ems_communicator_destroy((EMSCommunicator *)peer->communicators->data);
@@ -124,10 +204,10 @@ void ems_peer_terminate(EMSPeer *peer)
         peer->communicators = tmp;
     }
     peer->is_alive = 0;
-    pthread_mutex_unlock(&peer->peer_lock);
 
     /* Wake up message loops. */
-    ems_peer_signal_new_message(peer);
+    ems_message_queue_cancel_waits(&peer->msgqueue);
+    pthread_mutex_unlock(&peer->peer_lock);
 }
 
 void ems_peer_shutdown(EMSPeer *peer)
@@ -146,12 +226,11 @@ void ems_peer_shutdown(EMSPeer *peer)
         ems_peer_send_message(peer, msg);
         ems_message_unref(msg);
 
-        /* wait for messages until there are no open connectinons anymore */
-        while (ems_peer_get_connection_count(peer)) {
-            /* The count could be decreased after the last call and the signal
-             * for the message might got lost. Therefore use a timeout. */
-            ems_peer_wait_for_message_timeout(peer, 500);
-        }
+        /* wait until there are no open connectinons anymore */
+        pthread_mutex_lock(&peer->peer_lock);
+        while (peer->connection_count)
+            pthread_cond_wait(&peer->connection_cond, &peer->peer_lock);
+        pthread_mutex_unlock(&peer->peer_lock);
     }
     else {
         msg = ems_message_new(__EMS_MESSAGE_LEAVE,
@@ -227,56 +306,15 @@ uint64_t ems_peer_get_id(EMSPeer *peer)
 
 void ems_peer_push_message(EMSPeer *peer, EMSMessage *msg)
 {
-    ems_message_queue_push_tail(&peer->msgqueue, msg);
-    ems_peer_signal_new_message(peer);
-}
-
-/* Signal the arrival of a new message in the queue. */
-static
-void ems_peer_signal_new_message(EMSPeer *peer)
-{
-    pthread_mutex_lock(&peer->msg_available_lock);
-    pthread_cond_broadcast(&peer->msg_available_cond);
-    pthread_mutex_unlock(&peer->msg_available_lock);
-}
-
-/* Wait for new messages.
- * This blocks the execution of the calling thread until a new message arrives.
- */
-static
-void ems_peer_wait_for_message(EMSPeer *peer)
-{
-    pthread_mutex_lock(&peer->msg_available_lock);
-#if DEBUG
-    if (peer->msgqueue.count > 30)
-        fprintf(stderr, "msgqueue count: %" PRIu64 "\n", peer->msgqueue.count);
-#endif
-    if (!ems_message_queue_peek_head(&peer->msgqueue))
-        pthread_cond_wait(&peer->msg_available_cond, &peer->msg_available_lock);
-    pthread_mutex_unlock(&peer->msg_available_lock);
+    if (ems_unlikely(ems_message_queue_push_tail(&peer->msgqueue, msg) != EMS_OK))
+        ems_message_unref(msg);
 }
 
-/* Wait for new messages or a timeout.
- * This blocks the execution of the calling thread until a new message arrives or
- * the timeout (in milliseconds) is expired.
- */
-static
-void ems_peer_wait_for_message_timeout(EMSPeer *peer, uint32_t timeout_ms)
+void ems_peer_push_messages(EMSPeer *peer, EMSMessage **msgs, size_t count)
 {
-    struct timespec timeout;
-
-    clock_gettime(CLOCK_REALTIME, &timeout);
-
-    timeout.tv_sec += timeout_ms / 1000;
-    timeout.tv_nsec += (timeout_ms % 1000) * 1e6;
-    if (timeout.tv_nsec >= 1e9) {
-        ++timeout.tv_sec;
-        timeout.tv_nsec -= 1e9;
-    }
-
-    pthread_mutex_lock(&peer->msg_available_lock);
-    pthread_cond_timedwait(&peer->msg_available_cond, &peer->msg_available_lock, &timeout);
-    pthread_mutex_unlock(&peer->msg_available_lock);
+    size_t j = ems_message_queue_push_many(&peer->msgqueue, msgs, count);
+    for (; j < count; ++j)
+        ems_message_unref(msgs[j]);
 }
 
 /* Get messages but filter out internal messages. */
@@ -293,14 +331,41 @@ EMSMessage *ems_peer_get_message(EMSPeer *peer)
     return msg;
 }
 
+size_t ems_peer_get_messages(EMSPeer *peer, EMSMessage **msgs, size_t max)
+{
+    size_t count, j, n;
+    do {
+        count = ems_message_queue_pop_many(&peer->msgqueue, msgs, max);
+        for (j = 0, n = 0; j < count; ++j) {
+            if (EMS_MESSAGE_IS_INTERNAL(msgs[j]))
+                _ems_peer_handle_internal_message(peer, msgs[j]);
+            else
+                msgs[n++] = msgs[j];
+        }
+    } while (n == 0 && count > 0);
+
+    return n;
+}
+
+int ems_peer_get_fd(EMSPeer *peer)
+{
+    if (ems_unlikely(!peer))
+        return -1;
+    return ems_message_queue_get_fd(&peer->msgqueue);
+}
+
 void ems_peer_add_communicator(EMSPeer *peer, EMSCommunicator *comm)
 {
     if (!peer || !comm)
         return;
 
     pthread_mutex_lock(&peer->peer_lock);
-    peer->communicators = ems_list_prepend(peer->communicators, comm);
+    atomic_store_explicit(&peer->communicators, ems_list_prepend(peer->communicators, comm),
+                          memory_order_release);
     comm->peer = peer;
+    if (!comm->peer_ring)
+        comm->peer_ring = ems_message_queue_add_ring(&peer->msgqueue, EMS_PEER_RING_SIZE);
+    ems_message_queue_set_limits(&comm->msg_queue_outgoing, &peer->outgoing_limits);
     ems_communicator_set_peer_id(comm, peer->id);
     pthread_mutex_unlock(&peer->peer_lock);
 }
@@ -318,6 +383,7 @@ void _ems_peer_handle_internal_message(EMSPeer *peer, EMSMessage *msg)
 #ifdef DEBUG
             fprintf(stderr, "[%d] connection ADD\n", getpid());
 #endif
+            pthread_cond_broadcast(&peer->connection_cond);
             pthread_mutex_unlock(&peer->peer_lock);
             _ems_peer_signal_change(peer, EMS_PEER_STATUS_CONNECTION_ADD, 0);
             break;
@@ -327,6 +393,7 @@ void _ems_peer_handle_internal_message(EMSPeer *peer, EMSMessage *msg)
 #ifdef DEBUG
             fprintf(stderr, "[%d] connection DEL\n", getpid());
 #endif
+            pthread_cond_broadcast(&peer->connection_cond);
             pthread_mutex_unlock(&peer->peer_lock);
             _ems_peer_signal_change(peer, EMS_PEER_STATUS_CONNECTION_DEL, ((EMSMessageIntConnectionDel *)msg)->remote_id);
             break;
@@ -358,22 +425,20 @@ void _ems_peer_handle_internal_message(EMSPeer *peer, EMSMessage *msg)
 static
 int _ems_peer_filter_internal_message(EMSMessage *msg, void *nil)
 {
-    return !EMS_MESSAGE_IS_INTERNAL(msg);
+    /* Wakeups are for the event loop. */
+    return msg->type == __EMS_MESSAGE_WAKEUP;
 }
 
-/* Check for internal messages. */
+/* Check for internal messages. User messages pushed meanwhile do not wake us up. */
 static
 void *ems_peer_check_messages(EMSPeer *peer)
 {
     EMSMessage *msg;
     while (peer->is_alive) {
-        ems_peer_wait_for_message(peer);
-        while ((msg = ems_message_queue_pop_matching(&peer->msgqueue,
-                                                     (EMSMessageFilterFunc)_ems_peer_filter_internal_message,
-                                                     NULL)) != NULL &&
-                msg->type != __EMS_MESSAGE_QUEUE_DISABLED) {
+        if ((msg = ems_message_queue_pop_internal_wait(&peer->msgqueue,
+                                                       (EMSMessageFilterFunc)_ems_peer_filter_internal_message,
+                                                       NULL, -1)) != NULL)
             _ems_peer_handle_internal_message(peer, msg);
-        }
     }
 
 #if DEBUG
@@ -388,18 +453,29 @@ struct _EMSPeerEventCallbackData {
     void *userdata;
 };
 
+#define EMS_PEER_EVENT_BATCH_MAX 16
+
 static
 void *_ems_peer_event_loop(struct _EMSPeerEventCallbackData *data)
 {
     /* msg checking */
+    EMSMessage *msgs[EMS_PEER_EVENT_BATCH_MAX];
     EMSMessage *msg;
+    size_t count, j;
     while (data->peer->is_alive && data->peer->msg_thread_enabled) {
-        ems_peer_wait_for_message(data->peer);
-        while (data->peer->msg_thread_enabled &&
-                (msg = ems_peer_get_message(data->peer)) != NULL) {
-            if (data->event_cb && msg->type != __EMS_MESSAGE_QUEUE_DISABLED)
-                data->event_cb(data->peer, msg, data->userdata);
-            ems_message_unref(msg);
+        /* Wait for the first message, the rest of the batch is taken without waiting. */
+        if ((msg = ems_message_queue_pop_matching_wait(&data->peer->msgqueue, NULL, NULL, -1)) == NULL)
+            continue;
+        if (EMS_MESSAGE_IS_INTERNAL(msg)) {
+            _ems_peer_handle_internal_message(data->peer, msg);
+            continue;
+        }
+        msgs[0] = msg;
+        count = 1 + ems_peer_get_messages(data->peer, &msgs[1], EMS_PEER_EVENT_BATCH_MAX - 1);
+        for (j = 0; j < count; ++j) {
+            if (data->event_cb)
+                data->event_cb(data->peer, msgs[j], data->userdata);
+            ems_message_unref(msgs[j]);
         }
     }
 
@@ -441,14 +517,13 @@ void ems_peer_stop_event_loop(EMSPeer *peer)
 {
     if (ems_unlikely(!peer))
         return;
-    peer->msg_thread_enabled = 0;
+    if (peer->msg_thread_enabled) {
+        peer->msg_thread_enabled = 0;
+        /* wake up event loop, the message stays queued if it is not waiting yet */
+        ems_peer_push_message(peer, ems_message_new(__EMS_MESSAGE_WAKEUP, peer->id, peer->id, NULL, NULL));
+    }
     if (peer->msg_thread_running) {
-        ems_peer_signal_new_message(peer);
         pthread_join(peer->event_loop, NULL);
         peer->msg_thread_running = 0;
     }
-    else {
-        /* just wake up event loop */
-        ems_peer_signal_new_message(peer);
-    }
 }
@@ -13,15 +13,16 @@
  * the other peers/slaves or to the master. Each peer has an unique id, the master
  * being 0. Messages can be sent to all peers or just to one specific peer.
  *
- * Messages are retrieved by ems_peer_get_message. You can wait for incoming messages
- * with ems_peer_wait_for_message or ems_peer_wait_for_message_timeout as long
- * as the peer is alive.
+ * Messages are retrieved by ems_peer_get_message. To wait for incoming messages,
+ * run an event loop with ems_peer_start_event_loop as long as the peer is alive,
+ * or poll the file descriptor of ems_peer_get_fd in your own loop.
  */
 #pragma once
 
 #include "ems-msg-queue.h"
 #include "ems-util.h"
 #include <stdint.h>
+#include <stdatomic.h>
 
 /* The role of this peer. It can either be the master or a slave. */
 typedef enum {
@@ -41,8 +42,12 @@ struct _EMSPeer {
     /* The message queue for incoming messages. */
     EMSMessageQueue msgqueue;
 
-    /* The list of all installed communicators. */
-    EMSList *communicators; /* EMSCommunicator */
+    /* The limits of the outgoing queues, see ems_peer_set_outgoing_limits. */
+    EMSMessageQueueLimits outgoing_limits;
+
+    /* The list of all installed communicators. New ones are prepended, so senders
+     * take the head without peer_lock and do not see the list change behind it. */
+    _Atomic(EMSList *) communicators; /* EMSCommunicator */
 
     /* The last id given to a peer. Each new peer gets a message from the
      * master informing it about its id. */
@@ -52,10 +57,17 @@ struct _EMSPeer {
      * or if slaves leave, or there is an error in the connection. */
     uint32_t connection_count;
 
-    /* Locks for the data and the condition of available messages. */
+    /* Lock for the data, and the condition signaled with it if the number of
+     * connections changes. */
     pthread_mutex_t peer_lock;
-    pthread_mutex_t msg_available_lock;
-    pthread_cond_t  msg_available_cond;
+    pthread_cond_t  connection_cond;
+
+    /* The number of threads sending messages without holding peer_lock, which may
+     * block for a full queue. Before the communicators are destroyed, the top bit is
+     * set under peer_lock. From then on senders leave under peer_lock and signal
+     * senders_cond, which is waited for until there are none. */
+    atomic_uint senders;
+    pthread_cond_t  senders_cond;
 
     /* Flag indicating that the peer is alive. In a dead peer no more messages are
      * received.
@@ -85,8 +97,22 @@ void ems_peer_connect(EMSPeer *peer);
 /* Disconnect all communicators. */
 void ems_peer_disconnect(EMSPeer *peer);
 
-/* Send a message to one or all connected peers. */
-void ems_peer_send_message(EMSPeer *peer, EMSMessage *msg);
+/* Send a message to one or all connected peers. Returns EMS_ERROR_QUEUE_FULL if an
+ * outgoing queue is full, see ems_peer_set_outgoing_limits.
+ * The message is encoded once for all communicators. An encoding left from an earlier
+ * send is dropped first, so a message may be changed and sent again. Do not change it
+ * while it may still be waiting in a queue, send a copy instead. Writes in progress
+ * keep the encoding they started with.
+ */
+int ems_peer_send_message(EMSPeer *peer, EMSMessage *msg);
+
+/* Send a message, overriding the priority of its class, see EMSMessagePriority. */
+int ems_peer_send_message_with_priority(EMSPeer *peer, EMSMessage *msg, EMSMessagePriority priority);
+
+/* Limit the outgoing queues of all communicators, including those added later, see
+ * EMSMessageQueueLimits. Set the limits before connecting. The incoming queue can be
+ * limited with ems_message_queue_set_limits on msgqueue. */
+void ems_peer_set_outgoing_limits(EMSPeer *peer, const EMSMessageQueueLimits *limits);
 
 /* Shutdown the peer. This stops all communicators, informing all connected peers about
  * this in advance and waits until all connections are closed.
@@ -114,6 +140,10 @@ uint64_t ems_peer_get_id(EMSPeer *peer);
  */
 void ems_peer_push_message(EMSPeer *peer, EMSMessage *msg);
 
+/* Push count messages to the message queue at once, waking waiting threads once.
+ * Messages not taken by a full queue are dropped. */
+void ems_peer_push_messages(EMSPeer *peer, EMSMessage **msgs, size_t count);
+
 /* Retrieve a message from the peer.
  * Internally, this checks first if the next message is for internal use only
  * and handles it if this is the case.
@@ -121,6 +151,15 @@ void ems_peer_push_message(EMSPeer *peer, EMSMessage *msg);
 /* FIXME: get message with (timed) wait? -> no, want still just peek for messages */
 EMSMessage *ems_peer_get_message(EMSPeer *peer);
 
+/* Retrieve up to max messages at once, internal messages are handled like in
+ * ems_peer_get_message. Returns the number of messages stored in msgs. */
+size_t ems_peer_get_messages(EMSPeer *peer, EMSMessage **msgs, size_t max);
+
+/* Get a file descriptor, which is readable as long as messages are pending. Do not
+ * read from it, but get the messages with ems_peer_get_messages until it returns 0.
+ * Do not mix this with an event loop. Returns -1 on error. */
+int ems_peer_get_fd(EMSPeer *peer);
+
 #include "ems-communicator.h"
 
 /* Add a communicator to the peer. */
@@ -130,6 +169,7 @@ void ems_peer_add_communicator(EMSPeer *peer, EMSCommunicator *comm);
 typedef void (*EMSPeerEventCallback)(EMSPeer *, EMSMessage *, void *);
 void ems_peer_start_event_loop(EMSPeer *peer, EMSPeerEventCallback event_cb, void *userdata, int do_return);
 
-/* Stop a possible event loop */
+/* Stop a possible event loop. Messages the loop has already taken from the queue
+ * are still passed to the callback. */
 void ems_peer_stop_event_loop(EMSPeer *peer);
 
@@ -12,4 +12,7 @@ typedef enum {
     EMS_TYPE_POINTER,
     EMS_TYPE_FIXED_STRING,
     EMS_TYPE_STRING,
+    EMS_TYPE_BYTES,
+    EMS_TYPE_ARRAY,
+    EMS_TYPE_SMALL_STRING,
 } EMSType;
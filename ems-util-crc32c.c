@@ -0,0 +1,123 @@
+#include "ems-util-crc32c.h"
+#include "ems-error.h"
+#include <memory.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EMS_UTIL_CRC32C_SSE42 1
+#include <immintrin.h>
+#endif
+
+/* The reflected Castagnoli polynomial. */
+#define EMS_UTIL_CRC32C_POLY 0x82f63b78
+
+/* Tables for slicing-by-8. table[0] is the usual byte-wise table, table[k] advances
+ * a byte over k further zero bytes. */
+static uint32_t crc32c_table[8][256];
+
+typedef uint32_t (*EMSUtilCrc32cFunc)(uint32_t, const uint8_t *, size_t);
+
+static
+uint32_t _ems_util_crc32c_sw(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --length;
+    }
+    while (length >= 8) {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = crc32c_table[7][crc & 0xff] ^
+              crc32c_table[6][(crc >> 8) & 0xff] ^
+              crc32c_table[5][(crc >> 16) & 0xff] ^
+              crc32c_table[4][crc >> 24] ^
+              crc32c_table[3][p[4]] ^
+              crc32c_table[2][p[5]] ^
+              crc32c_table[1][p[6]] ^
+              crc32c_table[0][p[7]];
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef EMS_UTIL_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static
+uint32_t _ems_util_crc32c_sse42(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --length;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    uint64_t value;
+    while (length >= 8) {
+        memcpy(&value, p, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    uint32_t value32;
+    while (length >= 4) {
+        memcpy(&value32, p, 4);
+        crc = _mm_crc32_u32(crc, value32);
+        p += 4;
+        length -= 4;
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static EMSUtilCrc32cFunc _ems_util_crc32c = _ems_util_crc32c_sw;
+
+/* Build the tables and choose the implementation when the library is loaded. */
+__attribute__((constructor))
+static
+void _ems_util_crc32c_init(void)
+{
+    uint32_t crc;
+    int j, k;
+
+    for (j = 0; j < 256; ++j) {
+        crc = j;
+        for (k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (crc & 1 ? EMS_UTIL_CRC32C_POLY : 0);
+        crc32c_table[0][j] = crc;
+    }
+    for (j = 0; j < 256; ++j) {
+        for (k = 1; k < 8; ++k)
+            crc32c_table[k][j] = (crc32c_table[k - 1][j] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][j] & 0xff];
+    }
+
+#ifdef EMS_UTIL_CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        _ems_util_crc32c = _ems_util_crc32c_sse42;
+#endif
+}
+
+uint32_t ems_util_crc32c(uint32_t crc, const void *data, size_t length)
+{
+    return ~_ems_util_crc32c(~crc, (const uint8_t *)data, length);
+}
+
+int ems_util_crc32c_use_hardware(int enable)
+{
+    if (!enable) {
+        _ems_util_crc32c = _ems_util_crc32c_sw;
+        return EMS_OK;
+    }
+#ifdef EMS_UTIL_CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        _ems_util_crc32c = _ems_util_crc32c_sse42;
+        return EMS_OK;
+    }
+#endif
+    return EMS_ERROR_INVALID_ARGUMENT;
+}
@@ -0,0 +1,14 @@
+/* CRC32C (Castagnoli) checksums, used to protect frames on the wire. */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Continue the checksum crc over length bytes of data. Start with crc 0. This uses
+ * the crc32 instruction of SSE 4.2 if available, and slicing-by-8 otherwise. */
+uint32_t ems_util_crc32c(uint32_t crc, const void *data, size_t length);
+
+/* Use the crc32 instruction (enable non-zero) or slicing-by-8. Returns EMS_ERROR_INVALID_ARGUMENT
+ * if the CPU lacks the instruction. This is meant for benchmarks and tests, call it while no
+ * connection is open. */
+int ems_util_crc32c_use_hardware(int enable);
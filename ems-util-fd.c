@@ -5,7 +5,7 @@
 #include <poll.h>
 #include <errno.h>
 
-ssize_t ems_util_write_full(int fd, uint8_t *buffer, size_t length)
+ssize_t ems_util_write_full(int fd, const uint8_t *buffer, size_t length)
 {
     ssize_t rc;
     ssize_t bytes_written = 0;
@@ -31,6 +31,51 @@ ssize_t ems_util_write_full(int fd, uint8_t *buffer, size_t length)
     return bytes_written;
 }
 
+ssize_t ems_util_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t rc;
+    ssize_t bytes_written = 0;
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    poll(&pfd, 1, 0);
+
+    if (ems_unlikely(pfd.revents & POLLHUP))
+        return -1;
+
+    while (iovcnt > 0) {
+        /* skip what has been written completely */
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+        rc = writev(fd, iov, iovcnt);
+        if (rc <= 0) {
+            fprintf(stderr, "writev_full returned %zd (written %zd), errno: %d\n", rc, bytes_written, errno);
+            return rc;
+        }
+        bytes_written += rc;
+        while (rc > 0) {
+            if ((size_t)rc >= iov->iov_len) {
+                rc -= iov->iov_len;
+                iov->iov_len = 0;
+                ++iov;
+                --iovcnt;
+            }
+            else {
+                iov->iov_base = (uint8_t *)iov->iov_base + rc;
+                iov->iov_len -= rc;
+                rc = 0;
+            }
+        }
+    }
+
+    return bytes_written;
+}
+
 ssize_t ems_util_read_full(int fd, uint8_t *buffer, size_t length)
 {
     ssize_t bytes_read = 0;
@@ -4,12 +4,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 /* Write a buffer of given length to the file descriptor fd.
  * This returns after the full buffer has been written or an
  * error occurred.
  */
-ssize_t ems_util_write_full(int fd, uint8_t *buffer, size_t length);
+ssize_t ems_util_write_full(int fd, const uint8_t *buffer, size_t length);
+
+/* Write all iovcnt buffers to the file descriptor fd, like ems_util_write_full.
+ * The iov array is changed while writing.
+ */
+ssize_t ems_util_writev_full(int fd, struct iovec *iov, int iovcnt);
 
 /* Read length bytes into buffer from the file descriptor fd.
  * This returns after the full amount has been read or an
@@ -1,14 +1,19 @@
 /* Some utilities used throughout the library. */
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define ems_likely(x)   __builtin_expect((x), 1)
 #define ems_unlikely(x) __builtin_expect((x), 0)
 
+/* Data written by different threads is kept this far apart. */
+#define EMS_CACHE_LINE_SIZE 64
+
 typedef void *(*PThreadCallback)(void *);
 
 #define EMS_UTIL_POINTER_TO_INT(p) ((int)(long)(p))
+#define EMS_UTIL_POINTER_TO_SIZE(p) ((size_t)(uintptr_t)(p))
 
 #include "ems-util-list.h"
 #include "ems-util-fd.h"
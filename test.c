@@ -11,6 +11,7 @@
 void test_register_messages(void)
 {
     EMSMessageClass cls;
+    memset(&cls, 0, sizeof(EMSMessageClass));
     cls.msgtype = EMS_TEST_MESSAGE_QUIT;
     cls.size = sizeof(EMSMessage);
     cls.min_payload = 0;
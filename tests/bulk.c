@@ -0,0 +1,182 @@
+/* The array conversions of every available kernel against the per-element helpers. */
+#include <stdlib.h>
+#include <string.h>
+#include "ems.h"
+#include "check.h"
+
+#define MAX_COUNT  4200
+#define MAX_OFFSET 32
+#define GUARD      64
+
+/* The element counts to test: all small ones, and some around the vector widths. */
+static const size_t large_counts[] = { 255, 256, 257, 1023, 1024, 1025, 4097, MAX_COUNT };
+#define SMALL_COUNTS 130
+
+typedef void (*WriteArrayFunc)(uint8_t *payload, uint32_t offset, const void *values, size_t count);
+typedef void (*ReadArrayFunc)(uint8_t *payload, uint32_t offset, void *values, size_t count);
+
+/* Write and read a single element of the size, floats as their bits. */
+static void write_element(uint8_t *payload, uint32_t offset, const uint8_t *value, size_t size)
+{
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+
+    switch (size) {
+        case 2:
+            memcpy(&u16, value, 2);
+            ems_message_write_u16(payload, offset, u16);
+            break;
+        case 4:
+            memcpy(&u32, value, 4);
+            ems_message_write_u32(payload, offset, u32);
+            break;
+        default:
+            memcpy(&u64, value, 8);
+            ems_message_write_u64(payload, offset, u64);
+            break;
+    }
+}
+
+static void read_element(uint8_t *payload, uint32_t offset, uint8_t *value, size_t size)
+{
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+
+    switch (size) {
+        case 2:
+            u16 = ems_message_read_u16(payload, offset);
+            memcpy(value, &u16, 2);
+            break;
+        case 4:
+            u32 = ems_message_read_u32(payload, offset);
+            memcpy(value, &u32, 4);
+            break;
+        default:
+            u64 = ems_message_read_u64(payload, offset);
+            memcpy(value, &u64, 8);
+            break;
+    }
+}
+
+static const struct {
+    const char *name;
+    size_t size;
+    WriteArrayFunc write;
+    ReadArrayFunc read;
+} types[] = {
+    { "u16",    2, (WriteArrayFunc)ems_message_write_u16_array,    (ReadArrayFunc)ems_message_read_u16_array },
+    { "u32",    4, (WriteArrayFunc)ems_message_write_u32_array,    (ReadArrayFunc)ems_message_read_u32_array },
+    { "u64",    8, (WriteArrayFunc)ems_message_write_u64_array,    (ReadArrayFunc)ems_message_read_u64_array },
+    { "float",  4, (WriteArrayFunc)ems_message_write_float_array,  (ReadArrayFunc)ems_message_read_float_array },
+    { "double", 8, (WriteArrayFunc)ems_message_write_double_array, (ReadArrayFunc)ems_message_read_double_array },
+};
+
+/* Buffers of MAX_COUNT elements of 8 bytes behind MAX_OFFSET bytes, with guards.
+ * Bytes next to the converted ones must not change. */
+static uint8_t *values, *result, *payload, *expected;
+
+static void fill(uint8_t *buffer, size_t length)
+{
+    size_t j;
+    for (j = 0; j < length; ++j)
+        buffer[j] = (uint8_t)rand();
+}
+
+/* The payload starts at offset, the values at element start, so both may be unaligned. */
+static int check_write(size_t t, size_t count, uint32_t offset, size_t start)
+{
+    size_t size = types[t].size;
+    size_t length = GUARD + offset + count * size + GUARD;
+    size_t j;
+
+    memset(payload, 0xa5, length);
+    memset(expected, 0xa5, length);
+    for (j = 0; j < count; ++j)
+        write_element(&expected[GUARD], offset + j * size, &values[(start + j) * size], size);
+    types[t].write(&payload[GUARD], offset, &values[start * size], count);
+
+    return memcmp(payload, expected, length) != 0;
+}
+
+static int check_read(size_t t, size_t count, uint32_t offset, size_t start)
+{
+    size_t size = types[t].size;
+    size_t length = (start + count) * size + GUARD;
+    size_t j;
+
+    memset(result, 0x5a, length);
+    memset(expected, 0x5a, length);
+    for (j = 0; j < count; ++j)
+        read_element(&payload[GUARD], offset + j * size, &expected[(start + j) * size], size);
+    types[t].read(&payload[GUARD], offset, &result[start * size], count);
+
+    return memcmp(result, expected, length) != 0;
+}
+
+static size_t check_count(size_t count)
+{
+    size_t failures = 0;
+    size_t t, start;
+    uint32_t offset;
+
+    for (t = 0; t < sizeof(types) / sizeof(types[0]); ++t) {
+        for (offset = 0; offset < MAX_OFFSET; ++offset) {
+            start = offset % 3;
+            if (check_write(t, count, offset, start)) {
+                fprintf(stderr, "write_%s_array: count %zu offset %u\n", types[t].name, count, offset);
+                ++failures;
+            }
+            fill(payload, GUARD + offset + count * types[t].size + GUARD);
+            if (check_read(t, count, offset, start)) {
+                fprintf(stderr, "read_%s_array: count %zu offset %u\n", types[t].name, count, offset);
+                ++failures;
+            }
+        }
+    }
+    return failures;
+}
+
+static void test_kernels(void)
+{
+    static const EMSMessageBulkKernels kernels[] = {
+        EMS_MESSAGE_BULK_SCALAR, EMS_MESSAGE_BULK_SSSE3, EMS_MESSAGE_BULK_AVX2,
+    };
+    size_t j, count;
+
+    for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); ++j) {
+        /* Kernels the CPU does not support are rejected. */
+        if (ems_message_bulk_use_kernels(kernels[j]) != EMS_OK)
+            continue;
+        for (count = 0; count < SMALL_COUNTS; ++count)
+            CHECK(check_count(count) == 0);
+        for (count = 0; count < sizeof(large_counts) / sizeof(large_counts[0]); ++count)
+            CHECK(check_count(large_counts[count]) == 0);
+    }
+    CHECK(ems_message_bulk_use_kernels(EMS_MESSAGE_BULK_SCALAR) == EMS_OK);
+}
+
+int main(void)
+{
+    size_t length = GUARD + MAX_OFFSET + MAX_COUNT * 8 + GUARD;
+
+    ems_init("EMSG");
+
+    values = malloc(length);
+    result = malloc(length);
+    payload = malloc(length);
+    expected = malloc(length);
+    fill(values, length);
+
+    test_kernels();
+
+    free(expected);
+    free(payload);
+    free(result);
+    free(values);
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,16 @@
+/* A minimal harness for the programs in this directory, run by "make check". */
+#pragma once
+
+#include <stdio.h>
+
+static int check_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++check_failures; \
+        } \
+    } while (0)
+
+/* Return this from main. */
+#define CHECK_RESULT() (check_failures ? 1 : 0)
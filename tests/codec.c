@@ -0,0 +1,92 @@
+/* The generic codec derived from the registered members. */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "ems.h"
+#include "check.h"
+
+#define TEST_MESSAGE (EMS_MESSAGE_USER + 1)
+
+/* The pointer is not put on the wire, but still limits the string before it. */
+typedef struct {
+    EMSMessage parent;
+    char name[16];
+    void *p;
+    uint32_t x;
+} TestMessage;
+
+static void register_type(void)
+{
+    EMSMessageClass cls;
+
+    memset(&cls, 0, sizeof(EMSMessageClass));
+    cls.size = sizeof(TestMessage);
+    cls.flags = EMS_MESSAGE_CLASS_AUTO_CODEC;
+    ems_message_register_type(TEST_MESSAGE, &cls);
+
+    ems_message_type_add_member(TEST_MESSAGE, EMS_MSG_MEMBER_FIXED_STRING, 1, "name",
+                                offsetof(TestMessage, name), NULL);
+    ems_message_type_add_member(TEST_MESSAGE, EMS_MSG_MEMBER_POINTER, 2, "p",
+                                offsetof(TestMessage, p), NULL);
+    ems_message_type_add_member(TEST_MESSAGE, EMS_MSG_MEMBER_UINT, 3, "x",
+                                offsetof(TestMessage, x), NULL);
+}
+
+static void decode(EMSMessage *msg, const uint8_t *data, size_t length)
+{
+    uint8_t *payload = ems_message_alloc_payload(msg, length);
+    memcpy(payload, data, length);
+    ems_message_decode_payload(msg, payload, length);
+    ems_message_release_payload(msg, payload);
+}
+
+static void test_round_trip(void)
+{
+    TestMessage *src = (TestMessage *)ems_message_new(TEST_MESSAGE, 0, 0, "name", "hello", "x", 42, NULL, NULL);
+    TestMessage *dst = (TestMessage *)ems_message_new(TEST_MESSAGE, 0, 0, NULL, NULL);
+    EMSMessageEncoding *encoding = ems_message_get_encoding((EMSMessage *)src);
+    size_t length;
+    const uint8_t *frame = ems_message_encoding_get_frame(encoding, 0, &length);
+
+    CHECK(frame && length == EMS_MESSAGE_HEADER_SIZE + 4 + 5 + 4);
+    if (frame)
+        decode((EMSMessage *)dst, &frame[EMS_MESSAGE_HEADER_SIZE], length - EMS_MESSAGE_HEADER_SIZE);
+    CHECK(strcmp(dst->name, "hello") == 0);
+    CHECK(dst->x == 42);
+
+    ems_message_encoding_unref(encoding);
+    ems_message_unref((EMSMessage *)src);
+    ems_message_unref((EMSMessage *)dst);
+}
+
+/* A peer sending a longer string must not write beyond the member. */
+static void test_long_fixed_string(void)
+{
+    TestMessage *msg = (TestMessage *)ems_message_new(TEST_MESSAGE, 0, 0, NULL, NULL);
+    uint8_t payload[4 + 20 + 4];
+
+    ems_message_write_u32(payload, 0, 20);
+    memset(&payload[4], 'A', 20);
+    ems_message_write_u32(payload, 24, 7);
+    msg->p = &payload;
+
+    decode((EMSMessage *)msg, payload, sizeof(payload));
+    CHECK(msg->p == &payload);
+    CHECK(strlen(msg->name) == sizeof(msg->name) - 1);
+    CHECK(msg->x == 7);
+
+    ems_message_unref((EMSMessage *)msg);
+}
+
+int main(void)
+{
+    ems_init("EMSG");
+
+    register_type();
+    test_round_trip();
+    test_long_fixed_string();
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,133 @@
+/* The bundled LZ codec and the size checks of ems_message_decompress_payload. */
+#include <stdlib.h>
+#include <string.h>
+#include "ems.h"
+#include "ems-message-lz.h"
+#include "check.h"
+
+#define TEST_MESSAGE (EMS_MESSAGE_USER + 1)
+
+static uint32_t seed = 1;
+
+static uint8_t next_byte(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+/* Random bytes, or mostly copies of earlier stretches with some random ones. */
+static void fill(uint8_t *data, size_t length, int compressible)
+{
+    size_t j = 0, run, from;
+    while (j < length) {
+        if (compressible && j >= 256 && next_byte() < 224) {
+            from = j - 1 - next_byte();
+            for (run = 4 + next_byte() % 60; run && j < length; --run)
+                data[j++] = data[from++];
+        }
+        else {
+            data[j++] = next_byte();
+        }
+    }
+}
+
+static void test_round_trip(size_t length, int compressible)
+{
+    size_t capacity = length + length / 255 + 16;
+    uint8_t *src = calloc(1, length + 1);
+    uint8_t *packed = malloc(capacity);
+    uint8_t *out = malloc(length + 1);
+    size_t size, j;
+
+    fill(src, length, compressible);
+    size = ems_message_lz_compress(src, length, packed, capacity);
+    CHECK(size > 0 || length == 0);
+    if (size) {
+        CHECK(ems_message_lz_decompress(packed, size, out, length) == length);
+        CHECK(memcmp(src, out, length) == 0);
+        if (compressible && length >= 1024)
+            CHECK(size < length / 2);
+
+        /* Too little room for the output. */
+        if (length)
+            CHECK(ems_message_lz_decompress(packed, size, out, length - 1) == 0);
+
+        /* Truncated input never yields the whole output. */
+        for (j = 0; length && j < size; j += 1 + j / 8)
+            CHECK(ems_message_lz_decompress(packed, j, out, length) != length);
+    }
+
+    free(out);
+    free(packed);
+    free(src);
+}
+
+static void test_garbage(void)
+{
+    uint8_t src[256];
+    uint8_t out[1024];
+    size_t j, k;
+
+    for (j = 0; j < 1000; ++j) {
+        for (k = 0; k < sizeof(src); ++k)
+            src[k] = next_byte();
+        /* Must stay within out, whatever the result. */
+        CHECK(ems_message_lz_decompress(src, 1 + j % sizeof(src), out, sizeof(out)) <= sizeof(out));
+    }
+}
+
+static void test_decompress_payload(void)
+{
+    EMSMessageClass cls;
+    EMSMessage *msg;
+    uint8_t data[64];
+    uint8_t *payload;
+    size_t size;
+
+    memset(&cls, 0, sizeof(EMSMessageClass));
+    cls.size = sizeof(EMSMessage);
+    ems_message_register_type(TEST_MESSAGE, &cls);
+    msg = ems_message_new(TEST_MESSAGE, 0, 0, NULL, NULL);
+
+    /* A 2 GB announcement is refused before allocating. */
+    memset(data, 0, sizeof(data));
+    data[0] = EMS_MESSAGE_COMPRESSOR_LZ;
+    ems_message_write_u32(data, 1, 0x7ffffff0);
+    CHECK(ems_message_decompress_payload(msg, data, 6, 1 << 20, &size) == NULL);
+
+    /* A valid payload passes exactly up to the limit. */
+    data[5] = 0xf0;                 /* 15 literals and more */
+    data[6] = 1;                    /* 16 literals */
+    memset(&data[7], 'x', 16);
+    ems_message_write_u32(data, 1, 16);
+    CHECK(ems_message_decompress_payload(msg, data, 23, 15, &size) == NULL);
+    payload = ems_message_decompress_payload(msg, data, 23, 16, &size);
+    CHECK(payload && size == 16 && memcmp(payload, &data[7], 16) == 0);
+    if (payload)
+        ems_message_release_payload(msg, payload);
+
+    /* The announced size must match. */
+    ems_message_write_u32(data, 1, 17);
+    CHECK(ems_message_decompress_payload(msg, data, 23, 0, &size) == NULL);
+
+    ems_message_unref(msg);
+}
+
+int main(void)
+{
+    static const size_t lengths[] = { 0, 1, 4, 12, 13, 100, 4096, 65536, 70000, 1 << 20 };
+    size_t j;
+
+    ems_init("EMSG");
+
+    for (j = 0; j < sizeof(lengths) / sizeof(lengths[0]); ++j) {
+        test_round_trip(lengths[j], 0);
+        test_round_trip(lengths[j], 1);
+    }
+    test_garbage();
+    test_decompress_payload();
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}
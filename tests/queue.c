@@ -0,0 +1,80 @@
+/* Serving the priorities of the message queue. */
+#include <string.h>
+#include "ems.h"
+#include "check.h"
+
+#define TEST_CONTROL (EMS_MESSAGE_USER + 1)
+#define TEST_BULK    (EMS_MESSAGE_USER + 2)
+#define TEST_OTHER   (EMS_MESSAGE_USER + 3)
+
+static void register_types(void)
+{
+    EMSMessageClass cls;
+
+    memset(&cls, 0, sizeof(EMSMessageClass));
+    cls.size = sizeof(EMSMessage);
+    ems_message_register_type(TEST_CONTROL, &cls);
+    ems_message_register_type(TEST_BULK, &cls);
+    ems_message_register_type(TEST_OTHER, &cls);
+}
+
+static void push(EMSMessageQueue *mq, uint32_t type, EMSMessagePriority priority, size_t count)
+{
+    while (count--)
+        ems_message_queue_push_tail_with_priority(mq, ems_message_new(type, 0, 0, NULL, NULL), priority);
+}
+
+/* Count the messages of type among the next count filtered ones. */
+static size_t pop_filtered(EMSMessageQueue *mq, uint32_t type, size_t count)
+{
+    EMSMessage *msg;
+    size_t found = 0;
+
+    while (count--) {
+        msg = ems_message_queue_pop_filtered(mq);
+        if (!msg)
+            break;
+        if (msg->type == type)
+            ++found;
+        ems_message_unref(msg);
+    }
+    return found;
+}
+
+/* The head of the low level does not match the filter, so serving the starving
+ * level does not unlink its head. It is served once per EMS_MESSAGE_QUEUE_STARVATION_LIMIT
+ * messages of higher priority anyway, not in preference to them. */
+static void test_filtered_starvation(void)
+{
+    EMSMessageQueue mq;
+    size_t n = EMS_MESSAGE_QUEUE_STARVATION_LIMIT;
+
+    ems_message_queue_init(&mq);
+    ems_message_queue_add_filter(&mq, TEST_CONTROL);
+    ems_message_queue_add_filter(&mq, TEST_BULK);
+
+    push(&mq, TEST_OTHER, EMS_MESSAGE_PRIORITY_LOW, 1);
+    push(&mq, TEST_BULK, EMS_MESSAGE_PRIORITY_LOW, 4);
+    push(&mq, TEST_CONTROL, EMS_MESSAGE_PRIORITY_CONTROL, 3 * n);
+
+    CHECK(pop_filtered(&mq, TEST_CONTROL, n) == n);
+    CHECK(pop_filtered(&mq, TEST_BULK, 1) == 1);
+    CHECK(pop_filtered(&mq, TEST_CONTROL, n) == n);
+    CHECK(pop_filtered(&mq, TEST_BULK, 1) == 1);
+    CHECK(pop_filtered(&mq, TEST_CONTROL, n) == n);
+    CHECK(pop_filtered(&mq, TEST_BULK, 2) == 2);
+
+    ems_message_queue_clear(&mq);
+}
+
+int main(void)
+{
+    ems_init("EMSG");
+
+    register_types();
+    test_filtered_starvation();
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}
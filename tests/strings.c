@@ -0,0 +1,66 @@
+/* Setting string members, also to their own value. */
+#include <string.h>
+#include <stddef.h>
+#include "ems.h"
+#include "check.h"
+
+#define TEST_MESSAGE (EMS_MESSAGE_USER + 1)
+
+#define LONG_VALUE "a string too long to be stored inline"
+
+typedef struct {
+    EMSMessage parent;
+    char *string;
+    EMSMessageSmallString small;
+} TestMessage;
+
+static void register_type(void)
+{
+    EMSMessageClass cls;
+
+    memset(&cls, 0, sizeof(EMSMessageClass));
+    cls.size = sizeof(TestMessage);
+    cls.flags = EMS_MESSAGE_CLASS_AUTO_CODEC;
+    ems_message_register_type(TEST_MESSAGE, &cls);
+
+    ems_message_type_add_member(TEST_MESSAGE, EMS_MSG_MEMBER_STRING, 1, "string",
+                                offsetof(TestMessage, string), NULL);
+    ems_message_type_add_member(TEST_MESSAGE, EMS_MSG_MEMBER_SMALL_STRING, 2, "small",
+                                offsetof(TestMessage, small), NULL);
+}
+
+static void test_assign_self(void)
+{
+    TestMessage *msg = (TestMessage *)ems_message_new(TEST_MESSAGE, 0, 0,
+                                                      "string", LONG_VALUE,
+                                                      "small", LONG_VALUE,
+                                                      NULL, NULL);
+
+    ems_message_set((EMSMessage *)msg, "string", msg->string, NULL, NULL);
+    ems_message_set((EMSMessage *)msg, "small", ems_message_small_string_get(&msg->small), NULL, NULL);
+    CHECK(strcmp(msg->string, LONG_VALUE) == 0);
+    CHECK(strcmp(ems_message_small_string_get(&msg->small), LONG_VALUE) == 0);
+
+    /* A suffix of the long value fits inline. */
+    ems_message_set((EMSMessage *)msg, "string", msg->string + 30, NULL, NULL);
+    ems_message_set((EMSMessage *)msg, "small", ems_message_small_string_get(&msg->small) + 30, NULL, NULL);
+    CHECK(strcmp(msg->string, LONG_VALUE + 30) == 0);
+    CHECK(strcmp(ems_message_small_string_get(&msg->small), LONG_VALUE + 30) == 0);
+
+    ems_message_set((EMSMessage *)msg, "small", ems_message_small_string_get(&msg->small) + 1, NULL, NULL);
+    CHECK(strcmp(ems_message_small_string_get(&msg->small), LONG_VALUE + 31) == 0);
+
+    ems_message_unref((EMSMessage *)msg);
+}
+
+int main(void)
+{
+    ems_init("EMSG");
+
+    register_type();
+    test_assign_self();
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,203 @@
+/* Several threads pushing to a message queue or sending through a peer. */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ems.h"
+#include "check.h"
+
+#define TEST_MESSAGE (EMS_MESSAGE_USER + 1)
+
+#define PRODUCERS 4
+#define MESSAGES  20000
+#define BATCH     16
+
+typedef struct {
+    EMSMessageQueue *mq;
+    EMSMessageQueueRing *ring;
+    EMSPeer *peer;
+    uint64_t id;
+    int failed;
+} Producer;
+
+static void register_type(void)
+{
+    EMSMessageClass cls;
+
+    memset(&cls, 0, sizeof(EMSMessageClass));
+    cls.size = sizeof(EMSMessage);
+    ems_message_register_type(TEST_MESSAGE, &cls);
+}
+
+/* The sender is the producer, the recipient the number of the message. */
+static EMSMessage *new_message(Producer *p, uint64_t seq)
+{
+    return ems_message_new(TEST_MESSAGE, seq, p->id, NULL, NULL);
+}
+
+static void *push_tail(Producer *p)
+{
+    uint64_t seq;
+
+    for (seq = 0; seq < MESSAGES; ++seq) {
+        if (ems_message_queue_push_tail(p->mq, new_message(p, seq)) != EMS_OK)
+            p->failed = 1;
+    }
+    return NULL;
+}
+
+static void *push_ring(Producer *p)
+{
+    EMSMessage *msgs[BATCH];
+    uint64_t seq;
+    size_t j;
+
+    for (seq = 0; seq < MESSAGES; seq += BATCH) {
+        for (j = 0; j < BATCH; ++j)
+            msgs[j] = new_message(p, seq + j);
+        if (ems_message_queue_ring_push_many(p->ring, msgs, BATCH) != BATCH)
+            p->failed = 1;
+    }
+    return NULL;
+}
+
+/* Pop all messages the producers push. Each producer's messages have to come in order. */
+static void run_producers(EMSMessageQueue *mq, Producer *producers, void *(*func)(Producer *))
+{
+    pthread_t threads[PRODUCERS];
+    uint64_t next[PRODUCERS];
+    EMSMessage *msg;
+    size_t received = 0, misordered = 0;
+    size_t j;
+
+    for (j = 0; j < PRODUCERS; ++j) {
+        producers[j].mq = mq;
+        producers[j].id = j;
+        producers[j].failed = 0;
+        next[j] = 0;
+        pthread_create(&threads[j], NULL, (void *(*)(void *))func, &producers[j]);
+    }
+
+    while (received < PRODUCERS * MESSAGES) {
+        if ((msg = ems_message_queue_pop_wait(mq, 1000)) == NULL)
+            break;
+        if (msg->sender_id >= PRODUCERS || msg->recipient_id != next[msg->sender_id]++)
+            ++misordered;
+        ++received;
+        ems_message_unref(msg);
+    }
+
+    for (j = 0; j < PRODUCERS; ++j) {
+        pthread_join(threads[j], NULL);
+        CHECK(!producers[j].failed);
+    }
+    CHECK(received == PRODUCERS * MESSAGES);
+    CHECK(misordered == 0);
+    CHECK(ems_message_queue_pop_head(mq) == NULL);
+}
+
+static void test_mpsc(void)
+{
+    EMSMessageQueue mq;
+    Producer producers[PRODUCERS];
+
+    ems_message_queue_init_full(&mq, EMS_MESSAGE_QUEUE_MPSC);
+    run_producers(&mq, producers, push_tail);
+    ems_message_queue_clear(&mq);
+}
+
+static void test_rings(void)
+{
+    EMSMessageQueue mq;
+    Producer producers[PRODUCERS];
+    size_t j;
+
+    ems_message_queue_init(&mq);
+    /* Small rings, so producers also overflow into the queue. */
+    for (j = 0; j < PRODUCERS; ++j)
+        producers[j].ring = ems_message_queue_add_ring(&mq, 64);
+    run_producers(&mq, producers, push_ring);
+    for (j = 0; j < PRODUCERS; ++j)
+        ems_message_queue_remove_ring(&mq, producers[j].ring);
+    ems_message_queue_clear(&mq);
+}
+
+/* Producers wait for the consumer to make room. */
+static void test_block(void)
+{
+    EMSMessageQueue mq;
+    EMSMessageQueueLimits limits;
+    Producer producers[PRODUCERS];
+
+    memset(&limits, 0, sizeof(EMSMessageQueueLimits));
+    limits.max_count = 8;
+    limits.policy = EMS_MESSAGE_QUEUE_BLOCK;
+
+    ems_message_queue_init_full(&mq, EMS_MESSAGE_QUEUE_MPSC);
+    ems_message_queue_set_limits(&mq, &limits);
+    run_producers(&mq, producers, push_tail);
+    ems_message_queue_clear(&mq);
+}
+
+static void *send_messages(Producer *p)
+{
+    EMSMessage *msg;
+    uint64_t seq;
+
+    for (seq = 0; seq < MESSAGES; ++seq) {
+        msg = new_message(p, seq);
+        ems_peer_send_message(p->peer, msg);
+        ems_message_unref(msg);
+    }
+    return NULL;
+}
+
+/* Senders block for the full outgoing queue of a communicator, which is never
+ * connected, until the peer is shut down. */
+static void test_peer_senders(void)
+{
+    EMSPeer *peer = ems_peer_create(EMS_PEER_ROLE_MASTER);
+    EMSMessageQueueLimits limits;
+    Producer producers[PRODUCERS];
+    pthread_t threads[PRODUCERS];
+    size_t j;
+
+    memset(&limits, 0, sizeof(EMSMessageQueueLimits));
+    limits.max_count = 4;
+    limits.policy = EMS_MESSAGE_QUEUE_BLOCK;
+    ems_peer_set_outgoing_limits(peer, &limits);
+    ems_peer_add_communicator(peer, ems_communicator_create(EMS_COMM_TYPE_UNIX,
+                                                            "socket", "/nonexistent/ems-test-socket",
+                                                            "role", EMS_PEER_ROLE_MASTER,
+                                                            NULL, NULL));
+
+    for (j = 0; j < PRODUCERS; ++j) {
+        producers[j].peer = peer;
+        producers[j].id = j;
+        pthread_create(&threads[j], NULL, (void *(*)(void *))send_messages, &producers[j]);
+    }
+    /* Communicators added while sending are picked up by later sends. */
+    ems_peer_add_communicator(peer, ems_communicator_create(EMS_COMM_TYPE_UNIX,
+                                                            "socket", "/nonexistent/ems-test-socket-2",
+                                                            "role", EMS_PEER_ROLE_MASTER,
+                                                            NULL, NULL));
+
+    ems_peer_shutdown(peer);
+    for (j = 0; j < PRODUCERS; ++j)
+        pthread_join(threads[j], NULL);
+    ems_peer_destroy(peer);
+}
+
+int main(void)
+{
+    ems_init("EMSG");
+
+    register_type();
+    test_mpsc();
+    test_rings();
+    test_block();
+    test_peer_senders();
+
+    ems_cleanup();
+
+    return CHECK_RESULT();
+}